@@ -37,28 +37,156 @@
 //2014may04, added a midi controller value detection, values 0-63 record
 //           values 64-127 pause recording
 //
+//2026oct19, added spilog, an asynchronous logging facility. the midi poll,
+//           the main loop and the audio callback now post fixed-size binary
+//           records into per-thread lock-free rings instead of calling
+//           printf()/fflush(), a background thread formats and writes them.
+//
+//2026oct19, added a table driven midi control mapping loaded with
+//           --midimap=file.txt, cc, note and program change rules trigger
+//           pause, resume, toggle, marker, split, stop, arm and disarm.
+//
+//2026oct19, added a posix (pthread) backend for the writer thread with
+//           SCHED_FIFO/SCHED_RR or nice scheduling, cpu pinning of the writer
+//           and midi threads and condition variable start/stop handshakes.
+//
+//2026oct19, added --lockmemory to lock and prefault the ring buffer and the
+//           log rings, --hugepages for huge page backed rings and --ringms.
+//
+//2026oct19, replaced the compile time sample type by --format, --channels
+//           and --encoding, the writer converts in one pass with template
+//           instances per format and channel count, or writes raw samples
+//           when the captured layout is the file's layout.
+//
+//2026oct19, added --control=path, a unix domain control and status socket,
+//           commands reach the audio callback through a lock-free queue and
+//           the keyboard is polled every 20 ms instead of every second.
+//
+//2026oct19, added recording sessions, one process runs any number of
+//           captures (--sessions=file.txt), each with its own stream, ring,
+//           pause state and midi mapping, serviced by a shared pool of
+//           writer threads (--writers=N) picking the fullest ring first.
+//
+//2026oct19, added --writer=gather, both ring regions and the prebuilt wav
+//           header go to the file in one pwritev() call from ring memory.
+//
+//2026oct19, writes are cut on the file's preferred block size, batches
+//           adapt to write latency and ring fill.
+//
+//2026oct19, added --peaks, the writer streams a min/max/rms overview of
+//           256, 4096 and 65536 frame buckets to filename.peak.
+//
+//2026oct19, added --loudness, ebu r128 momentary, short-term, integrated
+//           loudness and true peak measured by the writer.
+//
+//2026oct19, added --spillseconds=N, a preallocated pool of chunks the
+//           callback diverts into when a ring is nearly full.
+//
+//2026oct19, added --mirror=dir1,dir2, each take is also recorded to every
+//           directory, each copy with its own cursor on the ring.
+//
+//2026oct19, added --fanout=pcm16:dither,float:1-2, more encodings of the
+//           same take from the same ring, and --dither for pcm16.
+//
+//2026oct19, portmidi initializes on its own thread while the streams are
+//           opened and started first, startup steps are timed and logged.
+//
+//2026oct19, takes are cut to the frame by the callback, --windows=a-b,c-d
+//           records only inside the given frame, second or clock windows.
+//
+//2026oct19, --metrics=file.prom, ring fill, drops, written bytes, callback
+//           and write duration histograms in the prometheus text format.
+//
+//2026oct19, --selftest=seed drives the callback, ring, writers and final drain
+//           with generated buffers, stalls and pauses, then checks the files.
+//
+//2026oct19, --rate sets the streams' sample rate, --outrate resamples the
+//           files in the writers with a polyphase fir.
+//
+//2026oct19, the file, encoding and midi control change while recording, with
+//           set on the control socket or --config=file.txt, see hot reconfiguration.
+//
+//2026oct19, --matrix=1+2,1-2 mixes the captured channels into the files'
+//           channels in the writers, mono sums, mid/side, fold-downs, picks.
+//
+//2026oct19, --retro=10 records into a circular file of the last 10 minutes,
+//           a save keeps the minutes around it, --retrobefore, --retroafter.
+//
+//2026oct19, the rings count frames, of any capacity, the callback's and the
+//           writers' indexes on their own cache lines, --ringbench times them.
+//
+//2026oct19, --manifest writes the crc32c of each file's blocks next to it,
+//           --verify checks files against them on all the cpus.
+//
+//2026oct19, --takes=N records takes back to back without stopping the stream,
+//           next starts one at once, a finalizer thread syncs the files.
+//
 //nakedsoftware.org, spi@oifii.org or stephane.poirier@oifii.org
 ////////////////////////////////////////////////////////////////
  
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=1) || defined(__SSE__)
+#define SPI_SSE
+#include <xmmintrin.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SPI_CRC32C_HW //the sse4.2 crc32 instruction, when cpuid reports it
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SPI_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define SPI_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
 #include "portaudio.h"
 #include "pa_asio.h"
 #include "pa_ringbuffer.h"
 #include "pa_util.h"
+#include "pa_memorybarrier.h"
 
 #include <sndfile.hh>
 #include <assert.h>
 #include <map>
 #include <string>
+#include <vector>
+#include <new>
 using namespace std;
 
+#include <algorithm>
+
 #ifdef _WIN32
 #include <windows.h>
 #include <process.h>
-#endif
-
 #include <conio.h> //for _kbhit()
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <semaphore.h>
+typedef unsigned char boolean;
+#endif
 
 #include "porttime.h"
 #include "portmidi.h"
@@ -76,28 +204,8 @@ using namespace std;
  
 
 
-/* Select sample format. */
-#if 1
-#define PA_SAMPLE_TYPE  paFloat32
-typedef float SAMPLE;
-#define SAMPLE_SILENCE  (0.0f)
-#define PRINTF_S_FORMAT "%.8f"
-#elif 1
-#define PA_SAMPLE_TYPE  paInt16
-typedef short SAMPLE;
-#define SAMPLE_SILENCE  (0)
-#define PRINTF_S_FORMAT "%d"
-#elif 0
-#define PA_SAMPLE_TYPE  paInt8
-typedef char SAMPLE;
-#define SAMPLE_SILENCE  (0)
-#define PRINTF_S_FORMAT "%d"
-#else
-#define PA_SAMPLE_TYPE  paUInt8
-typedef unsigned char SAMPLE;
-#define SAMPLE_SILENCE  (128)
-#define PRINTF_S_FORMAT "%d"
-#endif
+/* Sample format, channel count and file encoding are runtime options, see the sample format pipeline. */
+#define MAX_CHANNELS    (32)
  
 #define STRING_MAX 80
 
@@ -137,31 +245,45 @@ typedef unsigned char SAMPLE;
 
 #define private static
 
+#ifdef _WIN32
 //The event signaled when the app should be terminated.
 HANDLE g_hTerminateEvent = NULL;
 //Handles events that would normally terminate a console application. 
 BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType);
+#else
+//SIGINT/SIGTERM only request the stop, main() terminates
+void SignalHandler(int signum);
+#endif
 
 int Terminate();
-string global_filename;
+void DispatchMidiInput(int midiinput, PmMessage message);
+void SelfTestStall();
 map<string,int> global_devicemap;
-PaStreamParameters global_inputParameters;
 PaError global_err;
-string global_audiodevicename;
-int global_inputAudioChannelSelectors[2];
-PaAsioStreamInfo global_asioInputInfo;
 
-bool global_pauserecording=false;
+PaSampleFormat global_sampleformat = paFloat32; //as captured and kept in the ring, --format
+int global_samplebytes = 4;
+int global_numchannels = NUM_CHANNELS; //--channels
+int global_samplerate = SAMPLE_RATE; //--rate, the streams'
+int global_filerate = SAMPLE_RATE; //--outrate, the files', see sample rate conversion
+int global_routedchannels = 0; //--matrix outputs, 0 writes the captured channels, see routing matrix
+int global_fileformat = SF_FORMAT_PCM_16; //--encoding, the container follows each session's file extension
+volatile bool global_stoprequested = false; //stops every session
+bool global_selftest = false; //--selftest, no audio device, see self test
+map<string,string> global_options; //named arguments, --name=value or --name, see ParseNamedOptions()
 
 
-PmStream* global_pPmStreamMIDIIN;      // midi input 
-boolean global_active = false;     // set when global_pPmStreamMIDIIN is ready for reading 
-int global_inputmidideviceid = -1; //alesis q49 midi port id (when midi yoke installed)
+#define MAX_MIDI_INPUTS (16)
+typedef struct
+{
+	PmStream* stream;
+	int deviceid;
+	string name; //"In From MIDI Yoke:  1", "In From MIDI Yoke:  2", ... , "In From MIDI Yoke:  8"
+} SpiMidiInput;
+SpiMidiInput global_midiinputs[MAX_MIDI_INPUTS]; //opened once, shared by the sessions naming the same device
+int global_nummidiinputs = 0;
+boolean global_active = false;     // set when the midi inputs are ready for reading 
 map<string,int> global_inputmididevicemap;
-string global_inputmididevicename = ""; //"In From MIDI Yoke:  1", "In From MIDI Yoke:  2", ... , "In From MIDI Yoke:  8"
-int global_midichannelid=0; //0 for midi channel 1, etc.
-int global_midictrlnumber=64; //midi control number between 0 and 127
-bool global_receivemidi=false;
 
 int debug = false;	// never set, but referenced by userio.c 
 boolean in_sysex = false;   // we are reading a sysex message 
@@ -189,538 +311,7501 @@ char val_format[] = "    Val %d\n";
 
 
 ///////////////////////////////////////////////////////////////////////////////
-//    Routines local to this module
+//    portable threads
+//
+// win32 uses _beginthreadex() and SetThreadPriority(), posix uses pthreads
+// with SCHED_FIFO/SCHED_RR or a nice level. both can pin a thread to a set
+// of cpus (the first 64). a thread that can't get the requested scheduling
+// keeps running with the default one, the failure is reported.
 ///////////////////////////////////////////////////////////////////////////////
 
-//private    void    mmexit(int code);
-private void output(PmMessage data);
-private int  put_pitch(int p);
-private void showhelp();
-private void showbytes(PmMessage data, int len, boolean newline);
-private void showstatus(boolean flag);
-private void doascii(char c);
-private int  get_number(char *prompt);
+typedef int (*ThreadFunctionType)(void*);
 
+enum { SPITHREAD_DEFAULT = 0, SPITHREAD_FIFO, SPITHREAD_RR, SPITHREAD_NICE };
 
-// read a number from console
-//
-int get_number(char *prompt)
+typedef struct
 {
-    char line[STRING_MAX];
-    int n = 0, i;
-    printf(prompt);
-    while (n != 1) {
-        n = scanf("%d", &i);
-        fgets(line, STRING_MAX, stdin);
+	int policy; //SPITHREAD_DEFAULT, SPITHREAD_FIFO, SPITHREAD_RR or SPITHREAD_NICE
+	int priority; //realtime priority for fifo/rr, nice value for nice
+	unsigned long long cpumask; //bit n pins to cpu n, 0 for no pinning
+	const char* name; //for reporting only
+} SpiThreadConfig;
 
-    }
-    return i;
-}
+SpiThreadConfig global_writerthreadconfig = { SPITHREAD_DEFAULT, 0, 0, "writer" }; //--writerpriority=fifo:70, --writercpus=2,3
+SpiThreadConfig global_midithreadconfig = { SPITHREAD_DEFAULT, 0, 0, "midi" }; //--midicpus=1
 
+// "fifo:70", "rr:50" or "nice:-10"
+bool ParseThreadPriority(const char* text, SpiThreadConfig* pConfig)
+{
+	const char* colon = strchr(text, ':');
+	if(colon==NULL) return false;
+	string policy(text, colon-text);
+	if(policy=="fifo") pConfig->policy = SPITHREAD_FIFO;
+	else if(policy=="rr") pConfig->policy = SPITHREAD_RR;
+	else if(policy=="nice") pConfig->policy = SPITHREAD_NICE;
+	else return false;
+	pConfig->priority = atoi(colon+1);
+	return true;
+}
 
-void receive_poll(PtTimestamp timestamp, void *userData)
+// "2,3" or "4-7,9"
+bool ParseCpuList(const char* text, SpiThreadConfig* pConfig)
 {
-    PmEvent event;
-    int count; 
-    if (!global_active) return;
-    while ((count = Pm_Read(global_pPmStreamMIDIIN, &event, 1))) 
+	unsigned long long mask = 0;
+	const char* p = text;
+	while(*p)
 	{
-        if (count == 1) 
+		char* end;
+		long first = strtol(p, &end, 10);
+		if(end==p || first<0 || first>63) return false;
+		long last = first;
+		p = end;
+		if(*p=='-')
 		{
-			//1) output message
-			//output(event.message);
-
-			//2) if cc value 0-63, keep recording
-			//   else if cc value 64-127 pause recording
-			int msgstatus = Pm_MessageStatus(event.message);
-			//if( msgstatus>=MIDI_CTRL && msgstatus<(MIDI_CTRL+16) )
-			if( (msgstatus-MIDI_CTRL)==global_midichannelid )
-			{
-				int ctrlnumber = Pm_MessageData1(event.message);
-				if(ctrlnumber==global_midictrlnumber)
-				{
-					int ctrlvalue = Pm_MessageData2(event.message);
-					if(ctrlvalue>=0 && ctrlvalue<64)
-					{
-						global_pauserecording=false; //keep recording
-						printf("unpause via midi\n"); fflush(stdout);
-					}
-					else
-					{
-						global_pauserecording=true; //pause recording
-						printf("pause via midi\n"); fflush(stdout);
-					}
-				}
-			}
-		}
-        else            
-		{
-			printf(Pm_GetErrorText((PmError)count)); //spi a cast as (PmError)
+			last = strtol(p+1, &end, 10);
+			if(end==p+1 || last<first || last>63) return false;
+			p = end;
 		}
-    }
+		for(long cpu=first; cpu<=last; cpu++) mask |= (1ULL<<cpu);
+		if(*p==',') p++;
+		else if(*p) return false;
+	}
+	pConfig->cpumask = mask;
+	return mask!=0;
 }
 
-
-bool SelectAudioDevice()
+// Pin the calling thread, used for threads we don't create ourselves (porttime's midi thread)
+bool SpiApplyThreadAffinity(const SpiThreadConfig* pConfig)
 {
-	const PaDeviceInfo* deviceInfo;
-    int numDevices = Pa_GetDeviceCount();
-    for( int i=0; i<numDevices; i++ )
-    {
-        deviceInfo = Pa_GetDeviceInfo( i );
-		string devicenamestring = deviceInfo->name;
-		global_devicemap.insert(pair<string,int>(devicenamestring,i));
+	if(pConfig==NULL || pConfig->cpumask==0) return true;
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)pConfig->cpumask)!=0;
+#elif defined(__linux__)
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	for(int cpu=0; cpu<64; cpu++)
+	{
+		if(pConfig->cpumask & (1ULL<<cpu)) CPU_SET(cpu, &cpuset);
 	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)==0;
+#else
+	return false; //no affinity api
+#endif
+}
 
-	int deviceid = Pa_GetDefaultInputDevice(); // default input device 
-	map<string,int>::iterator it;
-	it = global_devicemap.find(global_audiodevicename);
-	if(it!=global_devicemap.end())
+#ifndef _WIN32
+typedef struct
+{
+	ThreadFunctionType fn;
+	void* arg;
+	SpiThreadConfig config;
+} SpiThreadStart;
+
+// Apply scheduling and affinity from inside the new thread (a nice level is per thread on linux only from there)
+static void* SpiThreadTrampoline(void* ptr)
+{
+	SpiThreadStart start = *(SpiThreadStart*)ptr;
+	delete (SpiThreadStart*)ptr;
+	if(start.config.policy==SPITHREAD_FIFO || start.config.policy==SPITHREAD_RR)
 	{
-		deviceid = (*it).second;
-		printf("%s maps to %d\n", global_audiodevicename.c_str(), deviceid);
-		deviceInfo = Pa_GetDeviceInfo(deviceid);
-		//assert(inputAudioChannelSelectors[0]<deviceInfo->maxInputChannels);
-		//assert(inputAudioChannelSelectors[1]<deviceInfo->maxInputChannels);
+		int policy = (start.config.policy==SPITHREAD_FIFO) ? SCHED_FIFO : SCHED_RR;
+		struct sched_param param;
+		param.sched_priority = max(sched_get_priority_min(policy), min(sched_get_priority_max(policy), start.config.priority));
+		int result = pthread_setschedparam(pthread_self(), policy, &param);
+		if(result!=0) fprintf(stderr, "warning, %s thread can't get realtime priority %d (%s), using default scheduling\n", start.config.name, param.sched_priority, strerror(result));
 	}
-	else
+	else if(start.config.policy==SPITHREAD_NICE)
 	{
-		for(it=global_devicemap.begin(); it!=global_devicemap.end(); it++)
-		{
-			printf("%s maps to %d\n", (*it).first.c_str(), (*it).second);
-		}
-		//Pa_Terminate();
-		//return -1;
-		printf("error, audio device not found, will use default\n");
-		deviceid = Pa_GetDefaultInputDevice();
+		if(setpriority(PRIO_PROCESS, 0, start.config.priority)!=0) fprintf(stderr, "warning, %s thread can't set nice level %d (%s)\n", start.config.name, start.config.priority, strerror(errno));
+	}
+	if(!SpiApplyThreadAffinity(&start.config)) fprintf(stderr, "warning, %s thread can't be pinned to the requested cpus\n", start.config.name);
+	start.fn(start.arg);
+	return NULL;
+}
+#endif
+
+// Create a running thread, returns NULL on failure
+void* SpiCreateThread(ThreadFunctionType fn, void* arg, const SpiThreadConfig* pConfig)
+{
+	SpiThreadConfig defaultconfig = { SPITHREAD_DEFAULT, 0, 0, "worker" };
+	if(pConfig==NULL) pConfig = &defaultconfig;
+#ifdef _WIN32
+    typedef unsigned (__stdcall* WinThreadFunctionType)(void*);
+    void* handle = (void*)_beginthreadex(NULL, 0, (WinThreadFunctionType)fn, arg, CREATE_SUSPENDED, NULL);
+    if (handle == NULL) return NULL;
+	int priority = THREAD_PRIORITY_ABOVE_NORMAL; //a little higher prio than normal
+	if(pConfig->policy==SPITHREAD_FIFO || pConfig->policy==SPITHREAD_RR) priority = THREAD_PRIORITY_TIME_CRITICAL;
+	else if(pConfig->policy==SPITHREAD_NICE) priority = (pConfig->priority<=-10) ? THREAD_PRIORITY_HIGHEST : (pConfig->priority<0) ? THREAD_PRIORITY_ABOVE_NORMAL : (pConfig->priority==0) ? THREAD_PRIORITY_NORMAL : THREAD_PRIORITY_BELOW_NORMAL;
+    SetThreadPriority(handle, priority);
+	if(pConfig->cpumask!=0 && SetThreadAffinityMask(handle, (DWORD_PTR)pConfig->cpumask)==0) fprintf(stderr, "warning, %s thread can't be pinned to the requested cpus\n", pConfig->name);
+    ResumeThread(handle);
+	return handle;
+#else
+	SpiThreadStart* pStart = new SpiThreadStart;
+	pStart->fn = fn;
+	pStart->arg = arg;
+	pStart->config = *pConfig;
+	pthread_t* pThread = new pthread_t;
+	if(pthread_create(pThread, NULL, SpiThreadTrampoline, pStart)!=0)
+	{
+		delete pStart;
+		delete pThread;
+		return NULL;
 	}
+	return pThread;
+#endif
+}
+
+// Wait for a thread created by SpiCreateThread() to return and release it
+void SpiJoinThread(void* handle)
+{
+	if(handle==NULL) return;
+#ifdef _WIN32
+	WaitForSingleObject(handle, INFINITE);
+	CloseHandle(handle);
+#else
+	pthread_join(*(pthread_t*)handle, NULL);
+	delete (pthread_t*)handle;
+#endif
+}
+
+// Seconds from an arbitrary origin, usable before Pa_Initialize
+static double SpiGetSeconds()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec * 1e-6;
+#endif
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    locked memory
+//
+// with --lockmemory, buffers touched by the audio callback and the writer are
+// locked in ram (mlock()/VirtualLock()) and prefaulted at startup so that no
+// first touch can page-fault on the audio thread. with --hugepages, buffers
+// of at least one huge page are backed by explicit huge pages when the system
+// has some reserved (MAP_HUGETLB, MEM_LARGE_PAGES), else by transparent huge
+// pages where available. without either option this is PaUtil_AllocateMemory().
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAX_MEMORY_BLOCKS (448)
+#define HUGE_PAGE_BYTES (2*1024*1024)
+
+enum { SPIMEMORY_PAUTIL = 0, SPIMEMORY_PAGES, SPIMEMORY_HUGEPAGES };
+
+typedef struct
+{
+	void* ptr;
+	size_t size; //as mapped, rounded up to the page size
+	int method;
+	bool locked;
+} SpiMemoryBlock;
 
+bool global_lockmemory = false;
+bool global_hugepages = false;
+SpiMemoryBlock global_memoryblocks[MAX_MEMORY_BLOCKS];
+int global_nummemoryblocks = 0;
+size_t global_lockedbytes = 0;
 
-	global_inputParameters.device = deviceid; 
-	if (global_inputParameters.device == paNoDevice) 
+static size_t SpiPageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO systeminfo;
+	GetSystemInfo(&systeminfo);
+	return systeminfo.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Lock and prefault memory we don't own (static buffers), reports the outcome
+bool SpiLockMemory(void* ptr, size_t size, const char* what)
+{
+#ifdef _WIN32
+	SIZE_T minimumsize, maximumsize;
+	if(GetProcessWorkingSetSize(GetCurrentProcess(), &minimumsize, &maximumsize))
 	{
-		fprintf(stderr,"Error: No default input device.\n");
-		//goto error;
-		Pa_Terminate();
-		fprintf( stderr, "An error occured while using the portaudio stream\n" );
-		fprintf( stderr, "Error number: %d\n", global_err );
-		fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( global_err ) );
-		return Terminate();
+		SetProcessWorkingSetSize(GetCurrentProcess(), minimumsize+size, maximumsize+size);
 	}
-	global_inputParameters.channelCount = 2;
-	global_inputParameters.sampleFormat =  PA_SAMPLE_TYPE;
-	global_inputParameters.suggestedLatency = Pa_GetDeviceInfo( global_inputParameters.device )->defaultLowOutputLatency;
-	//inputParameters.hostApiSpecificStreamInfo = NULL;
+	bool locked = VirtualLock(ptr, size)!=0;
+	if(!locked) printf("warning, can't lock %lu bytes of %s in memory (error %lu)\n", (unsigned long)size, what, (unsigned long)GetLastError());
+#else
+	bool locked = mlock(ptr, size)==0;
+	if(!locked)
+	{
+		struct rlimit limit;
+		getrlimit(RLIMIT_MEMLOCK, &limit);
+		printf("warning, can't lock %lu bytes of %s in memory (%s, RLIMIT_MEMLOCK is %lu bytes)\n", (unsigned long)size, what, strerror(errno), (unsigned long)limit.rlim_cur);
+	}
+#endif
+	//prefault, every page gets written once now rather than on first use
+	size_t pagesize = SpiPageSize();
+	for(size_t offset=0; offset<size; offset+=pagesize) ((volatile char*)ptr)[offset] = ((volatile char*)ptr)[offset];
+	if(locked) global_lockedbytes += size;
+	return locked;
+}
 
-	//Use an ASIO specific structure. WARNING - this is not portable. 
-	//PaAsioStreamInfo asioInputInfo;
-	global_asioInputInfo.size = sizeof(PaAsioStreamInfo);
-	global_asioInputInfo.hostApiType = paASIO;
-	global_asioInputInfo.version = 1;
-	global_asioInputInfo.flags = paAsioUseChannelSelectors;
-	global_asioInputInfo.channelSelectors = global_inputAudioChannelSelectors;
-	if(deviceid==Pa_GetDefaultInputDevice())
+// Allocate a zeroed buffer, locked, prefaulted and huge page backed as requested
+void* SpiAllocateMemory(size_t size, const char* what)
+{
+	if(!global_lockmemory && !global_hugepages)
 	{
-		global_inputParameters.hostApiSpecificStreamInfo = NULL;
+		void* ptr = PaUtil_AllocateMemory((long)size);
+		if(ptr) memset(ptr, 0, size);
+		return ptr;
 	}
-	else if(Pa_GetHostApiInfo(Pa_GetDeviceInfo(deviceid)->hostApi)->type == paASIO) 
+	if(global_nummemoryblocks>=MAX_MEMORY_BLOCKS) return NULL;
+
+	SpiMemoryBlock block = { NULL, 0, SPIMEMORY_PAGES, false };
+	size_t pagesize = SpiPageSize();
+	block.size = (size + pagesize - 1) / pagesize * pagesize;
+	if(global_hugepages && size>=HUGE_PAGE_BYTES)
 	{
-		global_inputParameters.hostApiSpecificStreamInfo = &global_asioInputInfo;
+#ifdef _WIN32
+		SIZE_T largepagesize = GetLargePageMinimum();
+		if(largepagesize!=0)
+		{
+			SIZE_T largesize = (size + largepagesize - 1) / largepagesize * largepagesize;
+			block.ptr = VirtualAlloc(NULL, largesize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if(block.ptr)
+			{
+				block.size = largesize;
+				block.method = SPIMEMORY_HUGEPAGES;
+				block.locked = true; //large pages are never paged out
+			}
+		}
+#elif defined(MAP_HUGETLB)
+		size_t hugesize = (size + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+		block.ptr = mmap(NULL, hugesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(block.ptr==MAP_FAILED) block.ptr = NULL;
+		if(block.ptr)
+		{
+			block.size = hugesize;
+			block.method = SPIMEMORY_HUGEPAGES;
+		}
+#endif
+		if(block.ptr==NULL) printf("no explicit huge pages for %s, ", what);
 	}
-	else if(Pa_GetHostApiInfo(Pa_GetDeviceInfo(deviceid)->hostApi)->type == paWDMKS) 
+	if(block.ptr==NULL)
 	{
-		global_inputParameters.hostApiSpecificStreamInfo = NULL;
+#ifdef _WIN32
+		block.ptr = VirtualAlloc(NULL, block.size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+		if(global_hugepages && size>=HUGE_PAGE_BYTES) block.size = (size + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+		block.ptr = mmap(NULL, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(block.ptr==MAP_FAILED) block.ptr = NULL;
+#ifdef MADV_HUGEPAGE
+		if(block.ptr && global_hugepages && size>=HUGE_PAGE_BYTES && madvise(block.ptr, block.size, MADV_HUGEPAGE)==0)
+		{
+			printf("using transparent huge pages for %s, ", what);
+		}
+#endif
+#endif
+		if(block.ptr==NULL) return NULL;
 	}
+
+	if(global_lockmemory && !block.locked) block.locked = SpiLockMemory(block.ptr, block.size, what);
 	else
 	{
-		//assert(false);
-		global_inputParameters.hostApiSpecificStreamInfo = NULL;
+		for(size_t offset=0; offset<block.size; offset+=pagesize) ((volatile char*)block.ptr)[offset] = 0;
+		if(block.locked) global_lockedbytes += block.size;
 	}
-	return true;
+	printf("%lu bytes allocated for %s%s%s\n", (unsigned long)block.size, what,
+		(block.method==SPIMEMORY_HUGEPAGES) ? ", huge pages" : "", block.locked ? ", locked" : "");
+	global_memoryblocks[global_nummemoryblocks++] = block;
+	return block.ptr;
+}
+
+void SpiFreeMemory(void* ptr)
+{
+	if(ptr==NULL) return;
+	for(int i=0; i<global_nummemoryblocks; i++)
+	{
+		SpiMemoryBlock block = global_memoryblocks[i];
+		if(block.ptr!=ptr) continue;
+#ifdef _WIN32
+		if(block.locked && block.method!=SPIMEMORY_HUGEPAGES) VirtualUnlock(block.ptr, block.size);
+		VirtualFree(block.ptr, 0, MEM_RELEASE);
+#else
+		if(block.locked) munlock(block.ptr, block.size);
+		munmap(block.ptr, block.size);
+#endif
+		if(block.locked) global_lockedbytes -= block.size;
+		global_memoryblocks[i] = global_memoryblocks[--global_nummemoryblocks];
+		return;
+	}
+	PaUtil_FreeMemory(ptr);
 }
 
 
- 
-typedef struct
+///////////////////////////////////////////////////////////////////////////////
+//    spilog, asynchronous logging for the time critical paths
+//
+// producers never format nor touch stdio, they post a fixed-size binary
+// record (format pointer plus up to SPILOG_MAX_ARGS typed arguments) into
+// a ring owned by the posting thread. the spilog thread merges the rings in
+// posting order, formats the records and writes them out in batches. when
+// a ring is full the record is dropped and counted, never waited for.
+//
+// the format string must have static lifetime (only its pointer is kept),
+// string arguments are copied into the record.
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(_MSC_VER) && (_MSC_VER < 1900)
+#define snprintf _snprintf
+#endif
+
+#ifdef _WIN32
+#define SPI_THREAD_LOCAL __declspec(thread)
+#define SpiAtomicIncrement(p) ((unsigned)InterlockedIncrement((volatile LONG*)(p)))
+#define SpiAtomicCompareAndSwap(p, oldvalue, newvalue) ((unsigned)InterlockedCompareExchange((volatile LONG*)(p), (LONG)(newvalue), (LONG)(oldvalue))==(unsigned)(oldvalue))
+#else
+#define SPI_THREAD_LOCAL __thread
+#define SpiAtomicIncrement(p) ((unsigned)__sync_add_and_fetch((p), 1))
+#define SpiAtomicCompareAndSwap(p, oldvalue, newvalue) __sync_bool_compare_and_swap((p), (oldvalue), (newvalue))
+#endif
+
+// Indices and flags another thread polls: the release store publishes what
+// was written before it to the acquire load that sees it. gcc and clang use
+// the atomic builtins, which -fsanitize=thread understands, msvc's volatile
+// accesses have these semantics already (/volatile:ms, x86 and x64).
+#ifdef __GNUC__
+#define SpiLoadAcquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SpiStoreRelease(p, value) __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#else
+#define SpiLoadAcquire(p) (*(p))
+#define SpiStoreRelease(p, value) (*(p) = (value))
+#endif
+
+// Sample positions and counters are 64-bit so they never wrap, other threads
+// load and store them whole, also on the 32-bit x86 build
+#ifdef _WIN32
+static long long SpiAtomicLoad64(const volatile long long* p)
 {
-    unsigned            frameIndex;
-    int                 threadSyncFlag;
-    SAMPLE             *ringBufferData;
-    PaUtilRingBuffer    ringBuffer;
-    FILE               *file;
-    void               *threadHandle;
+	return InterlockedCompareExchange64((volatile LONGLONG*)p, 0, 0);
 }
- 
-paTestData;
- 
-bool AppendWavFile(const char* filename, const void* pVoid, long sizeelementinbytes, long count)
+
+static void SpiAtomicStore64(volatile long long* p, long long value)
 {
-	assert(filename);
-	assert(sizeelementinbytes==4);
-    const int format=SF_FORMAT_WAV | SF_FORMAT_PCM_16;  
-    //const int format=SF_FORMAT_W64 | SF_FORMAT_PCM_16;  
-	//const int format=SF_FORMAT_WAV | SF_FORMAT_FLOAT;  
-    //const int format=SF_FORMAT_WAV | SF_FORMAT_PCM_24;  
-    //const int format=SF_FORMAT_WAV | SF_FORMAT_PCM_32;  
-	//SndfileHandle outfile(filename, SFM_WRITE, format, numChannels, SampleRate); 
-
-	SndfileHandle outfile(filename, SFM_RDWR, format, NUM_CHANNELS, SAMPLE_RATE); 
-	//SndfileHandle outfile(filename, SFM_RDWR, format, 1, SAMPLE_RATE); 
-	outfile.seek(outfile.frames(), SEEK_SET);
-	/*
-	if(frameIndex==0)
-	{
-		outfile.write(pSamples, numSamples);  
-	}
-	else
+	long long seen = *p;
+	for(;;)
 	{
-		assert(frameIndex<=totalFrames);
-		outfile.write(pSamples, frameIndex*NUM_CHANNELS); 
+		long long previous = InterlockedCompareExchange64((volatile LONGLONG*)p, value, seen);
+		if(previous==seen) break;
+		seen = previous;
 	}
-	*/
-	outfile.write((const float*)pVoid, count); 
-	return true;
 }
+#else
+static long long SpiAtomicLoad64(const volatile long long* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static void SpiAtomicStore64(volatile long long* p, long long value) { __atomic_store_n(p, value, __ATOMIC_RELEASE); }
+#endif
+
+#define SPILOG_MAX_THREADS    (96) //a ring per thread for good: the callbacks of MAX_SESSIONS, MAX_WRITERS and the rest
+#define SPILOG_RING_RECORDS   (256) //must be a power of 2
+#define SPILOG_MAX_ARGS       (4)
+#define SPILOG_STRING_BYTES   (64)
+#define SPILOG_BATCH_BYTES    (16384)
+#define SPILOG_FLUSH_MS       (10)
 
-// This routine is run in a separate thread to write data from the ring buffer into a wav file (during Recording)
-static int threadFunctionWriteToWavFile(void* ptr)
+enum { SPILOG_ARG_INT, SPILOG_ARG_UINT, SPILOG_ARG_DOUBLE, SPILOG_ARG_STRING, SPILOG_ARG_POINTER };
+
+typedef struct
 {
-    paTestData* pData = (paTestData*)ptr;
- 
-    // Mark thread started  
-    pData->threadSyncFlag = 0;
- 
-    while (1)
+    int type;
+    union
     {
-        ring_buffer_size_t elementsInBuffer = PaUtil_GetRingBufferReadAvailable(&pData->ringBuffer);
-        if ( (elementsInBuffer >= pData->ringBuffer.bufferSize / NUM_WRITES_PER_BUFFER) ||
-             pData->threadSyncFlag )
-        {
-            void* ptr[2] = {0};
-            ring_buffer_size_t sizes[2] = {0};
- 
-            /* By using PaUtil_GetRingBufferReadRegions, we can read directly from the ring buffer */
-            ring_buffer_size_t elementsRead = PaUtil_GetRingBufferReadRegions(&pData->ringBuffer, elementsInBuffer, ptr + 0, sizes + 0, ptr + 1, sizes + 1);
-            if (elementsRead > 0)
-            {
-                int i;
-                for (i = 0; i < 2 && ptr[i] != NULL; ++i)
-                {
-                    //fwrite(ptr[i], pData->ringBuffer.elementSizeBytes, sizes[i], pData->file);
-					AppendWavFile(global_filename.c_str(), ptr[i], pData->ringBuffer.elementSizeBytes, sizes[i]);
-                }
-                PaUtil_AdvanceRingBufferReadIndex(&pData->ringBuffer, elementsRead);
-            }
- 
-            if (pData->threadSyncFlag)
-            {
-                break;
-            }
-        }
- 
-        /* Sleep a little while... */
-        Pa_Sleep(20);
- 
-    }
- 
-    pData->threadSyncFlag = 0;
-    return 0;
-}
+        long long           i;
+        unsigned long long  u;
+        double              d;
+        const void         *p;
+    } value;
+} SpiLogArg;
 
-/* This routine is run in a separate thread to write data from the ring buffer into a file (during Recording) */ 
-static int threadFunctionWriteToRawFile(void* ptr)
+typedef struct
 {
-    paTestData* pData = (paTestData*)ptr;
- 
-    /* Mark thread started */ 
-    pData->threadSyncFlag = 0;
- 
-    while (1)
+    unsigned            sequence;
+    const char         *format;
+    int                 numArgs;
+    SpiLogArg           args[SPILOG_MAX_ARGS];
+    char                strings[SPILOG_STRING_BYTES]; //string args are stored here, value.u is the offset
+} SpiLogRecord;
+
+typedef struct
+{
+    volatile unsigned   writeIndex;
+    char                pad0[60]; //keep producer and consumer indexes on their own cache line
+    volatile unsigned   readIndex;
+    char                pad1[60];
+    volatile unsigned   dropped; //incremented by the producer only
+    unsigned            droppedReported; //consumer only
+    SpiLogRecord        records[SPILOG_RING_RECORDS];
+} SpiLogRing;
+
+static SpiLogRing spilog_rings[SPILOG_MAX_THREADS];
+static SpiLogRing spilog_overflowRing; //never holds records, counts posts from threads beyond SPILOG_MAX_THREADS
+static volatile unsigned spilog_numRings = 0;
+static volatile unsigned spilog_sequence = 0;
+static SPI_THREAD_LOCAL SpiLogRing* spilog_threadRing = NULL;
+static volatile int spilog_threadSyncFlag = 0;
+static void* spilog_threadHandle = NULL;
+static FILE* spilog_file = NULL; //stdout unless redirected
+
+static SpiLogArg SpiLogArgOf(int v) { SpiLogArg a; a.type = SPILOG_ARG_INT; a.value.i = v; return a; }
+static SpiLogArg SpiLogArgOf(long v) { SpiLogArg a; a.type = SPILOG_ARG_INT; a.value.i = v; return a; }
+static SpiLogArg SpiLogArgOf(long long v) { SpiLogArg a; a.type = SPILOG_ARG_INT; a.value.i = v; return a; }
+static SpiLogArg SpiLogArgOf(unsigned v) { SpiLogArg a; a.type = SPILOG_ARG_UINT; a.value.u = v; return a; }
+static SpiLogArg SpiLogArgOf(unsigned long v) { SpiLogArg a; a.type = SPILOG_ARG_UINT; a.value.u = v; return a; }
+static SpiLogArg SpiLogArgOf(unsigned long long v) { SpiLogArg a; a.type = SPILOG_ARG_UINT; a.value.u = v; return a; }
+static SpiLogArg SpiLogArgOf(double v) { SpiLogArg a; a.type = SPILOG_ARG_DOUBLE; a.value.d = v; return a; }
+static SpiLogArg SpiLogArgOf(const char* v) { SpiLogArg a; a.type = SPILOG_ARG_STRING; a.value.p = v; return a; }
+static SpiLogArg SpiLogArgOf(const string& v) { return SpiLogArgOf(v.c_str()); }
+static SpiLogArg SpiLogArgOf(const void* v) { SpiLogArg a; a.type = SPILOG_ARG_POINTER; a.value.p = v; return a; }
+
+// Post one record from the calling thread, never blocks, never allocates.
+static void SpiLog_Post(const char* format, int numArgs, const SpiLogArg* args)
+{
+    SpiLogRing* pRing = spilog_threadRing;
+    if (pRing == NULL)
     {
-        ring_buffer_size_t elementsInBuffer = PaUtil_GetRingBufferReadAvailable(&pData->ringBuffer);
-        if ( (elementsInBuffer >= pData->ringBuffer.bufferSize / NUM_WRITES_PER_BUFFER) ||
-             pData->threadSyncFlag )
-        {
-            void* ptr[2] = {0};
-            ring_buffer_size_t sizes[2] = {0};
+        unsigned ringIndex = SpiAtomicIncrement(&spilog_numRings) - 1;
+        pRing = (ringIndex < SPILOG_MAX_THREADS) ? &spilog_rings[ringIndex] : &spilog_overflowRing;
+        spilog_threadRing = pRing;
+    }
+    if (pRing == &spilog_overflowRing)
+    {
+        (void)SpiAtomicIncrement(&spilog_overflowRing.dropped);
+        return;
+    }
+
+    unsigned writeIndex = pRing->writeIndex;
+    if (writeIndex - SpiLoadAcquire(&pRing->readIndex) >= SPILOG_RING_RECORDS)
+    {
+        SpiStoreRelease(&pRing->dropped, pRing->dropped + 1);
+        return;
+    }
+    SpiLogRecord* pRecord = &pRing->records[writeIndex & (SPILOG_RING_RECORDS - 1)];
+    pRecord->format = format;
+    pRecord->numArgs = numArgs;
+    unsigned stringOffset = 0;
+    for (int i = 0; i < numArgs; i++)
+    {
+        pRecord->args[i] = args[i];
+        if (args[i].type == SPILOG_ARG_STRING)
+        {
+            const char* src = args[i].value.p ? (const char*)args[i].value.p : "(null)";
+            pRecord->args[i].value.u = stringOffset;
+            while (*src && stringOffset < SPILOG_STRING_BYTES - 1) pRecord->strings[stringOffset++] = *src++;
+            if (stringOffset < SPILOG_STRING_BYTES) pRecord->strings[stringOffset++] = '\0';
+            else pRecord->strings[SPILOG_STRING_BYTES - 1] = '\0';
+        }
+    }
+    pRecord->sequence = SpiAtomicIncrement(&spilog_sequence);
+    PaUtil_WriteMemoryBarrier();
+    SpiStoreRelease(&pRing->writeIndex, writeIndex + 1);
+}
+
+static void SpiLog(const char* format)
+{
+    SpiLog_Post(format, 0, NULL);
+}
+template<typename A> void SpiLog(const char* format, A a)
+{
+    SpiLogArg args[1] = { SpiLogArgOf(a) };
+    SpiLog_Post(format, 1, args);
+}
+template<typename A, typename B> void SpiLog(const char* format, A a, B b)
+{
+    SpiLogArg args[2] = { SpiLogArgOf(a), SpiLogArgOf(b) };
+    SpiLog_Post(format, 2, args);
+}
+template<typename A, typename B, typename C> void SpiLog(const char* format, A a, B b, C c)
+{
+    SpiLogArg args[3] = { SpiLogArgOf(a), SpiLogArgOf(b), SpiLogArgOf(c) };
+    SpiLog_Post(format, 3, args);
+}
+template<typename A, typename B, typename C, typename D> void SpiLog(const char* format, A a, B b, C c, D d)
+{
+    SpiLogArg args[4] = { SpiLogArgOf(a), SpiLogArgOf(b), SpiLogArgOf(c), SpiLogArgOf(d) };
+    SpiLog_Post(format, 4, args);
+}
+
+// Format one record into out, the conversion's length modifiers are replaced
+// according to the recorded argument type so a mismatch can not misread the stack.
+static int SpiLog_FormatRecord(const SpiLogRecord* pRecord, char* out, int outSize)
+{
+    const char* f = pRecord->format;
+    int used = 0;
+    int argIndex = 0;
+    while (*f && used < outSize - 1)
+    {
+        if (*f != '%')
+        {
+            out[used++] = *f++;
+            continue;
+        }
+        if (f[1] == '%')
+        {
+            out[used++] = '%';
+            f += 2;
+            continue;
+        }
+        char spec[32];
+        int specLen = 0;
+        spec[specLen++] = *f++;
+        while (*f && strchr("-+ #0123456789.", *f) && specLen < 24) spec[specLen++] = *f++;
+        while (*f && strchr("hlLqjzt", *f)) f++;
+        char conversion = *f ? *f++ : 's';
+        char tmp[128];
+        int n = 0;
+        const SpiLogArg* pArg = (argIndex < pRecord->numArgs) ? &pRecord->args[argIndex++] : NULL;
+        if (pArg == NULL)
+        {
+            n = snprintf(tmp, sizeof(tmp), "(?)");
+        }
+        else if (strchr("eEfFgGaA", conversion))
+        {
+            double v = (pArg->type == SPILOG_ARG_DOUBLE) ? pArg->value.d :
+                       (pArg->type == SPILOG_ARG_INT) ? (double)pArg->value.i : (double)pArg->value.u;
+            spec[specLen++] = conversion; spec[specLen] = '\0';
+            n = snprintf(tmp, sizeof(tmp), spec, v);
+        }
+        else if (conversion == 's')
+        {
+            const char* v = (pArg->type == SPILOG_ARG_STRING) ? pRecord->strings + pArg->value.u : "(?)";
+            spec[specLen++] = 's'; spec[specLen] = '\0';
+            n = snprintf(tmp, sizeof(tmp), spec, v);
+        }
+        else if (conversion == 'p')
+        {
+            n = snprintf(tmp, sizeof(tmp), "%p", pArg->value.p);
+        }
+        else if (conversion == 'c')
+        {
+            spec[specLen++] = 'c'; spec[specLen] = '\0';
+            n = snprintf(tmp, sizeof(tmp), spec, (int)pArg->value.i);
+        }
+        else
+        {
+            long long v = (pArg->type == SPILOG_ARG_DOUBLE) ? (long long)pArg->value.d : pArg->value.i;
+            spec[specLen++] = 'l'; spec[specLen++] = 'l'; spec[specLen++] = conversion; spec[specLen] = '\0';
+            n = snprintf(tmp, sizeof(tmp), spec, v);
+        }
+        if (n < 0 || n >= (int)sizeof(tmp)) n = (int)sizeof(tmp) - 1;
+        for (int i = 0; i < n && used < outSize - 1; i++) out[used++] = tmp[i];
+    }
+    out[used] = '\0';
+    return used;
+}
+
+// Drain every ring in posting order and write the result in one batch.
+// Only the spilog thread (or the main thread once it is stopped) calls this.
+static void SpiLog_Drain()
+{
+    static char batch[SPILOG_BATCH_BYTES];
+    int batchUsed = 0;
+    unsigned numRings = min((unsigned)SpiLoadAcquire(&spilog_numRings), (unsigned)SPILOG_MAX_THREADS);
+    FILE* pFile = spilog_file ? spilog_file : stdout;
+
+    while (1)
+    {
+        SpiLogRing* pNext = NULL;
+        SpiLogRecord* pNextRecord = NULL;
+        for (unsigned r = 0; r < numRings; r++)
+        {
+            SpiLogRing* pRing = &spilog_rings[r];
+            if (SpiLoadAcquire(&pRing->writeIndex) == pRing->readIndex) continue;
+            PaUtil_ReadMemoryBarrier();
+            SpiLogRecord* pRecord = &pRing->records[pRing->readIndex & (SPILOG_RING_RECORDS - 1)];
+            if (pNextRecord == NULL || (int)(pRecord->sequence - pNextRecord->sequence) < 0)
+            {
+                pNext = pRing;
+                pNextRecord = pRecord;
+            }
+        }
+        if (pNext == NULL) break;
+
+        if (batchUsed > SPILOG_BATCH_BYTES - 512)
+        {
+            fwrite(batch, 1, batchUsed, pFile);
+            batchUsed = 0;
+        }
+        batchUsed += SpiLog_FormatRecord(pNextRecord, batch + batchUsed, SPILOG_BATCH_BYTES - batchUsed);
+        PaUtil_FullMemoryBarrier();
+        SpiStoreRelease(&pNext->readIndex, pNext->readIndex + 1);
+    }
+
+    for (unsigned r = 0; r <= numRings; r++)
+    {
+        SpiLogRing* pRing = (r < numRings) ? &spilog_rings[r] : &spilog_overflowRing;
+        unsigned dropped = SpiLoadAcquire(&pRing->dropped);
+        if (dropped != pRing->droppedReported)
+        {
+            if (batchUsed > SPILOG_BATCH_BYTES - 128)
+            {
+                fwrite(batch, 1, batchUsed, pFile);
+                batchUsed = 0;
+            }
+            int n = snprintf(batch + batchUsed, SPILOG_BATCH_BYTES - batchUsed, "spilog: %u records dropped\n", dropped - pRing->droppedReported);
+            if (n > 0) batchUsed += n;
+            pRing->droppedReported = dropped;
+        }
+    }
+
+    if (batchUsed > 0)
+    {
+        fwrite(batch, 1, batchUsed, pFile);
+        fflush(pFile);
+    }
+}
+
+// Total number of records lost because a ring was full.
+static unsigned SpiLog_GetDroppedCount()
+{
+    unsigned total = SpiLoadAcquire(&spilog_overflowRing.dropped);
+    unsigned numRings = min((unsigned)SpiLoadAcquire(&spilog_numRings), (unsigned)SPILOG_MAX_THREADS);
+    for (unsigned r = 0; r < numRings; r++) total += SpiLoadAcquire(&spilog_rings[r].dropped);
+    return total;
+}
+
+static int threadFunctionSpiLog(void* ptr)
+{
+    (void)ptr;
+    // Mark thread started
+    SpiStoreRelease(&spilog_threadSyncFlag, 0);
+    while (!SpiLoadAcquire(&spilog_threadSyncFlag))
+    {
+        SpiLog_Drain();
+        Pa_Sleep(SPILOG_FLUSH_MS);
+    }
+    SpiLog_Drain();
+    SpiStoreRelease(&spilog_threadSyncFlag, 0);
+    return 0;
+}
+
+static bool SpiLog_Start()
+{
+    SpiStoreRelease(&spilog_threadSyncFlag, 1);
+    spilog_threadHandle = SpiCreateThread(threadFunctionSpiLog, NULL, NULL);
+    if (spilog_threadHandle == NULL) return false;
+    while (SpiLoadAcquire(&spilog_threadSyncFlag)) Pa_Sleep(1);
+    return true;
+}
+
+// Stop the spilog thread after a last drain, safe to call more than once.
+static void SpiLog_Stop()
+{
+    if (spilog_threadHandle)
+    {
+        SpiStoreRelease(&spilog_threadSyncFlag, 1);
+        while (SpiLoadAcquire(&spilog_threadSyncFlag)) Pa_Sleep(1);
+        SpiJoinThread(spilog_threadHandle);
+        spilog_threadHandle = NULL;
+    }
+    SpiLog_Drain();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    Routines local to this module
+///////////////////////////////////////////////////////////////////////////////
+
+//private    void    mmexit(int code);
+private void output(PmMessage data);
+private int  put_pitch(int p);
+private void showhelp();
+private void showbytes(PmMessage data, int len, boolean newline);
+private void showstatus(boolean flag);
+private void doascii(char c);
+private int  get_number(char *prompt);
+
+
+// read a number from console
+//
+int get_number(char *prompt)
+{
+    char line[STRING_MAX];
+    int n = 0, i;
+    printf(prompt);
+    while (n != 1) {
+        n = scanf("%d", &i);
+        fgets(line, STRING_MAX, stdin);
+
+    }
+    return i;
+}
+
+
+// Console keyboard, _kbhit()/_getch() on win32, a raw non-blocking terminal elsewhere
+#ifndef _WIN32
+static struct termios global_savedtermios;
+static bool global_termiosraw = false;
+
+static void RestoreTerminal()
+{
+	if(global_termiosraw) tcsetattr(STDIN_FILENO, TCSANOW, &global_savedtermios);
+	global_termiosraw = false;
+}
+#endif
+
+int SpiKbhit()
+{
+#ifdef _WIN32
+	return _kbhit();
+#else
+	if(!global_termiosraw && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &global_savedtermios)==0)
+	{
+		struct termios raw = global_savedtermios;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_cc[VMIN] = 0;
+		raw.c_cc[VTIME] = 0;
+		if(tcsetattr(STDIN_FILENO, TCSANOW, &raw)==0)
+		{
+			global_termiosraw = true;
+			atexit(RestoreTerminal);
+		}
+	}
+	fd_set readset;
+	FD_ZERO(&readset);
+	FD_SET(STDIN_FILENO, &readset);
+	struct timeval timeout = { 0, 0 };
+	return select(STDIN_FILENO+1, &readset, NULL, NULL, &timeout) > 0;
+#endif
+}
+
+int SpiGetch()
+{
+#ifdef _WIN32
+	return _getch();
+#else
+	unsigned char c;
+	return (read(STDIN_FILENO, &c, 1)==1) ? c : -1;
+#endif
+}
+
+
+void receive_poll(PtTimestamp timestamp, void *userData)
+{
+    PmEvent event;
+    int count; 
+    static bool pinned = false; //porttime owns this thread, pin it from its first callback
+    if (!pinned)
+    {
+        pinned = true;
+        if (!SpiApplyThreadAffinity(&global_midithreadconfig)) SpiLog("warning, midi thread can't be pinned to the requested cpus\n");
+    }
+    if (!global_active) return;
+    for (int i = 0; i < global_nummidiinputs; i++)
+    {
+        while ((count = Pm_Read(global_midiinputs[i].stream, &event, 1))) 
+        {
+            if (count == 1) 
+            {
+                //1) output message
+                //output(event.message);
+
+                //2) one lookup in the midi mapping tables of each session listening to this input
+                DispatchMidiInput(i, event.message);
+            }
+            else            
+            {
+                SpiLog("%s\n", Pm_GetErrorText((PmError)count)); //spi a cast as (PmError)
+            }
+        }
+    }
+}
+
+
+// Named arguments (--name=value or --name) may appear anywhere on the command
+// line, they are moved into global_options so the positional arguments keep
+// their meaning.
+void ParseNamedOptions(int& argc, char* argv[])
+{
+	int numpositional = 1;
+	for(int i=1; i<argc; i++)
+	{
+		if(strncmp(argv[i], "--", 2)==0 && argv[i][2]!='\0')
+		{
+			string option = argv[i]+2;
+			size_t equal = option.find('=');
+			if(equal==string::npos) global_options[option] = "1";
+			else global_options[option.substr(0, equal)] = option.substr(equal+1);
+		}
+		else
+		{
+			argv[numpositional++] = argv[i];
+		}
+	}
+	argc = numpositional;
+}
+
+string GetOption(const char* name, const char* defaultvalue)
+{
+	map<string,string>::iterator it = global_options.find(name);
+	return (it!=global_options.end()) ? (*it).second : string(defaultvalue);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    frame ring
+//
+// each session's ring counts whole frames, of any capacity (--ringms is no
+// longer rounded up to a power of two samples). its indexes run over
+// [0, 2*capacity), so a full ring and an empty one differ without a power
+// of two. the callback's write index and the writers' read index each have
+// a cache line of their own, and each side keeps its last look at the other
+// one's index: the callback reads the writers' line only when its copy shows
+// less room than the buffer needs, a writer the callback's line only when
+// its copy shows less than its batch. readers and the writer get one or two
+// contiguous spans for their copies, like PaUtilRingBuffer's regions.
+//
+// the ring has one producer, the callback, and one read index, moved by
+// whichever writer moves the slowest target's cursor, see output targets.
+///////////////////////////////////////////////////////////////////////////////
+
+#define SPI_CACHE_LINE (64)
+
+typedef struct
+{
+	char padBefore[SPI_CACHE_LINE];
+	// The callback's line
+	volatile unsigned writeFrame;
+	unsigned cachedReadFrame; //the callback's last look at readFrame
+	char padWrite[SPI_CACHE_LINE - 2*sizeof(unsigned)];
+	// The writers' line
+	volatile unsigned readFrame; //frames before it are written by every active target
+	char padRead[SPI_CACHE_LINE - sizeof(unsigned)];
+	// Set once
+	unsigned capacity; //frames
+	unsigned frameBytes;
+	char* buffer;
+} SpiFrameRing;
+
+// False when capacity frames can't be indexed
+static bool SpiFrameRing_Init(SpiFrameRing* pRing, unsigned frameBytes, unsigned capacity, void* buffer)
+{
+	if(capacity==0 || capacity > 0x7fffffffu) return false;
+	pRing->writeFrame = 0;
+	pRing->cachedReadFrame = 0;
+	pRing->readFrame = 0;
+	pRing->capacity = capacity;
+	pRing->frameBytes = frameBytes;
+	pRing->buffer = (char*)buffer;
+	return true;
+}
+
+// Frames from index from to index to
+static unsigned SpiFrameRing_Distance(const SpiFrameRing* pRing, unsigned from, unsigned to)
+{
+	return (to>=from) ? to - from : to + 2*pRing->capacity - from;
+}
+
+// Index frames after index, frames at most capacity
+static unsigned SpiFrameRing_Advance(const SpiFrameRing* pRing, unsigned index, unsigned frames)
+{
+	index += frames;
+	return (index >= 2*pRing->capacity) ? index - 2*pRing->capacity : index;
+}
+
+// Up to frames frames from index, as one or two spans of the buffer
+static void SpiFrameRing_Spans(const SpiFrameRing* pRing, unsigned index, unsigned frames, void* ptr[2], unsigned sizes[2])
+{
+	unsigned position = (index >= pRing->capacity) ? index - pRing->capacity : index;
+	unsigned first = min(frames, pRing->capacity - position);
+	ptr[0] = pRing->buffer + (size_t)position * pRing->frameBytes;
+	sizes[0] = first;
+	ptr[1] = (first<frames) ? pRing->buffer : NULL;
+	sizes[1] = frames - first;
+}
+
+// Frames held, from any thread
+static unsigned SpiFrameRing_Fill(const SpiFrameRing* pRing)
+{
+	return SpiFrameRing_Distance(pRing, SpiLoadAcquire(&pRing->readFrame), SpiLoadAcquire(&pRing->writeFrame));
+}
+
+// Producer side, room for frames, looking at the writers' line only when
+// the last look shows less than wanted
+static unsigned SpiFrameRing_WriteAvailable(SpiFrameRing* pRing, unsigned wanted)
+{
+	unsigned available = pRing->capacity - SpiFrameRing_Distance(pRing, pRing->cachedReadFrame, pRing->writeFrame);
+	if(available >= wanted) return available;
+	pRing->cachedReadFrame = SpiLoadAcquire(&pRing->readFrame);
+	return pRing->capacity - SpiFrameRing_Distance(pRing, pRing->cachedReadFrame, pRing->writeFrame);
+}
+
+// Producer side, the spans to fill with up to frames frames, returns the frames they hold
+static unsigned SpiFrameRing_GetWriteSpans(SpiFrameRing* pRing, unsigned frames, void* ptr[2], unsigned sizes[2])
+{
+	frames = min(frames, SpiFrameRing_WriteAvailable(pRing, frames));
+	SpiFrameRing_Spans(pRing, pRing->writeFrame, frames, ptr, sizes);
+	return frames;
+}
+
+// Producer side, publish frames filled through the write spans
+static void SpiFrameRing_CommitWrite(SpiFrameRing* pRing, unsigned frames)
+{
+	PaUtil_WriteMemoryBarrier(); //the frames before the index
+	SpiStoreRelease(&pRing->writeFrame, SpiFrameRing_Advance(pRing, pRing->writeFrame, frames));
+}
+
+// Producer side, copy up to frames frames in, returns the frames copied
+static unsigned SpiFrameRing_Write(SpiFrameRing* pRing, const void* data, unsigned frames)
+{
+	void* ptr[2];
+	unsigned sizes[2];
+	frames = SpiFrameRing_GetWriteSpans(pRing, frames, ptr, sizes);
+	memcpy(ptr[0], data, (size_t)sizes[0] * pRing->frameBytes);
+	if(ptr[1]) memcpy(ptr[1], (const char*)data + (size_t)sizes[0] * pRing->frameBytes, (size_t)sizes[1] * pRing->frameBytes);
+	SpiFrameRing_CommitWrite(pRing, frames);
+	return frames;
+}
+
+// Consumer side, frames readable from cursor, looking at the callback's line
+// only when *pCachedWrite, a write index seen before by the cursor's owner,
+// shows less than wanted (or is behind the cursor, read while the owner
+// moved it)
+static unsigned SpiFrameRing_ReadAvailable(const SpiFrameRing* pRing, unsigned cursor, unsigned* pCachedWrite, unsigned wanted)
+{
+	unsigned available = SpiFrameRing_Distance(pRing, cursor, *pCachedWrite);
+	if(available >= wanted && available <= pRing->capacity) return available;
+	SpiStoreRelease(pCachedWrite, SpiLoadAcquire(&pRing->writeFrame)); //ClaimFullestTarget reads the owner's copy
+	return SpiFrameRing_Distance(pRing, cursor, *pCachedWrite);
+}
+
+// Consumer side, the spans of up to frames frames from cursor, at most the
+// readable ones, returns the frames they hold
+static unsigned SpiFrameRing_GetReadSpans(const SpiFrameRing* pRing, unsigned cursor, unsigned* pCachedWrite, unsigned frames, void* ptr[2], unsigned sizes[2])
+{
+	frames = min(frames, SpiFrameRing_ReadAvailable(pRing, cursor, pCachedWrite, frames));
+	if(frames>0) PaUtil_ReadMemoryBarrier(); //read the frames after the write index
+	SpiFrameRing_Spans(pRing, cursor, frames, ptr, sizes);
+	return frames;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    recording sessions
+//
+// one process runs any number of independent captures. a session owns its
+// stream, ring, file, pause/split/arm state, markers, midi mapping and
+// command queue. session 0 comes from the positional arguments, or
+// --sessions=file.txt gives one session per line with the same positional
+// arguments (and an optional --midimap=file.txt). the sample format, channel
+// count and encoding are shared by all sessions.
+//
+// the rings are serviced by a small pool of writer threads (--writers=N,
+// default one per 8 sessions), each pass goes to the fullest ring that no
+// other writer holds.
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAX_SESSIONS          (64)
+#define MAX_MARKERS           (1024)
+#define MAX_RETRO_SAVES       (64)
+#define COMMAND_QUEUE_SIZE    (256) //must be a power of 2
+
+#define MAX_WINDOWS           (64)
+#define MAX_TARGETS           (8) //the session's filename, its --mirror copies and --fanout encodings
+#define LATENCY_BUCKETS       (12) //see metrics
+
+struct SamplePipeline;
+struct SpiPeakFile;
+struct SpiLoudness;
+struct SpiSpillEntry;
+struct SpiResampler;
+struct SpiMatrix;
+struct SpiConfig;
+struct SpiManifest;
+
+typedef struct SpiSession SpiSession;
+typedef struct SpiTarget SpiTarget;
+typedef ring_buffer_size_t (*WriteRegionsFunction)(SpiTarget* pTarget, void* ptr[2], ring_buffer_size_t sizes[2]); //returns the samples consumed
+
+enum { TARGET_ACTIVE = 0, TARGET_FAILED, TARGET_DROPPED };
+
+// Durations counted by upper bound, see metrics. Each histogram has a single
+// writer, the exporter reads it without locking.
+typedef struct
+{
+    volatile unsigned   counts[LATENCY_BUCKETS+1]; //the last bucket is +Inf
+    volatile double     sum; //seconds
+} SpiHistogram;
+
+// One file the session's take goes to, with its own cursor on the session's
+// ring and its own writer state, see output targets
+struct SpiTarget
+{
+    SpiSession         *pSession;
+    int                 index; //0 for the session's filename, then the --mirror directories and --fanout encodings
+    string              filename; //at startup, see hot reconfiguration for the files after a change
+    string              directory; //--mirror directory, empty for the session's own
+    string              suffix; //--fanout encoding's, inserted before the extension
+    int                 fileformat; //container and encoding
+    const SamplePipeline *pPipeline; //conversion from the captured format, see sample format pipeline
+    int                 numchannels; //channels in the file
+    const int          *channelmap; //captured channel of each file channel, NULL when all are written
+    SpiResampler       *resampler; //with --outrate, see sample rate conversion
+    const SpiMatrix    *matrix; //with --matrix, see routing matrix
+    float              *mixData; //the matrix's file channels
+    WriteRegionsFunction writeRegions; //sndfile, raw cache or gather writer
+    volatile long long  samplesWritten; //position of the writer in the captured sample stream, stored by its owner
+    int                 segmentIndex; //incremented on each split, 0 writes to the target's filename
+    const SpiConfig * volatile config; //settings of the current segment, see hot reconfiguration
+    int                 firstsegment; //segment the config's files start at
+    void               *stagingData; //converted samples on their way to libsndfile
+    long                stagedSamples; //partial frame carried over from the previous region
+    FILE               *file;
+    int                 fd; //gather writer's file, -1 when closed
+    long long           fileOffset; //gather writer's position in the file
+    unsigned char       header[44]; //prebuilt wav header, see the gather writer
+    int                 headerBytes; //0 for .raw files
+    bool                headerPending; //goes out with the segment's first write
+    long                blockBytes; //preferred i/o size of the target, see write coalescing
+    long                minBatchSamples; //one block
+    ring_buffer_size_t  maxBatchSamples;
+    volatile ring_buffer_size_t batchSamples; //a writer claims the target once this much is readable
+    SpiManifest        *manifest; //crc32c of the file being written, with --manifest
+    volatile unsigned   readFrame; //cursor on the session's ring, an index of the frame ring
+    unsigned            cachedWriteFrame; //the ring's write index as last seen by the target's owner
+    volatile unsigned   spillRead; //next spilled chunk to write
+    volatile unsigned   writeErrors;
+    SpiHistogram        writeLatency; //time spent in the target's writes
+    volatile unsigned   writerBusy; //1 while a writer (or the final drain) owns the target
+    volatile int        state; //TARGET_ACTIVE, TARGET_FAILED or TARGET_DROPPED
+    long long           intactSamples; //samplesWritten when dropped, the write in flight may end torn
+};
+
+typedef struct
+{
+    volatile long long  sampleIndex; //samples captured, see frame ring, stored by the callback
+    void               *ringBufferData;
+    SpiFrameRing        ring; //its read index follows the slowest active target
+    SpiTarget           targets[MAX_TARGETS];
+    int                 numTargets;
+    SpiPeakFile        *peaks; //waveform overview, with --peaks
+    SpiLoudness        *loudness; //loudness meter, with --loudness
+    SpiSpillEntry      *spillQueue; //chunks published by the callback, see the spill arena
+    volatile unsigned   spillWrite; //advanced by the callback
+    volatile unsigned   spillRead; //chunks before it are written by every active target
+    volatile unsigned   spillReleasing; //1 while a writer gives chunks back, see output targets
+    unsigned            spillOpen; //chunk the callback is filling, SPILL_NONE when none
+    long                spillOpenSamples;
+    volatile int        spilling; //the callback writes to chunks, not to the ring
+    volatile long long  spilledSamples; //stored by the callback, a metrics counter
+    unsigned            spillPeakChunks;
+    volatile int        finished; //stream closed and ring drained, writers skip the session
+    volatile double     firstSampleSeconds; //first callback, see startup
+    long long           streamFrames; //frames the device delivered, paused or not, see record windows
+    volatile long long  recordedFrames; //frames recorded in the take
+    long long           takeFrames; //frames recorded in the current one of --takes, see take manager
+    volatile unsigned   takeIndex; //takes started before the current one
+    int                 windowIndex; //record window the stream is in or before
+    volatile int        complete; //the take has its length or its last window is over
+    volatile ring_buffer_size_t ringPeak; //most samples the ring held, see metrics
+    volatile long long  droppedSamples; //ring and spill arena full, stored by the callback, a metrics counter
+    volatile unsigned   inputOverflows; //reported by the device
+    SpiHistogram        callbackLatency; //with --metrics only
+}
+ 
+paTestData;
+
+// The ring's capacity in samples
+static ring_buffer_size_t RingCapacitySamples(const paTestData* pData)
+{
+	return (ring_buffer_size_t)pData->ring.capacity * global_numchannels;
+}
+
+// Stream frames [start, stop) are recorded, stop is SPI_FOREVER for an open end
+typedef struct
+{
+	long long start;
+	long long stop;
+} SpiRecordWindow;
+
+enum
+{
+	MIDIACTION_NONE = 0,
+	MIDIACTION_PAUSE,
+	MIDIACTION_RESUME,
+	MIDIACTION_TOGGLE,
+	MIDIACTION_MARKER,
+	MIDIACTION_SPLIT,
+	MIDIACTION_STOP,
+	MIDIACTION_ARM,
+	MIDIACTION_DISARM,
+	MIDIACTION_SAVE,
+	MIDIACTION_NEXT
+};
+
+typedef struct
+{
+	unsigned char onAction; //fired when the value rises to threshold
+	unsigned char onParam;
+	unsigned char offAction; //fired when the value falls below threshold-hysteresis
+	unsigned char offParam;
+	unsigned char threshold;
+	unsigned char hysteresis;
+} MidiControlRule;
+
+typedef struct
+{
+	MidiControlRule ccmap[16][128];
+	MidiControlRule notemap[16][128];
+	MidiControlRule programmap[16][128];
+	bool usesnotes;
+	bool usesprograms;
+} SpiMidiMap;
+
+typedef struct
+{
+	volatile unsigned sequence; //slot is free for position sequence, holds a command for position sequence-1
+	int action; //MIDIACTION_*
+	int param;
+	const char* source; //static string, for the log
+} SpiCommandSlot;
+
+// Bounded multiple producer, single consumer queue, the consumer is the
+// audio callback
+typedef struct
+{
+	SpiCommandSlot slots[COMMAND_QUEUE_SIZE];
+	char pad0[64];
+	volatile unsigned enqueuePos;
+	char pad1[64];
+	unsigned dequeuePos;
+	volatile unsigned dropped;
+} SpiCommandQueue;
+
+struct SpiSession
+{
+	int index;
+	string filename;
+	int fileformat; //container from the file extension and global_fileformat
+	float secondsRecord;
+	long long recordframes; //length of the take, from secondsRecord, SPI_FOREVER for no end
+	string windowsspec; //--windows, see record windows
+	SpiRecordWindow windows[MAX_WINDOWS]; //sorted stream frame ranges the take is recorded in
+	int numwindows;
+	string audiodevicename;
+	int inputAudioChannelSelectors[MAX_CHANNELS];
+	PaStreamParameters inputParameters;
+	PaAsioStreamInfo asioInputInfo;
+	PaStream* stream;
+	paTestData data;
+
+	volatile bool pauserecording;
+	volatile bool stoprequested;
+	volatile int splitsegment; //segment beginning at splitsample, a split is pending for targets behind it
+	volatile long long splitsample; //position in the captured sample stream where segment splitsegment begins
+	volatile unsigned armedchannelmask; //disarmed channels are written as silence
+	long long markerframes[MAX_MARKERS];
+	volatile unsigned nummarkers;
+	long long retrosamples[MAX_RETRO_SAVES]; //saves asked for, positions in the captured sample stream, see retrospective capture
+	volatile unsigned numretrosaves;
+	volatile unsigned retrosaved; //saves written by main
+	volatile int retrowrapped; //the circular file is full, set by its writer
+
+	int midiinput; //index in global_midiinputs, -1 without midi
+	string midimapfilename;
+	int midichannelid; //0 for midi channel 1, etc.
+	int midictrlnumber; //midi control number between 0 and 127
+	SpiConfig* volatile config; //current settings, swapped by the callback, see hot reconfiguration
+	SpiConfig* volatile pendingconfig; //published by a reconfiguration, not yet applied
+	SpiConfig* volatile splitconfig; //settings of segment splitsegment and after
+	const SpiConfig* midiconfig; //version the rule states belong to, only touched by the midi thread
+	signed char ccstates[16][128]; //-1 unknown, 0 low, 1 high, only touched by the midi thread
+	signed char notestates[16][128];
+	volatile unsigned midievents; //messages dispatched to the session, see metrics
+	SpiCommandQueue commandqueue;
+};
+
+SpiSession* global_sessions[MAX_SESSIONS];
+int global_numsessions = 0;
+
+// Upper bounds of the latency histograms in seconds, see metrics
+static const double global_latencybounds[LATENCY_BUCKETS] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1.0 };
+bool global_metrics = false; //--metrics, the callback times itself
+
+// Count one duration, by the histogram's writer only
+static void ObserveLatency(SpiHistogram* pHistogram, double seconds)
+{
+	int b = 0;
+	while(b<LATENCY_BUCKETS && seconds>global_latencybounds[b]) b++;
+	pHistogram->counts[b]++;
+	pHistogram->sum += seconds;
+}
+
+void DrainCommandQueue(SpiSession* pSession);
+static bool SpiCommand_Post(SpiSession* pSession, int action, int param, const char* source);
+void ApplyPendingConfig(SpiSession* pSession);
+
+int global_devicesscanned = 0; //devices before it are in global_devicemap
+
+// The index of the named audio device, -1 when there is none. The devices
+// are only scanned up to the one looked for, the names seen are kept for
+// the next sessions.
+static int FindAudioDevice(const string& name)
+{
+	map<string,int>::iterator it = global_devicemap.find(name);
+	if(it!=global_devicemap.end()) return (*it).second;
+	int numDevices = Pa_GetDeviceCount();
+	while(global_devicesscanned<numDevices)
+	{
+		int i = global_devicesscanned++;
+		const PaDeviceInfo* deviceInfo = Pa_GetDeviceInfo( i );
+		string devicenamestring = deviceInfo->name;
+		if(global_devicemap.insert(pair<string,int>(devicenamestring,i)).second && devicenamestring==name) return i;
+	}
+	return -1;
+}
+
+bool SelectAudioDevice(SpiSession* pSession)
+{
+	int deviceid = Pa_GetDefaultInputDevice(); // default input device 
+	int founddeviceid = FindAudioDevice(pSession->audiodevicename);
+	if(founddeviceid>=0)
+	{
+		deviceid = founddeviceid;
+		printf("%s maps to %d\n", pSession->audiodevicename.c_str(), deviceid);
+	}
+	else
+	{
+		//every device, those sharing a name too, not only the ones scanned for earlier sessions
+		int numDevices = Pa_GetDeviceCount();
+		for(int i=0; i<numDevices; i++)
+		{
+			const PaDeviceInfo* deviceInfo = Pa_GetDeviceInfo(i);
+			printf("%s maps to %d, %d input channels\n", deviceInfo->name, i, deviceInfo->maxInputChannels);
+		}
+		//Pa_Terminate();
+		//return -1;
+		printf("error, audio device not found, will use default\n");
+		deviceid = Pa_GetDefaultInputDevice();
+	}
+
+
+	pSession->inputParameters.device = deviceid; 
+	if (pSession->inputParameters.device == paNoDevice) 
+	{
+		fprintf(stderr,"Error: No default input device.\n");
+		//goto error;
+		Pa_Terminate();
+		fprintf( stderr, "An error occured while using the portaudio stream\n" );
+		fprintf( stderr, "Error number: %d\n", global_err );
+		fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( global_err ) );
+		return Terminate();
+	}
+	pSession->inputParameters.channelCount = global_numchannels;
+	pSession->inputParameters.sampleFormat =  global_sampleformat;
+	pSession->inputParameters.suggestedLatency = Pa_GetDeviceInfo( pSession->inputParameters.device )->defaultLowOutputLatency;
+	//inputParameters.hostApiSpecificStreamInfo = NULL;
+
+	//Use an ASIO specific structure. WARNING - this is not portable. 
+	//PaAsioStreamInfo asioInputInfo;
+	pSession->asioInputInfo.size = sizeof(PaAsioStreamInfo);
+	pSession->asioInputInfo.hostApiType = paASIO;
+	pSession->asioInputInfo.version = 1;
+	pSession->asioInputInfo.flags = paAsioUseChannelSelectors;
+	pSession->asioInputInfo.channelSelectors = pSession->inputAudioChannelSelectors;
+	if(deviceid==Pa_GetDefaultInputDevice())
+	{
+		pSession->inputParameters.hostApiSpecificStreamInfo = NULL;
+	}
+	else if(Pa_GetHostApiInfo(Pa_GetDeviceInfo(deviceid)->hostApi)->type == paASIO) 
+	{
+		pSession->inputParameters.hostApiSpecificStreamInfo = &pSession->asioInputInfo;
+	}
+	else if(Pa_GetHostApiInfo(Pa_GetDeviceInfo(deviceid)->hostApi)->type == paWDMKS) 
+	{
+		pSession->inputParameters.hostApiSpecificStreamInfo = NULL;
+	}
+	else
+	{
+		//assert(false);
+		pSession->inputParameters.hostApiSpecificStreamInfo = NULL;
+	}
+	return true;
+}
+
+
+ 
+ 
+///////////////////////////////////////////////////////////////////////////////
+//    sample format pipeline
+//
+// the ring keeps the samples exactly as captured (--format), the writer
+// converts them in one pass to what libsndfile is given for the file's
+// encoding (--encoding). each (input format, output type, channel count)
+// combination is its own template instance, selected once at startup, so
+// the conversion loop has no per-sample branch. when the captured layout
+// already is the file's layout (int16 to pcm16, int24 to pcm24, int32 to
+// pcm32, float32 to float, uint8 to pcm8) the samples are written raw.
+//
+// the callback and the ring only move bytes (framesPerBuffer*channels
+// samples of global_samplebytes), they need no specialization.
+///////////////////////////////////////////////////////////////////////////////
+
+#define STAGING_SAMPLES (65536)
+
+typedef struct { unsigned char b[3]; } Int24; //packed little endian, as paInt24 delivers it
+
+// Left justified 32 bit value of a packed 24 bit sample
+static inline int Int24ToInt(Int24 v) { return (int)(((unsigned)v.b[0] << 8) | ((unsigned)v.b[1] << 16) | ((unsigned)v.b[2] << 24)); }
+
+// Disarmed channels (keep is 0) are silenced without a branch
+static inline float KeepSample(float v, int keep) { return v * (float)keep; }
+static inline int KeepSample(int v, int keep) { return v * keep; }
+static inline short KeepSample(short v, int keep) { return (short)(v * keep); }
+static inline signed char KeepSample(signed char v, int keep) { return (signed char)(v * keep); }
+static inline unsigned char KeepSample(unsigned char v, int keep) { return (unsigned char)(128 + (v - 128) * keep); }
+static inline Int24 KeepSample(Int24 v, int keep)
+{
+	unsigned char mask = (unsigned char)(-keep);
+	Int24 r = { { (unsigned char)(v.b[0] & mask), (unsigned char)(v.b[1] & mask), (unsigned char)(v.b[2] & mask) } };
+	return r;
+}
+
+// Same layout in and out, the raw path
+static inline void ConvertSample(float in, float& out) { out = in; }
+static inline void ConvertSample(int in, int& out) { out = in; }
+static inline void ConvertSample(Int24 in, Int24& out) { out = in; }
+static inline void ConvertSample(short in, short& out) { out = in; }
+static inline void ConvertSample(signed char in, signed char& out) { out = in; }
+static inline void ConvertSample(unsigned char in, unsigned char& out) { out = in; }
+// To short, for pcm16 and pcm8 files
+static inline void ConvertSample(float in, short& out) { float x = in * 32767.0f; out = (short)floor(max(-32768.0f, min(32767.0f, x)) + 0.5f); }
+static inline void ConvertSample(int in, short& out) { out = (short)(in >> 16); }
+static inline void ConvertSample(Int24 in, short& out) { out = (short)(Int24ToInt(in) >> 16); }
+static inline void ConvertSample(signed char in, short& out) { out = (short)(in * 256); }
+static inline void ConvertSample(unsigned char in, short& out) { out = (short)((in - 128) * 256); }
+// To full scale int, for pcm24 and pcm32 files
+static inline void ConvertSample(float in, int& out) { double x = in * 2147483647.0; out = (int)floor(max(-2147483648.0, min(2147483647.0, x)) + 0.5); }
+static inline void ConvertSample(Int24 in, int& out) { out = Int24ToInt(in); }
+static inline void ConvertSample(short in, int& out) { out = in * 65536; }
+static inline void ConvertSample(signed char in, int& out) { out = in * 16777216; }
+static inline void ConvertSample(unsigned char in, int& out) { out = (in - 128) * 16777216; }
+// To float, for float and double files
+static inline void ConvertSample(int in, float& out) { out = in * (1.0f / 2147483648.0f); }
+static inline void ConvertSample(Int24 in, float& out) { out = Int24ToInt(in) * (1.0f / 2147483648.0f); }
+static inline void ConvertSample(short in, float& out) { out = in * (1.0f / 32768.0f); }
+static inline void ConvertSample(signed char in, float& out) { out = in * (1.0f / 128.0f); }
+static inline void ConvertSample(unsigned char in, float& out) { out = (in - 128) * (1.0f / 128.0f); }
+
+// Convert interleaved samples, in[0] belongs to channel firstchannel. Channels
+// is 0 for channel counts without their own instance.
+typedef void (*ConvertFunction)(const void* pIn, void* pOut, long samples, int firstchannel, const int* keep);
+
+// TPDF dither for pcm16 from wider samples, one lsb peak from a per-thread lcg
+static SPI_THREAD_LOCAL unsigned spi_ditherseed = 22222;
+
+static inline float TpdfDither()
+{
+	spi_ditherseed = spi_ditherseed * 1664525u + 1013904223u;
+	float a = (float)(spi_ditherseed >> 8) * (1.0f / 16777216.0f);
+	spi_ditherseed = spi_ditherseed * 1664525u + 1013904223u;
+	float b = (float)(spi_ditherseed >> 8) * (1.0f / 16777216.0f);
+	return a - b;
+}
+
+// In pcm16 lsbs
+static inline float ShortScale(float in) { return in * 32767.0f; }
+static inline float ShortScale(int in) { return in * (1.0f / 65536.0f); }
+static inline float ShortScale(Int24 in) { return Int24ToInt(in) * (1.0f / 65536.0f); }
+
+// Dithered ConvertSamples to short, disarmed channels stay silent
+template<typename In, int Channels>
+static void DitherSamples(const void* pIn, void* pOut, long samples, int firstchannel, const int* keep)
+{
+	const In* in = (const In*)pIn;
+	short* out = (short*)pOut;
+	const int channels = Channels ? Channels : global_numchannels;
+	int c = firstchannel;
+	for(long i=0; i<samples; i++)
+	{
+		float x = ShortScale(in[i]) + TpdfDither();
+		out[i] = (short)((short)floor(max(-32768.0f, min(32767.0f, x)) + 0.5f) * keep[c]);
+		if(++c==channels) c = 0;
+	}
+}
+
+template<typename In>
+static ConvertFunction SelectDitherForChannels(int channels)
+{
+	switch(channels)
+	{
+	case 1: return &DitherSamples<In, 1>;
+	case 2: return &DitherSamples<In, 2>;
+	default: return &DitherSamples<In, 0>;
+	}
+}
+
+template<typename In, typename Out, int Channels>
+static void ConvertSamples(const void* pIn, void* pOut, long samples, int firstchannel, const int* keep)
+{
+	const In* in = (const In*)pIn;
+	Out* out = (Out*)pOut;
+	const int channels = Channels ? Channels : global_numchannels;
+	long i = 0;
+	// leading partial frame, when a ring region starts inside a frame
+	for(int c=firstchannel; c!=0 && c<channels && i<samples; c++, i++) ConvertSample(KeepSample(in[i], keep[c]), out[i]);
+	// whole frames, the channel loop unrolls when Channels is known
+	for(; i+channels<=samples; i+=channels)
+	{
+		for(int c=0; c<(Channels ? Channels : channels); c++) ConvertSample(KeepSample(in[i+c], keep[c]), out[i+c]);
+	}
+	// trailing partial frame
+	for(int c=0; i<samples; c++, i++) ConvertSample(KeepSample(in[i], keep[c]), out[i]);
+}
+
+template<typename In, typename Out>
+static ConvertFunction SelectConvertForChannels(int channels)
+{
+	switch(channels)
+	{
+	case 1: return &ConvertSamples<In, Out, 1>;
+	case 2: return &ConvertSamples<In, Out, 2>;
+	case 4: return &ConvertSamples<In, Out, 4>;
+	case 6: return &ConvertSamples<In, Out, 6>;
+	case 8: return &ConvertSamples<In, Out, 8>;
+	default: return &ConvertSamples<In, Out, 0>;
+	}
+}
+
+template<typename Out>
+static ConvertFunction SelectConvertForInput(PaSampleFormat format, int channels)
+{
+	switch(format)
+	{
+	case paFloat32: return SelectConvertForChannels<float, Out>(channels);
+	case paInt32: return SelectConvertForChannels<int, Out>(channels);
+	case paInt24: return SelectConvertForChannels<Int24, Out>(channels);
+	case paInt16: return SelectConvertForChannels<short, Out>(channels);
+	case paInt8: return SelectConvertForChannels<signed char, Out>(channels);
+	case paUInt8: return SelectConvertForChannels<unsigned char, Out>(channels);
+	}
+	return NULL;
+}
+
+static ConvertFunction SelectRawConvert(PaSampleFormat format, int channels)
+{
+	switch(format)
+	{
+	case paFloat32: return SelectConvertForChannels<float, float>(channels);
+	case paInt32: return SelectConvertForChannels<int, int>(channels);
+	case paInt24: return SelectConvertForChannels<Int24, Int24>(channels);
+	case paInt16: return SelectConvertForChannels<short, short>(channels);
+	case paInt8: return SelectConvertForChannels<signed char, signed char>(channels);
+	case paUInt8: return SelectConvertForChannels<unsigned char, unsigned char>(channels);
+	}
+	return NULL;
+}
+
+enum { WRITE_RAW = 0, WRITE_SHORT, WRITE_INT, WRITE_FLOAT };
+
+typedef struct SamplePipeline
+{
+	ConvertFunction convert;
+	int writetype; //how the converted samples are handed to libsndfile
+	int outbytes; //bytes per converted sample
+	int subformat; //libsndfile encoding
+} SamplePipeline;
+
+SamplePipeline global_pipeline = { NULL, WRITE_SHORT, 2, SF_FORMAT_PCM_16 };
+
+// One version of the settings that can change while recording, never
+// modified once published, see hot reconfiguration
+struct SpiConfig
+{
+	int generation; //0 for the settings at startup
+	bool split; //new files from the frame it is applied at
+	string filename; //the session's file, the mirrors and fan-outs follow it
+	SamplePipeline pipeline; //encoding of the session's file and the mirrors
+	string filenames[MAX_TARGETS];
+	int fileformats[MAX_TARGETS];
+	const SamplePipeline* pipelines[MAX_TARGETS]; //may point into a previous version
+	int midichannelid;
+	int midictrlnumber;
+	string midimapfilename;
+	SpiMidiMap midimap;
+	SpiConfig* previous; //the version it replaces, kept until the session is freed
+};
+bool global_gatherwriter = false; //--writer=gather
+
+// The encoding that stores a --format without conversion, "" for int8 (wav has no signed 8 bit)
+const char* CapturedEncoding(const string& format)
+{
+	if(format=="float32") return "float";
+	if(format=="int32") return "pcm32";
+	if(format=="int24") return "pcm24";
+	if(format=="int16") return "pcm16";
+	if(format=="uint8") return "pcm8";
+	return "";
+}
+
+// Select the conversion of the captured samples to encoding, dithered to
+// pcm16 when asked and the captured samples are wider. False for unknown
+// encodings.
+static bool SelectSamplePipeline(const string& encoding, bool dither, SamplePipeline* pPipeline)
+{
+	static const struct { const char* name; int subformat; PaSampleFormat rawformat; int writetype; int outbytes; } encodings[] = {
+		{ "pcm16", SF_FORMAT_PCM_16, paInt16, WRITE_SHORT, 2 }, { "pcm24", SF_FORMAT_PCM_24, paInt24, WRITE_INT, 4 },
+		{ "pcm32", SF_FORMAT_PCM_32, paInt32, WRITE_INT, 4 }, { "float", SF_FORMAT_FLOAT, paFloat32, WRITE_FLOAT, 4 },
+		{ "double", SF_FORMAT_DOUBLE, 0, WRITE_FLOAT, 4 }, { "pcm8", SF_FORMAT_PCM_U8, paUInt8, WRITE_SHORT, 2 } };
+
+	int e;
+	for(e=0; e<(int)(sizeof(encodings)/sizeof(encodings[0])) && encoding!=encodings[e].name; e++);
+	if(e==(int)(sizeof(encodings)/sizeof(encodings[0]))) return false;
+
+	pPipeline->subformat = encodings[e].subformat;
+	if(global_filerate!=global_samplerate || global_routedchannels>0)
+	{
+		// Mixed and resampled as float, libsndfile quantizes, see routing matrix and sample rate conversion
+		pPipeline->convert = SelectConvertForInput<float>(global_sampleformat, global_numchannels);
+		pPipeline->writetype = WRITE_FLOAT;
+		pPipeline->outbytes = 4;
+		return true;
+	}
+	if(encodings[e].rawformat==global_sampleformat)
+	{
+		pPipeline->convert = SelectRawConvert(global_sampleformat, global_numchannels);
+		pPipeline->writetype = WRITE_RAW;
+		pPipeline->outbytes = global_samplebytes;
+		return true;
+	}
+	pPipeline->writetype = encodings[e].writetype;
+	pPipeline->outbytes = encodings[e].outbytes;
+	if(dither && encodings[e].subformat==SF_FORMAT_PCM_16 && global_samplebytes>2)
+	{
+		if(global_sampleformat==paFloat32) pPipeline->convert = SelectDitherForChannels<float>(global_numchannels);
+		else if(global_sampleformat==paInt32) pPipeline->convert = SelectDitherForChannels<int>(global_numchannels);
+		else pPipeline->convert = SelectDitherForChannels<Int24>(global_numchannels);
+	}
+	else if(pPipeline->writetype==WRITE_SHORT) pPipeline->convert = SelectConvertForInput<short>(global_sampleformat, global_numchannels);
+	else if(pPipeline->writetype==WRITE_INT) pPipeline->convert = SelectConvertForInput<int>(global_sampleformat, global_numchannels);
+	else pPipeline->convert = SelectConvertForInput<float>(global_sampleformat, global_numchannels);
+	return true;
+}
+
+// Parse --format, --channels and --encoding, then select the conversion
+bool SetupSamplePipeline(const string& format, int channels, const string& encoding, bool dither)
+{
+	static const struct { const char* name; PaSampleFormat format; int bytes; } formats[] = {
+		{ "float32", paFloat32, 4 }, { "int32", paInt32, 4 }, { "int24", paInt24, 3 },
+		{ "int16", paInt16, 2 }, { "int8", paInt8, 1 }, { "uint8", paUInt8, 1 } };
+
+	int f;
+	for(f=0; f<(int)(sizeof(formats)/sizeof(formats[0])) && format!=formats[f].name; f++);
+	if(f==(int)(sizeof(formats)/sizeof(formats[0])))
+	{
+		printf("error, unknown --format=%s, expected float32, int32, int24, int16, int8 or uint8\n", format.c_str());
+		return false;
+	}
+	if(channels<1 || channels>MAX_CHANNELS)
+	{
+		printf("error, --channels must be between 1 and %d\n", MAX_CHANNELS);
+		return false;
+	}
+
+	global_sampleformat = formats[f].format;
+	global_samplebytes = formats[f].bytes;
+	global_numchannels = channels;
+
+	if(!SelectSamplePipeline(encoding, dither, &global_pipeline))
+	{
+		printf("error, unknown --encoding=%s, expected pcm16, pcm24, pcm32, float, double or pcm8\n", encoding.c_str());
+		return false;
+	}
+	global_fileformat = global_pipeline.subformat;
+	printf("capturing %d channels of %s, writing %s%s\n", channels, formats[f].name, encoding.c_str(),
+		(global_pipeline.writetype==WRITE_RAW) ? " without conversion" : "");
+	return global_pipeline.convert!=NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    sample rate conversion
+//
+// --rate=48000 runs the streams at the device's rate, --outrate=44100 writes
+// the files at another one. each target then converts to float, resamples in
+// its writer and lets libsndfile quantize to the encoding. the gather
+// writer, which writes ring memory as is, can't be used.
+//
+// the resampler is a polyphase fir: the rates are reduced to up/down (160/147
+// for 44.1 to 48 kHz), a kaiser windowed sinc of up*taps coefficients is
+// designed once at startup for that ratio and stored as up phases of taps
+// coefficients. each output frame is one phase's dot product with the last
+// taps input frames, all channels of the frame at once, four per step with
+// SSE. a target keeps its last taps-1 input frames, the phase and the
+// position of its next output, so ring regions, wrap points and staging
+// chunks are seamless. the filter's delay is dropped from the start and
+// made up with silence when the target is closed, so a file has exactly
+// frames*outrate/rate frames, aligned with the captured ones.
+///////////////////////////////////////////////////////////////////////////////
+
+#define CHANNEL_GROUPS ((MAX_CHANNELS+3)/4)
+#define SPI_PI (3.14159265358979323846)
+#define RESAMPLE_TAPS (64) //per phase when upsampling, more when the cutoff is lower
+#define RESAMPLE_PASSBAND (0.9) //of the lower nyquist frequency
+#define RESAMPLE_BLOCK (1024) //input frames filtered per pass
+#define RESAMPLE_MAX_PHASES (4096)
+#define RESAMPLE_KAISER_BETA (9.0) //about 90 dB of stopband rejection
+
+typedef struct
+{
+	int up; //interpolation factor
+	int down; //decimation factor
+	int taps; //coefficients per phase
+	long delay; //of the filter, in output frames
+	float* coefficients; //[up][taps], each phase in reverse so it reads the history forward
+} SpiResampleBank;
+
+SpiResampleBank global_resamplebank = { 1, 1, 0, 0, NULL };
+
+struct SpiResampler
+{
+	int numchannels;
+	int stride; //channels padded to whole groups of four
+	int phase; //of the next output, in 1/up of an input frame
+	long pos; //history frame the next output ends at
+	long skip; //outputs still to drop, the filter's delay
+	unsigned long long inputFrames;
+	unsigned long long outputFrames;
+	float* history; //taps-1 kept frames, then a block of new ones
+	float* output; //interleaved, numchannels per frame
+	long outputCapacity; //frames
+};
+
+static int GreatestCommonDivisor(int a, int b)
+{
+	while(b!=0)
+	{
+		int r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+// Modified Bessel function of order 0, for the kaiser window
+static double BesselI0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for(int k=1; k<50 && term > sum*1e-12; k++)
+	{
+		term *= (x/(2.0*k)) * (x/(2.0*k));
+		sum += term;
+	}
+	return sum;
+}
+
+// Design the filter bank for global_samplerate to global_filerate, false
+// when the ratio needs too many phases
+static bool SetupResampleBank()
+{
+	SpiResampleBank* pBank = &global_resamplebank;
+	int divisor = GreatestCommonDivisor(global_filerate, global_samplerate);
+	pBank->up = global_filerate / divisor;
+	pBank->down = global_samplerate / divisor;
+	if(pBank->up > RESAMPLE_MAX_PHASES || pBank->down > RESAMPLE_MAX_PHASES*8)
+	{
+		printf("error, can't convert %d Hz to %d Hz, the ratio %d/%d is too fine\n", global_samplerate, global_filerate, pBank->up, pBank->down);
+		return false;
+	}
+	// Below the lower of the two nyquist rates, a narrower band needs proportionally more taps
+	double ratio = (double)pBank->down / pBank->up;
+	pBank->taps = (int)ceil(RESAMPLE_TAPS * max(ratio, 1.0));
+	double cutoff = 0.5 * RESAMPLE_PASSBAND / max(ratio, 1.0); //in cycles per input frame
+	long length = (long)pBank->up * pBank->taps;
+	pBank->coefficients = (float*)SpiAllocateMemory(length * sizeof(float), "resampler filter bank");
+	if(pBank->coefficients==NULL) return false;
+	// The sinc is centered on a whole output frame, the window on the filter
+	pBank->delay = (long)floor((length - 1) / 2.0 / pBank->down + 0.5);
+	double center = (double)pBank->delay * pBank->down;
+	double middle = (length - 1) / 2.0;
+	double normalize = BesselI0(RESAMPLE_KAISER_BETA);
+	for(long j=0; j<length; j++)
+	{
+		double t = (j - center) / pBank->up; //in input frames
+		double x = 2.0*cutoff*t;
+		double sinc = (fabs(x) < 1e-12) ? 1.0 : sin(SPI_PI*x) / (SPI_PI*x);
+		double w = (j - middle) / (middle + 0.5);
+		double window = BesselI0(RESAMPLE_KAISER_BETA * sqrt(max(0.0, 1.0 - w*w))) / normalize;
+		// Phase p's tap k weighs the input k frames ago, stored at [p][taps-1-k]
+		int phase = (int)(j % pBank->up);
+		long k = j / pBank->up;
+		pBank->coefficients[(long)phase*pBank->taps + pBank->taps-1 - k] = (float)(2.0*cutoff*sinc*window);
+	}
+	// Unity gain at dc for every phase, or the phases' differences modulate the output
+	for(int phase=0; phase<pBank->up; phase++)
+	{
+		float* coefficients = pBank->coefficients + (long)phase*pBank->taps;
+		double sum = 0.0;
+		for(int k=0; k<pBank->taps; k++) sum += coefficients[k];
+		for(int k=0; k<pBank->taps; k++) coefficients[k] = (float)(coefficients[k] / sum);
+	}
+	printf("resampling %d Hz to %d Hz, %d phases of %d taps\n", global_samplerate, global_filerate, pBank->up, pBank->taps);
+	return true;
+}
+
+static SpiResampler* OpenResampler(int numchannels)
+{
+	SpiResampleBank* pBank = &global_resamplebank;
+	SpiResampler* pResampler = (SpiResampler*)SpiAllocateMemory(sizeof(SpiResampler), "resampler");
+	if(pResampler==NULL) return NULL;
+	pResampler->numchannels = numchannels;
+	pResampler->stride = (numchannels+3)/4*4;
+	pResampler->pos = pBank->taps-1; //the first output, silence before the first frame
+	pResampler->skip = pBank->delay;
+	// A staging buffer's worth of captured frames at most, plus the flush. with
+	// --matrix the file has fewer channels than the staging buffer's frames
+	long inputFrames = STAGING_SAMPLES/global_numchannels + pBank->taps;
+	pResampler->outputCapacity = (long)((double)inputFrames * pBank->up / pBank->down) + 2;
+	pResampler->history = (float*)SpiAllocateMemory((size_t)(pBank->taps-1 + RESAMPLE_BLOCK) * pResampler->stride * sizeof(float), "resampler history");
+	pResampler->output = (float*)SpiAllocateMemory((size_t)pResampler->outputCapacity * numchannels * sizeof(float), "resampler output");
+	if(pResampler->history==NULL || pResampler->output==NULL) return NULL;
+	return pResampler;
+}
+
+static void FreeResampler(SpiResampler* pResampler)
+{
+	if(pResampler==NULL) return;
+	SpiFreeMemory(pResampler->history);
+	SpiFreeMemory(pResampler->output);
+	SpiFreeMemory(pResampler);
+}
+
+// One output frame, the dot product of a phase with the taps frames ending at the history's last
+static void ResampleFrame(const float* history, const float* coefficients, int taps, int stride, int numchannels, float* out)
+{
+	float frame[CHANNEL_GROUPS*4];
+#ifdef SPI_SSE
+	for(int g=0; g<stride; g+=4)
+	{
+		__m128 y = _mm_setzero_ps();
+		for(int k=0; k<taps; k++)
+			y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(coefficients[k]), _mm_loadu_ps(history + k*stride + g)));
+		_mm_storeu_ps(frame+g, y);
+	}
+#else
+	for(int c=0; c<numchannels; c++)
+	{
+		float y = 0.0f;
+		for(int k=0; k<taps; k++) y += coefficients[k] * history[k*stride + c];
+		frame[c] = y;
+	}
+#endif
+	memcpy(out, frame, numchannels*sizeof(float));
+}
+
+// Resample interleaved float frames, NULL for silence. Returns the frames
+// appended to pResampler->output after the first produced ones.
+static long Resample(SpiResampler* pResampler, const float* in, long frames, long produced)
+{
+	const SpiResampleBank* pBank = &global_resamplebank;
+	int taps = pBank->taps, stride = pResampler->stride, channels = pResampler->numchannels;
+	if(in) pResampler->inputFrames += frames;
+	while(frames>0)
+	{
+		long block = min(frames, (long)RESAMPLE_BLOCK);
+		float* newest = pResampler->history + (taps-1)*stride;
+		for(long f=0; f<block; f++)
+		{
+			for(int c=0; c<channels; c++) newest[f*stride + c] = in ? in[f*channels + c] : 0.0f;
+		}
+		long available = taps-1 + block;
+		while(pResampler->pos < available)
+		{
+			if(pResampler->skip>0) pResampler->skip--;
+			else
+			{
+				assert(produced < pResampler->outputCapacity);
+				ResampleFrame(pResampler->history + (pResampler->pos-(taps-1))*stride, pBank->coefficients + (long)pResampler->phase*taps,
+					taps, stride, channels, pResampler->output + produced*channels);
+				produced++;
+				pResampler->outputFrames++;
+			}
+			pResampler->phase += pBank->down;
+			pResampler->pos += pResampler->phase / pBank->up;
+			pResampler->phase %= pBank->up;
+		}
+		memmove(pResampler->history, pResampler->history + block*stride, (taps-1)*stride*sizeof(float));
+		pResampler->pos -= block;
+		if(in) in += block*channels;
+		frames -= block;
+	}
+	return produced;
+}
+
+// Frames the output still lacks once the input is over, the filter's delay
+static long ResamplerTail(SpiResampler* pResampler)
+{
+	unsigned long long expected = (pResampler->inputFrames * global_resamplebank.up + global_resamplebank.down/2) / global_resamplebank.down;
+	return (expected > pResampler->outputFrames) ? (long)(expected - pResampler->outputFrames) : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    routing matrix
+//
+// --matrix=1+2,1-2 writes each file channel as a weighted sum of captured
+// channels, comma separated and 1-based: 0.5*1+0.5*2 sums a stereo pair to
+// mono, 1+2,1-2 decodes mid/side, 1,2,0.7*3+0.7*5,0.7*4+0.7*6 folds stems
+// down to two pairs and 3,4 picks channels. --matrix=file.txt reads one file
+// channel per line, # starts a comment. the matrix applies to every target,
+// the channels of a --fanout encoding then pick among its outputs. targets
+// convert to float, mix after the staging buffer in their writer and let
+// libsndfile quantize to the encoding: the callback and the ring don't
+// change, every host api gives the same files, peaks and loudness still
+// measure the captured channels. the mix skips zero gains: only captured
+// channels feeding some file channel are read, each one is added to the
+// groups of four file channels it has a gain in, a group per SSE step. the
+// gains are a few KB and stay in cache while a staging chunk's frames
+// stream through them once.
+///////////////////////////////////////////////////////////////////////////////
+
+struct SpiMatrix
+{
+	int rows; //file channels
+	int cols; //captured channels
+	float gains[MAX_CHANNELS][MAX_CHANNELS]; //[row][col]
+	int numinputs; //captured channels with a gain in some row
+	int inputs[MAX_CHANNELS];
+	unsigned groupmasks[MAX_CHANNELS]; //groups of four rows each input has a gain in
+	float columns[MAX_CHANNELS][CHANNEL_GROUPS*4]; //each input's gains in every row, zero padded
+};
+
+SpiMatrix global_matrix;
+
+// Gather the nonzero gains of the matrix by captured channel, for MixFrames()
+static void PrepareMatrix(SpiMatrix* pMatrix)
+{
+	pMatrix->numinputs = 0;
+	for(int c=0; c<pMatrix->cols; c++)
+	{
+		int i = pMatrix->numinputs;
+		pMatrix->groupmasks[i] = 0;
+		for(int r=0; r<CHANNEL_GROUPS*4; r++)
+		{
+			float gain = (r<pMatrix->rows) ? pMatrix->gains[r][c] : 0.0f;
+			pMatrix->columns[i][r] = gain;
+			if(gain!=0.0f) pMatrix->groupmasks[i] |= 1u << (r/4);
+		}
+		if(pMatrix->groupmasks[i]==0) continue;
+		pMatrix->inputs[i] = c;
+		pMatrix->numinputs++;
+	}
+}
+
+// Parse one file channel, terms like 2, -2 or 0.5*2 added together, into the next row
+static bool ParseMatrixRow(const string& row, SpiMatrix* pMatrix)
+{
+	if(pMatrix->rows==MAX_CHANNELS) return false;
+	float* gains = pMatrix->gains[pMatrix->rows];
+	for(int c=0; c<MAX_CHANNELS; c++) gains[c] = 0.0f;
+	const char* p = row.c_str();
+	bool first = true;
+	while(*p)
+	{
+		double sign = 1.0;
+		if(*p=='+' || *p=='-') sign = (*p++=='-') ? -1.0 : 1.0;
+		else if(!first) return false;
+		if(*p=='+' || *p=='-') return false;
+		char* end;
+		double gain = 1.0;
+		double value = strtod(p, &end);
+		if(end==p) return false;
+		if(*end=='*')
+		{
+			gain = value;
+			p = end+1;
+			if(*p=='+' || *p=='-') return false;
+			value = strtod(p, &end);
+			if(end==p) return false;
+		}
+		int channel = (int)value;
+		if(channel!=value || channel<1 || channel>pMatrix->cols || channel>MAX_CHANNELS) return false;
+		gains[channel-1] += (float)(sign*gain);
+		p = end;
+		first = false;
+	}
+	if(first) return false;
+	pMatrix->rows++;
+	return true;
+}
+
+// Parse --matrix, a comma separated list or a file of rows, before SetupSamplePipeline
+bool SetupMatrix(const string& option, int channels)
+{
+	if(option.empty()) return true;
+	SpiMatrix* pMatrix = &global_matrix;
+	pMatrix->rows = 0;
+	pMatrix->cols = channels;
+	vector<string> rows;
+	FILE* pFile = fopen(option.c_str(), "r");
+	if(pFile)
+	{
+		char line[256];
+		while(fgets(line, sizeof(line), pFile))
+		{
+			char* hash = strchr(line, '#');
+			if(hash) *hash = '\0';
+			rows.push_back(line);
+		}
+		fclose(pFile);
+	}
+	else
+	{
+		size_t begin = 0;
+		while(begin <= option.size())
+		{
+			size_t comma = option.find(',', begin);
+			if(comma==string::npos) comma = option.size();
+			rows.push_back(option.substr(begin, comma-begin));
+			begin = comma+1;
+		}
+	}
+	for(size_t i=0; i<rows.size(); i++)
+	{
+		string row;
+		for(size_t k=0; k<rows[i].size(); k++) if(strchr(" \t\r\n", rows[i][k])==NULL) row += rows[i][k];
+		if(row.empty() && pFile) continue;
+		if(!ParseMatrixRow(row, pMatrix))
+		{
+			printf("error, invalid --matrix channel %s, expected at most %d sums of channels 1 to %d, as 2, 1-2 or 0.5*1+0.5*2\n", row.c_str(), MAX_CHANNELS, channels);
+			return false;
+		}
+	}
+	if(pMatrix->rows==0)
+	{
+		printf("error, --matrix=%s has no channels\n", option.c_str());
+		return false;
+	}
+	PrepareMatrix(pMatrix);
+	global_routedchannels = pMatrix->rows;
+	printf("routing %d captured channels to %d file channels\n", channels, pMatrix->rows);
+	return true;
+}
+
+// Keep the given rows of a matrix, in order, for a --fanout encoding's channels
+static void SelectMatrixRows(const SpiMatrix* pMatrix, const int* rows, int numrows, SpiMatrix* pSelected)
+{
+	pSelected->rows = numrows;
+	pSelected->cols = pMatrix->cols;
+	for(int r=0; r<numrows; r++) memcpy(pSelected->gains[r], pMatrix->gains[rows[r]], sizeof(pSelected->gains[r]));
+	PrepareMatrix(pSelected);
+}
+
+// Mix whole frames of float samples, captured channels in, file channels
+// out. Returns the frames written to out.
+static long MixFrames(const SpiMatrix* pMatrix, const float* in, long frames, float* out)
+{
+	const int cols = pMatrix->cols, rows = pMatrix->rows, numinputs = pMatrix->numinputs;
+	const int groups = (rows+3)/4;
+	for(long f=0; f<frames; f++)
+	{
+		const float* x = in + f*cols;
+		float frame[CHANNEL_GROUPS*4];
+#ifdef SPI_SSE
+		__m128 y[CHANNEL_GROUPS];
+		for(int g=0; g<groups; g++) y[g] = _mm_setzero_ps();
+		for(int i=0; i<numinputs; i++)
+		{
+			__m128 sample = _mm_set1_ps(x[pMatrix->inputs[i]]);
+			unsigned mask = pMatrix->groupmasks[i];
+			for(int g=0; g<groups; g++)
+			{
+				if(mask & (1u<<g)) y[g] = _mm_add_ps(y[g], _mm_mul_ps(sample, _mm_loadu_ps(pMatrix->columns[i] + g*4)));
+			}
+		}
+		for(int g=0; g<groups; g++) _mm_storeu_ps(frame + g*4, y[g]);
+#else
+		for(int r=0; r<rows; r++) frame[r] = 0.0f;
+		for(int i=0; i<numinputs; i++)
+		{
+			float sample = x[pMatrix->inputs[i]];
+			const float* column = pMatrix->columns[i];
+			for(int r=0; r<rows; r++) frame[r] += sample * column[r];
+		}
+#endif
+		memcpy(out + f*rows, frame, rows*sizeof(float));
+	}
+	return frames;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    fan-out encodings
+//
+// --fanout=pcm16:dither:1-2,pcm24 records every take once more for each
+// comma separated encoding, a file per encoding next to the session's file
+// (take.wav gives take_pcm16_1-2.wav and take_pcm24.wav). each is an output
+// target of the session, written by the writer pool from the same ring
+// regions as the session's own file, without a copy and without reading the
+// finished file again. fields after the encoding: dither (pcm16 from wider
+// samples only) and the channels written, 1-based, 3 or 1-2 or 1+3+5.
+// converted samples are compacted to the written channels in the target's
+// staging buffer.
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAX_FANOUTS (4)
+
+typedef struct
+{
+	string suffix; //inserted before the extension
+	SamplePipeline pipeline;
+	int numchannels;
+	int channelmap[MAX_CHANNELS];
+	bool allchannels;
+	SpiMatrix matrix; //the --matrix rows of the channels, see routing matrix
+} SpiFanout;
+
+SpiFanout global_fanouts[MAX_FANOUTS];
+int global_numfanouts = 0;
+
+// Parse the channels field of a --fanout encoding, 1-based, into the map.
+// With --matrix the channels are the matrix's file channels.
+static bool ParseFanoutChannels(const string& field, SpiFanout* pFanout)
+{
+	const int available = global_routedchannels ? global_routedchannels : global_numchannels;
+	pFanout->numchannels = 0;
+	size_t begin = 0;
+	while(begin < field.size())
+	{
+		size_t plus = field.find('+', begin);
+		if(plus==string::npos) plus = field.size();
+		string range = field.substr(begin, plus-begin);
+		begin = plus+1;
+		int first = 0, last = 0;
+		int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+		if(n<1) return false;
+		if(n==1) last = first;
+		if(first<1 || last<first || last>available) return false;
+		for(int c=first; c<=last; c++)
+		{
+			if(pFanout->numchannels==available) return false; //compacted in place, no more than captured
+			pFanout->channelmap[pFanout->numchannels++] = c-1;
+		}
+	}
+	return pFanout->numchannels>0;
+}
+
+// Parse --fanout, after SetupSamplePipeline
+bool SetupFanout(const string& option)
+{
+	size_t begin = 0;
+	while(begin < option.size())
+	{
+		size_t comma = option.find(',', begin);
+		if(comma==string::npos) comma = option.size();
+		string spec = option.substr(begin, comma-begin);
+		begin = comma+1;
+		if(spec.empty()) continue;
+		if(global_numfanouts==MAX_FANOUTS)
+		{
+			printf("error, at most %d --fanout encodings\n", MAX_FANOUTS);
+			return false;
+		}
+		SpiFanout* pFanout = &global_fanouts[global_numfanouts];
+		size_t colon = spec.find(':');
+		string encoding = spec.substr(0, colon);
+		bool dither = false;
+		string channels;
+		while(colon!=string::npos)
+		{
+			size_t next = spec.find(':', colon+1);
+			string field = spec.substr(colon+1, (next==string::npos) ? string::npos : next-colon-1);
+			colon = next;
+			if(field=="dither") dither = true;
+			else channels = field;
+		}
+		if(!SelectSamplePipeline(encoding, dither, &pFanout->pipeline) || pFanout->pipeline.convert==NULL)
+		{
+			printf("error, unknown --fanout encoding %s, expected pcm16, pcm24, pcm32, float, double or pcm8\n", encoding.c_str());
+			return false;
+		}
+		pFanout->suffix = "_" + encoding;
+		pFanout->allchannels = channels.empty();
+		const int available = global_routedchannels ? global_routedchannels : global_numchannels;
+		if(pFanout->allchannels)
+		{
+			pFanout->numchannels = available;
+			for(int c=0; c<available; c++) pFanout->channelmap[c] = c;
+		}
+		else if(ParseFanoutChannels(channels, pFanout))
+		{
+			pFanout->suffix += "_" + channels;
+		}
+		else
+		{
+			printf("error, invalid --fanout channels %s, expected 1 to %d as 3, 1-2 or 1+3\n", channels.c_str(), available);
+			return false;
+		}
+		if(global_routedchannels>0) SelectMatrixRows(&global_matrix, pFanout->channelmap, pFanout->numchannels, &pFanout->matrix);
+		bool dithered = (dither && pFanout->pipeline.subformat==SF_FORMAT_PCM_16 && global_samplebytes>2);
+		printf("fan-out %s, %d channels%s\n", pFanout->suffix.c_str()+1, pFanout->numchannels, dithered ? ", dithered" : "");
+		global_numfanouts++;
+	}
+	return true;
+}
+
+// Keep the written channels of whole frames of converted samples, in place. Returns the samples kept.
+static long CompactChannels(char* pSamples, long samples, int outbytes, const int* channelmap, int numchannels)
+{
+	long frames = samples / global_numchannels;
+	char kept[MAX_CHANNELS*4]; //a frame's written channels, the map may reorder them
+	for(long f=0; f<frames; f++)
+	{
+		const char* frame = pSamples + f*global_numchannels*outbytes;
+		for(int c=0; c<numchannels; c++) memcpy(kept + c*outbytes, frame + channelmap[c]*outbytes, outbytes);
+		memcpy(pSamples + f*numchannels*outbytes, kept, numchannels*outbytes);
+	}
+	return frames * numchannels;
+}
+
+// The container follows the file extension, .w64, .rf64 or wav for anything else
+int ContainerFormat(const string& filename)
+{
+	size_t dot = filename.find_last_of('.');
+	string extension = (dot==string::npos) ? "" : filename.substr(dot);
+	if(extension==".w64") return SF_FORMAT_W64;
+	if(extension==".rf64") return SF_FORMAT_RF64;
+	return SF_FORMAT_WAV;
+}
+
+// Count a write error. The target fails and stops gating the ring while
+// another one is still active, the last active target keeps trying.
+static void TargetWriteFailed(SpiTarget* pTarget)
+{
+	paTestData* pData = &pTarget->pSession->data;
+	SpiStoreRelease(&pTarget->writeErrors, pTarget->writeErrors + 1);
+	int numactive = 0;
+	for(int t=0; t<pData->numTargets; t++) if(pData->targets[t].state==TARGET_ACTIVE) numactive++;
+	if(numactive>1 && SpiAtomicCompareAndSwap(&pTarget->state, TARGET_ACTIVE, TARGET_FAILED))
+	{
+		SpiLog("session %d, write error on %s, target failed\n", pTarget->pSession->index, pTarget->filename);
+	}
+}
+
+static void ManifestBytes(SpiTarget* pTarget, const void* data, size_t bytes);
+static void ManifestSamples(SpiTarget* pTarget, const void* pSamples, long count);
+static void FinishManifest(SpiTarget* pTarget, const string& filename);
+static void FinalizeFile(SpiTarget* pTarget, const string& filename, int fd, const unsigned char* header, int headerBytes);
+
+bool AppendWavFile(const char* filename, int fileformat, int channels, const SamplePipeline* pPipeline, const void* pVoid, long count)
+{
+	assert(filename);
+	SndfileHandle outfile(filename, SFM_RDWR, fileformat, channels, global_filerate); 
+	if(!outfile) return false;
+	outfile.seek(outfile.frames(), SEEK_SET);
+	sf_count_t written = 0;
+	switch(pPipeline->writetype)
+	{
+	case WRITE_RAW:
+		written = outfile.writeRaw(pVoid, (sf_count_t)count * pPipeline->outbytes) / pPipeline->outbytes;
+		break;
+	case WRITE_SHORT:
+		written = outfile.write((const short*)pVoid, count);
+		break;
+	case WRITE_INT:
+		written = outfile.write((const int*)pVoid, count);
+		break;
+	case WRITE_FLOAT:
+		written = outfile.write((const float*)pVoid, count);
+		break;
+	}
+	return written==count;
+}
+
+// The config's first segment is the target's file, the next ones get _001,
+// _002, ... inserted before the extension
+string SegmentFilename(SpiTarget* pTarget, int segmentIndex)
+{
+	const string& filename = pTarget->config->filenames[pTarget->index];
+	segmentIndex -= pTarget->firstsegment;
+	if(segmentIndex==0) return filename;
+	char suffix[16];
+	sprintf(suffix, "_%03d", segmentIndex);
+	size_t dot = filename.find_last_of('.');
+	if(dot==string::npos) return filename + suffix;
+	return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+// Take up the settings of the segment the target just split to, by its
+// writer. A new file starts empty, like the session's first one.
+static void ApplySegmentConfig(SpiTarget* pTarget)
+{
+	PaUtil_ReadMemoryBarrier();
+	const SpiConfig* pConfig = SpiLoadAcquire(&pTarget->pSession->splitconfig);
+	if(pConfig==pTarget->config) return;
+	SpiStoreRelease(&pTarget->config, pConfig);
+	pTarget->firstsegment = pTarget->segmentIndex;
+	pTarget->fileformat = pConfig->fileformats[pTarget->index];
+	pTarget->pPipeline = pConfig->pipelines[pTarget->index];
+	FILE* pFile = fopen(pConfig->filenames[pTarget->index].c_str(), "wb");
+	if(pFile) fclose(pFile);
+}
+
+// Convert one ring region into the staging buffer and write it to the current
+// segment, silencing disarmed tracks and switching to the next segment when a
+// pending split point falls inside it. libsndfile takes whole frames only, a
+// frame split by the ring's wrap point is carried over to the next region.
+static void WriteRegionToWavFile(SpiTarget* pTarget, void* ptr, long count)
+{
+	SpiSession* pSession = pTarget->pSession;
+	SpiTarget* pData = pTarget;
+	int keep[MAX_CHANNELS];
+	unsigned armedmask = SpiLoadAcquire(&pSession->armedchannelmask);
+	for(int c=0; c<global_numchannels; c++) keep[c] = (armedmask>>c) & 1;
+	char* pSamples = (char*)ptr;
+	while(count>0)
+	{
+		long chunk = min(count, (long)STAGING_SAMPLES - pData->stagedSamples);
+		if(pData->segmentIndex < SpiLoadAcquire(&pSession->splitsegment))
+		{
+			PaUtil_ReadMemoryBarrier();
+			long long untilsplit = pSession->splitsample - pData->samplesWritten;
+			if(untilsplit<chunk) chunk = (long)max(untilsplit, 0LL);
+		}
+		if(chunk>0)
+		{
+			const SamplePipeline* pPipeline = pTarget->pPipeline;
+			char* pStaging = (char*)pData->stagingData;
+			pPipeline->convert(pSamples, pStaging + pData->stagedSamples*pPipeline->outbytes, chunk, (int)(pData->samplesWritten % global_numchannels), keep);
+			long staged = pData->stagedSamples + chunk;
+			long whole = staged - staged % global_numchannels;
+			long kept = (whole>0 && pTarget->channelmap) ? CompactChannels(pStaging, whole, pPipeline->outbytes, pTarget->channelmap, pTarget->numchannels) : whole;
+			const void* pOut = pStaging;
+			if(whole>0 && pTarget->matrix)
+			{
+				kept = MixFrames(pTarget->matrix, (const float*)pStaging, whole/global_numchannels, pTarget->mixData) * pTarget->numchannels;
+				pOut = pTarget->mixData;
+			}
+			if(whole>0 && pTarget->resampler)
+			{
+				kept = Resample(pTarget->resampler, (const float*)pOut, kept/pTarget->numchannels, 0) * pTarget->numchannels;
+				pOut = pTarget->resampler->output;
+			}
+			if(kept>0 && !AppendWavFile(SegmentFilename(pTarget, pData->segmentIndex).c_str(), pTarget->fileformat, pTarget->numchannels, pPipeline, pOut, kept))
+			{
+				TargetWriteFailed(pTarget);
+			}
+			if(kept>0 && pTarget->manifest) ManifestSamples(pTarget, pOut, kept);
+			pData->stagedSamples = staged - whole;
+			if(pData->stagedSamples>0) memmove(pStaging, pStaging + whole*pPipeline->outbytes, pData->stagedSamples*pPipeline->outbytes);
+			SpiAtomicStore64(&pData->samplesWritten, pData->samplesWritten + chunk);
+			pSamples += chunk*global_samplebytes;
+			count -= chunk;
+		}
+		if(pData->segmentIndex < SpiLoadAcquire(&pSession->splitsegment) && SpiAtomicLoad64(&pSession->splitsample) <= pData->samplesWritten)
+		{
+			if(pTarget->manifest) FinishManifest(pTarget, SegmentFilename(pTarget, pData->segmentIndex));
+			FinalizeFile(pTarget, SegmentFilename(pTarget, pData->segmentIndex), -1, NULL, 0);
+			SpiStoreRelease(&pData->segmentIndex, SpiLoadAcquire(&pSession->splitsegment));
+			ApplySegmentConfig(pTarget);
+			SpiLog("session %d now recording to %s\n", pSession->index, SegmentFilename(pTarget, pData->segmentIndex));
+		}
+	}
+}
+
+// Write what the resampler's delay still holds back, once the input is over
+static void FlushResampler(SpiTarget* pTarget)
+{
+	SpiResampler* pResampler = pTarget->resampler;
+	long missing = ResamplerTail(pResampler);
+	long produced = 0;
+	while(produced < missing) produced = Resample(pResampler, NULL, global_resamplebank.taps, produced);
+	if(missing>0 && !AppendWavFile(SegmentFilename(pTarget, pTarget->segmentIndex).c_str(), pTarget->fileformat, pTarget->numchannels, pTarget->pPipeline, pResampler->output, missing*pTarget->numchannels))
+	{
+		TargetWriteFailed(pTarget);
+	}
+	if(missing>0 && pTarget->manifest) ManifestSamples(pTarget, pResampler->output, missing*pTarget->numchannels);
+}
+
+static ring_buffer_size_t WriteRegionsToWavFile(SpiTarget* pTarget, void* ptr[2], ring_buffer_size_t sizes[2])
+{
+    int i;
+    for (i = 0; i < 2 && ptr[i] != NULL; ++i)
+    {
+        WriteRegionToWavFile(pTarget, ptr[i], sizes[i]);
+    }
+    return sizes[0] + (ptr[1] ? sizes[1] : 0);
+}
+
+/* Write the ring regions into the raw 'cache' file, as captured */ 
+static ring_buffer_size_t WriteRegionsToRawFile(SpiTarget* pTarget, void* ptr[2], ring_buffer_size_t sizes[2])
+{
+    int i;
+    for (i = 0; i < 2 && ptr[i] != NULL; ++i)
+    {
+        if (fwrite(ptr[i], global_samplebytes, sizes[i], pTarget->file) != (size_t)sizes[i]) TargetWriteFailed(pTarget);
+        SpiAtomicStore64(&pTarget->samplesWritten, pTarget->samplesWritten + sizes[i]);
+    }
+    return sizes[0] + (ptr[1] ? sizes[1] : 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    gather writer
+//
+// --writer=gather hands both ring regions, plus the prebuilt wav header on a
+// segment's first write, to the kernel in one pwritev() call straight from
+// ring memory: no staging copy and no stdio buffer. the read index advances
+// only once the call has returned. samples are written as captured, so the
+// encoding is the captured format (--encoding may be left out). disarmed
+// tracks are silenced in place in the ring, the writer owns that part of it
+// until the read index advances. the header's sizes are patched with one
+// more positional write by the finalizer once a segment is closed (see take
+// manager), files ending in .raw get no header. this is the zero-copy
+// baseline the other writers are measured against. win32 has no pwritev(),
+// there each slice gets its own _write().
+///////////////////////////////////////////////////////////////////////////////
+
+#define WAV_HEADER_BYTES (44)
+
+#ifdef _WIN32
+struct iovec
+{
+	void* iov_base;
+	size_t iov_len;
+};
+#endif
+
+static void PutLittleEndian(unsigned char* p, unsigned value, int bytes)
+{
+	for(int i=0; i<bytes; i++) p[i] = (unsigned char)(value >> (8*i));
+}
+
+// Canonical 44 byte header, WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT for the captured format
+static void BuildWavHeader(unsigned char* header, long long dataBytes)
+{
+	unsigned datasize = (unsigned)min(dataBytes, 0xffffffffLL - (WAV_HEADER_BYTES-8));
+	int blockalign = global_numchannels * global_samplebytes;
+	memcpy(header, "RIFF", 4);
+	PutLittleEndian(header+4, datasize + WAV_HEADER_BYTES-8, 4);
+	memcpy(header+8, "WAVEfmt ", 8);
+	PutLittleEndian(header+16, 16, 4);
+	PutLittleEndian(header+20, (global_sampleformat==paFloat32) ? 3 : 1, 2);
+	PutLittleEndian(header+22, global_numchannels, 2);
+	PutLittleEndian(header+24, global_samplerate, 4);
+	PutLittleEndian(header+28, global_samplerate * blockalign, 4);
+	PutLittleEndian(header+32, blockalign, 2);
+	PutLittleEndian(header+34, global_samplebytes*8, 2);
+	memcpy(header+36, "data", 4);
+	PutLittleEndian(header+40, datasize, 4);
+}
+
+// Write all of iov at offset, retrying partial writes, false on error
+static bool SpiWriteGather(int fd, struct iovec* iov, int iovcnt, long long offset)
+{
+	while(iovcnt>0)
+	{
+#ifdef _WIN32
+		if(_lseeki64(fd, offset, SEEK_SET)<0) return false;
+		long long written = _write(fd, iov[0].iov_base, (unsigned)iov[0].iov_len);
+#else
+		long long written = pwritev(fd, iov, iovcnt, (off_t)offset);
+		if(written<0 && errno==EINTR) continue;
+#endif
+		if(written<0) return false;
+		offset += written;
+		while(iovcnt>0 && (size_t)written>=iov[0].iov_len)
+		{
+			written -= iov[0].iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0)
+		{
+			iov[0].iov_base = (char*)iov[0].iov_base + written;
+			iov[0].iov_len -= (size_t)written;
+		}
+	}
+	return true;
+}
+
+static bool OpenGatherSegment(SpiTarget* pTarget)
+{
+	SpiTarget* pData = pTarget;
+	string filename = SegmentFilename(pTarget, pData->segmentIndex);
+#ifdef _WIN32
+	pData->fd = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	pData->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if(pData->fd<0)
+	{
+		SpiLog("session %d, can't open %s\n", pTarget->pSession->index, filename);
+		return false;
+	}
+	size_t dot = filename.find_last_of('.');
+	bool raw = (dot!=string::npos && filename.substr(dot)==".raw");
+	pData->headerBytes = raw ? 0 : WAV_HEADER_BYTES;
+	pData->headerPending = !raw;
+	pData->fileOffset = 0;
+	if(!raw) BuildWavHeader(pData->header, 0);
+	return true;
+}
+
+static void CloseGatherSegment(SpiTarget* pTarget)
+{
+	SpiTarget* pData = pTarget;
+	if(pData->fd<0) return;
+	if(pTarget->manifest) FinishManifest(pTarget, SegmentFilename(pTarget, pData->segmentIndex));
+	if(pData->headerBytes>0)
+	{
+		//a header still pending goes out with the final sizes, nothing was recorded
+		BuildWavHeader(pData->header, pData->fileOffset - (pData->headerPending ? 0 : pData->headerBytes));
+	}
+	//the finalizer writes the header, syncs and closes the file
+	FinalizeFile(pTarget, SegmentFilename(pTarget, pData->segmentIndex), pData->fd, pData->header, pData->headerBytes);
+	pData->fd = -1;
+}
+
+// Silence the disarmed tracks of count samples, first[0] belonging to channel firstchannel
+static void SilenceDisarmedTracks(SpiSession* pSession, char* first, long count, int firstchannel)
+{
+	unsigned armedmask = SpiLoadAcquire(&pSession->armedchannelmask);
+	unsigned allmask = (global_numchannels==32) ? 0xffffffff : ((1u<<global_numchannels)-1);
+	if((armedmask & allmask)==allmask) return;
+	int silence = (global_sampleformat==paUInt8) ? 128 : 0;
+	int channel = firstchannel;
+	for(long i=0; i<count; i++)
+	{
+		if(!(armedmask & (1u<<channel))) memset(first + i*global_samplebytes, silence, global_samplebytes);
+		if(++channel==global_numchannels) channel = 0;
+	}
+}
+
+static ring_buffer_size_t WriteRegionsGather(SpiTarget* pTarget, void* ptr[2], ring_buffer_size_t sizes[2])
+{
+	SpiSession* pSession = pTarget->pSession;
+	SpiTarget* pData = pTarget;
+	char* slices[2] = { (char*)ptr[0], (char*)ptr[1] };
+	long left[2] = { ptr[0] ? (long)sizes[0] : 0, ptr[1] ? (long)sizes[1] : 0 };
+	ring_buffer_size_t consumed = 0;
+	SilenceDisarmedTracks(pSession, slices[0], left[0], (int)(pData->samplesWritten % global_numchannels));
+	SilenceDisarmedTracks(pSession, slices[1], left[1], (int)((pData->samplesWritten + left[0]) % global_numchannels));
+	while(left[0] + left[1] > 0 && pData->fd>=0)
+	{
+		long count = left[0] + left[1];
+		if(pData->segmentIndex < SpiLoadAcquire(&pSession->splitsegment))
+		{
+			PaUtil_ReadMemoryBarrier();
+			long long untilsplit = pSession->splitsample - pData->samplesWritten;
+			if(untilsplit<count) count = (long)max(untilsplit, 0LL);
+		}
+		if(count>0)
+		{
+			struct iovec iov[3];
+			int iovcnt = 0;
+			if(pData->headerPending)
+			{
+				iov[iovcnt].iov_base = pData->header;
+				iov[iovcnt++].iov_len = (size_t)pData->headerBytes;
+			}
+			long remaining = count;
+			for(int i=0; i<2 && remaining>0; i++)
+			{
+				long take = min(remaining, left[i]);
+				if(take==0) continue;
+				iov[iovcnt].iov_base = slices[i];
+				iov[iovcnt++].iov_len = (size_t)take * global_samplebytes;
+				if(pTarget->manifest) ManifestBytes(pTarget, slices[i], (size_t)take * global_samplebytes);
+				slices[i] += take * global_samplebytes;
+				left[i] -= take;
+				remaining -= take;
+			}
+			size_t bytes = 0;
+			for(int i=0; i<iovcnt; i++) bytes += iov[i].iov_len;
+			if(!SpiWriteGather(pData->fd, iov, iovcnt, pData->fileOffset))
+			{
+				SpiLog("session %d, write error on %s, %ld samples lost\n", pSession->index, pTarget->filename, count);
+				TargetWriteFailed(pTarget);
+			}
+			pData->fileOffset += bytes;
+			pData->headerPending = false;
+			SpiAtomicStore64(&pData->samplesWritten, pData->samplesWritten + count);
+			consumed += count;
+		}
+		if(pData->segmentIndex < SpiLoadAcquire(&pSession->splitsegment) && SpiAtomicLoad64(&pSession->splitsample) <= pData->samplesWritten)
+		{
+			CloseGatherSegment(pTarget);
+			SpiStoreRelease(&pData->segmentIndex, SpiLoadAcquire(&pSession->splitsegment));
+			ApplySegmentConfig(pTarget);
+			OpenGatherSegment(pTarget);
+			SpiLog("session %d now recording to %s\n", pSession->index, SegmentFilename(pTarget, pData->segmentIndex));
+		}
+	}
+	return consumed + left[0] + left[1]; //without a file the samples are dropped
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    integrity manifest
+//
+// --manifest has the writers checksum every file's samples as they write
+// them, a crc32c (castagnoli) of each --manifestblock (1 MiB) of the data
+// chunk and of the whole of it, into filename.crc32c next to the file (and
+// to each split segment, mirror and fan-out file). the crc32c instruction
+// of sse4.2 is used when cpuid reports it, slicing-by-8 tables otherwise;
+// the whole data's crc is combined from the blocks' ones in log time, so
+// each byte is read once. the file is never read back to make it.
+//
+// the bytes are the file's own: raw samples, or what libsndfile stores for
+// the pipeline's shorts, ints and floats (pcm24 keeps an int's top 3 bytes,
+// pcm8 a short's high byte plus 128, double widens the float). floats
+// quantized by libsndfile itself (--matrix or --outrate to a pcm encoding)
+// are refused, as is --retro.
+//
+// --verify take.wav take_001.wav ... checks the files against their
+// manifests and exits, 1 when one doesn't match. the blocks are spread over
+// --verifythreads threads (one per cpu), each reading its own ranges.
+///////////////////////////////////////////////////////////////////////////////
+
+#define CRC32C_POLYNOMIAL (0x82F63B78u) //reflected
+#define MANIFEST_LINE_BYTES (256)
+#define VERIFY_JOB_BLOCKS (16)
+
+struct SpiManifest
+{
+	unsigned blockCrc; //of the block being filled
+	unsigned blockFill; //bytes in it
+	unsigned fileCrc; //of the finished blocks
+	long long bytes;
+	vector<unsigned> blocks;
+};
+
+unsigned global_manifestblock = 0; //--manifestblock bytes, 0 without --manifest
+static unsigned spi_crc32ctable[8][256];
+static unsigned (*spi_crc32c)(unsigned crc, const unsigned char* p, size_t n) = NULL;
+
+// Slicing-by-8, 8 table lookups for 8 bytes
+static unsigned Crc32cSoftware(unsigned crc, const unsigned char* p, size_t n)
+{
+	crc = ~crc;
+	while(n>0 && ((size_t)p & 3)) { crc = spi_crc32ctable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8); n--; }
+	while(n>=8)
+	{
+		unsigned lo = crc ^ (p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned)p[3]<<24));
+		unsigned hi = p[4] | (p[5]<<8) | (p[6]<<16) | ((unsigned)p[7]<<24);
+		crc = spi_crc32ctable[7][lo & 0xff] ^ spi_crc32ctable[6][(lo>>8) & 0xff] ^ spi_crc32ctable[5][(lo>>16) & 0xff] ^ spi_crc32ctable[4][lo>>24]
+			^ spi_crc32ctable[3][hi & 0xff] ^ spi_crc32ctable[2][(hi>>8) & 0xff] ^ spi_crc32ctable[1][(hi>>16) & 0xff] ^ spi_crc32ctable[0][hi>>24];
+		p += 8;
+		n -= 8;
+	}
+	while(n>0) { crc = spi_crc32ctable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8); n--; }
+	return ~crc;
+}
+
+#ifdef SPI_CRC32C_HW
+// The sse4.2 crc32 instruction, 8 bytes at a time on x64
+SPI_TARGET_SSE42 static unsigned Crc32cHardware(unsigned crc, const unsigned char* p, size_t n)
+{
+	crc = ~crc;
+	while(n>0 && ((size_t)p & 7)) { crc = _mm_crc32_u8(crc, *p++); n--; }
+#if defined(_M_X64) || defined(__x86_64__)
+	unsigned long long crc64 = crc;
+	for(; n>=8; p+=8, n-=8) crc64 = _mm_crc32_u64(crc64, *(const unsigned long long*)p);
+	crc = (unsigned)crc64;
+#else
+	for(; n>=4; p+=4, n-=4) crc = _mm_crc32_u32(crc, *(const unsigned*)p);
+#endif
+	while(n>0) { crc = _mm_crc32_u8(crc, *p++); n--; }
+	return ~crc;
+}
+
+static bool CpuHasSse42()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1<<20))!=0;
+#else
+	unsigned a, b, c, d;
+	return __get_cpuid(1, &a, &b, &c, &d) && (c & (1u<<20));
+#endif
+}
+#endif
+
+// True when the manifest knows the bytes libsndfile stores for the pipeline's samples
+static bool ManifestCovers(const SamplePipeline* pPipeline)
+{
+	return pPipeline->writetype!=WRITE_FLOAT || pPipeline->subformat==SF_FORMAT_FLOAT || pPipeline->subformat==SF_FORMAT_DOUBLE;
+}
+
+// Build the tables and pick the implementation, once
+static void SetupCrc32c()
+{
+	if(spi_crc32c) return;
+	for(unsigned i=0; i<256; i++)
+	{
+		unsigned crc = i;
+		for(int k=0; k<8; k++) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		spi_crc32ctable[0][i] = crc;
+	}
+	for(unsigned i=0; i<256; i++)
+	{
+		for(int t=1; t<8; t++) spi_crc32ctable[t][i] = spi_crc32ctable[0][spi_crc32ctable[t-1][i] & 0xff] ^ (spi_crc32ctable[t-1][i] >> 8);
+	}
+	spi_crc32c = Crc32cSoftware;
+#ifdef SPI_CRC32C_HW
+	if(CpuHasSse42()) spi_crc32c = Crc32cHardware;
+#endif
+}
+
+static unsigned Gf2MatrixTimes(const unsigned* matrix, unsigned vector)
+{
+	unsigned sum = 0;
+	for(; vector; vector >>= 1, matrix++) if(vector & 1) sum ^= *matrix;
+	return sum;
+}
+
+static void Gf2MatrixSquare(unsigned* square, const unsigned* matrix)
+{
+	for(int n=0; n<32; n++) square[n] = Gf2MatrixTimes(matrix, matrix[n]);
+}
+
+// The crc of a then b from their crcs and b's length, like zlib's crc32_combine()
+static unsigned Crc32cCombine(unsigned crcA, unsigned crcB, long long bytesB)
+{
+	if(bytesB<=0) return crcA;
+	unsigned even[32], odd[32]; //operators for 2^n zero bits
+	odd[0] = CRC32C_POLYNOMIAL;
+	for(int n=1; n<32; n++) odd[n] = 1u << (n-1);
+	Gf2MatrixSquare(even, odd); //2 zero bits
+	Gf2MatrixSquare(odd, even); //4 zero bits
+	do
+	{
+		Gf2MatrixSquare(even, odd);
+		if(bytesB & 1) crcA = Gf2MatrixTimes(even, crcA);
+		bytesB >>= 1;
+		if(bytesB==0) break;
+		Gf2MatrixSquare(odd, even);
+		if(bytesB & 1) crcA = Gf2MatrixTimes(odd, crcA);
+		bytesB >>= 1;
+	} while(bytesB);
+	return crcA ^ crcB;
+}
+
+// Parse --manifest and --manifestblock, after SetupFanout
+bool SetupManifest(bool manifest, long blockbytes, bool retro)
+{
+	if(!manifest) return true;
+	if(retro)
+	{
+		printf("error, --manifest covers recorded files, not --retro's circular files\n");
+		return false;
+	}
+	if(blockbytes<4096 || blockbytes>(1<<30))
+	{
+		printf("error, --manifestblock must be from 4096 to 2^30 bytes\n");
+		return false;
+	}
+	bool covered = ManifestCovers(&global_pipeline);
+	for(int f=0; f<global_numfanouts; f++) covered = covered && ManifestCovers(&global_fanouts[f].pipeline);
+	if(!covered)
+	{
+		printf("error, --manifest can't follow libsndfile's float to pcm quantization, --matrix and --outrate need --encoding=float or double with it\n");
+		return false;
+	}
+	SetupCrc32c();
+	global_manifestblock = (unsigned)blockbytes;
+	printf("integrity manifests, crc32c of %ld byte blocks, %s\n", blockbytes, (spi_crc32c==Crc32cSoftware) ? "slicing-by-8" : "sse4.2");
+	return true;
+}
+
+static void FinishManifestBlock(SpiManifest* pManifest)
+{
+	pManifest->fileCrc = Crc32cCombine(pManifest->fileCrc, pManifest->blockCrc, pManifest->blockFill);
+	pManifest->blocks.push_back(pManifest->blockCrc);
+	pManifest->blockCrc = 0;
+	pManifest->blockFill = 0;
+}
+
+// Add bytes of the file's data chunk, by the target's writer
+static void ManifestBytes(SpiTarget* pTarget, const void* data, size_t bytes)
+{
+	SpiManifest* pManifest = pTarget->manifest;
+	const unsigned char* p = (const unsigned char*)data;
+	while(bytes>0)
+	{
+		size_t n = min(bytes, (size_t)(global_manifestblock - pManifest->blockFill));
+		pManifest->blockCrc = spi_crc32c(pManifest->blockCrc, p, n);
+		pManifest->blockFill += (unsigned)n;
+		pManifest->bytes += n;
+		p += n;
+		bytes -= n;
+		if(pManifest->blockFill==global_manifestblock) FinishManifestBlock(pManifest);
+	}
+}
+
+// Add count samples given to AppendWavFile, as libsndfile stores them
+static void ManifestSamples(SpiTarget* pTarget, const void* pSamples, long count)
+{
+	const SamplePipeline* pPipeline = pTarget->pPipeline;
+	int subformat = pTarget->fileformat & SF_FORMAT_SUBMASK;
+	if(pPipeline->writetype==WRITE_RAW || (pPipeline->writetype==WRITE_SHORT && subformat==SF_FORMAT_PCM_16)
+		|| (pPipeline->writetype==WRITE_INT && subformat==SF_FORMAT_PCM_32) || (pPipeline->writetype==WRITE_FLOAT && subformat==SF_FORMAT_FLOAT))
+	{
+		ManifestBytes(pTarget, pSamples, (size_t)count * pPipeline->outbytes);
+		return;
+	}
+	unsigned char bytes[4096];
+	for(long done=0; done<count; )
+	{
+		long n = 0;
+		size_t used = 0;
+		for(; done+n<count && used+8<=sizeof(bytes); n++)
+		{
+			if(subformat==SF_FORMAT_PCM_U8)
+			{
+				bytes[used++] = (unsigned char)((((const short*)pSamples)[done+n] >> 8) + 128);
+			}
+			else if(subformat==SF_FORMAT_PCM_24)
+			{
+				int sample = ((const int*)pSamples)[done+n];
+				bytes[used++] = (unsigned char)(sample >> 8);
+				bytes[used++] = (unsigned char)(sample >> 16);
+				bytes[used++] = (unsigned char)(sample >> 24);
+			}
+			else //SF_FORMAT_DOUBLE
+			{
+				double sample = ((const float*)pSamples)[done+n];
+				memcpy(bytes+used, &sample, 8);
+				used += 8;
+			}
+		}
+		ManifestBytes(pTarget, bytes, used);
+		done += n;
+	}
+}
+
+// Write filename.crc32c for the file the target just finished and start over
+static void FinishManifest(SpiTarget* pTarget, const string& filename)
+{
+	SpiManifest* pManifest = pTarget->manifest;
+	if(pManifest->blockFill>0) FinishManifestBlock(pManifest);
+	string manifestfilename = filename + ".crc32c";
+	FILE* pFile = fopen(manifestfilename.c_str(), "w");
+	if(pFile)
+	{
+		fprintf(pFile, "blockbytes\t%u\n", global_manifestblock);
+		fprintf(pFile, "bytes\t%lld\n", pManifest->bytes);
+		fprintf(pFile, "crc32c\t%08x\n", pManifest->fileCrc);
+		for(size_t b=0; b<pManifest->blocks.size(); b++) fprintf(pFile, "block\t%lld\t%08x\n", (long long)b * global_manifestblock, pManifest->blocks[b]);
+		if(fclose(pFile)!=0) pFile = NULL;
+	}
+	if(pFile==NULL) SpiLog("session %d, can't write %s\n", pTarget->pSession->index, manifestfilename);
+	pManifest->fileCrc = 0;
+	pManifest->bytes = 0;
+	pManifest->blocks.clear();
+}
+
+static int SpiSeekFile(FILE* pFile, long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(pFile, offset, SEEK_SET);
+#else
+	return fseeko(pFile, (off_t)offset, SEEK_SET);
+#endif
+}
+
+typedef struct
+{
+	string filename;
+	long long dataOffset;
+	unsigned blockbytes;
+	long long bytes;
+	unsigned crc;
+	vector<unsigned> expected; //the manifest's blocks
+	vector<unsigned> computed;
+	vector<char> unreadable;
+	string error;
+} SpiVerifyFile;
+
+typedef struct
+{
+	vector<SpiVerifyFile>* pFiles;
+	vector< pair<int,long long> > jobs; //file, first block
+	volatile unsigned nextJob;
+} SpiVerify;
+
+// Where the samples start: the data chunk of a wav, rf64 or w64 file, 0 for raw files
+static bool FindDataChunk(FILE* pFile, long long* pOffset)
+{
+	unsigned char header[40];
+	size_t got = fread(header, 1, sizeof(header), pFile);
+	*pOffset = 0;
+	if(got>=12 && (memcmp(header, "RIFF", 4)==0 || memcmp(header, "RF64", 4)==0) && memcmp(header+8, "WAVE", 4)==0)
+	{
+		long long offset = 12;
+		unsigned char chunk[8];
+		while(SpiSeekFile(pFile, offset)==0 && fread(chunk, 1, 8, pFile)==8)
+		{
+			if(memcmp(chunk, "data", 4)==0) { *pOffset = offset + 8; return true; }
+			unsigned size = chunk[4] | (chunk[5]<<8) | (chunk[6]<<16) | ((unsigned)chunk[7]<<24);
+			offset += 8 + size + (size & 1);
+		}
+		return false;
+	}
+	if(got>=40 && memcmp(header, "riff", 4)==0) //w64, 16 byte guids and 64 bit sizes that count the chunk's header
+	{
+		long long offset = 40;
+		unsigned char chunk[24];
+		while(SpiSeekFile(pFile, offset)==0 && fread(chunk, 1, 24, pFile)==24)
+		{
+			if(memcmp(chunk, "data", 4)==0) { *pOffset = offset + 24; return true; }
+			long long size = 0;
+			for(int i=7; i>=0; i--) size = (size<<8) | chunk[16+i];
+			if(size<24) return false;
+			offset += (size + 7) & ~7LL;
+		}
+		return false;
+	}
+	return true;
+}
+
+// Read filename.crc32c and find the file's data, false with the error set
+static bool LoadManifest(SpiVerifyFile* pFile)
+{
+	string manifestfilename = pFile->filename + ".crc32c";
+	FILE* pManifest = fopen(manifestfilename.c_str(), "r");
+	if(pManifest==NULL) { pFile->error = "no " + manifestfilename; return false; }
+	char line[MANIFEST_LINE_BYTES];
+	pFile->blockbytes = 0;
+	pFile->bytes = -1;
+	while(fgets(line, sizeof(line), pManifest))
+	{
+		long long offset;
+		unsigned value;
+		if(sscanf(line, "blockbytes\t%u", &value)==1) pFile->blockbytes = value;
+		else if(sscanf(line, "bytes\t%lld", &offset)==1) pFile->bytes = offset;
+		else if(sscanf(line, "crc32c\t%x", &value)==1) pFile->crc = value;
+		else if(sscanf(line, "block\t%lld\t%x", &offset, &value)==2) pFile->expected.push_back(value);
+	}
+	fclose(pManifest);
+	if(pFile->blockbytes==0 || pFile->bytes<0 || (long long)pFile->expected.size() != (pFile->bytes + pFile->blockbytes - 1) / pFile->blockbytes)
+	{
+		pFile->error = "invalid " + manifestfilename;
+		return false;
+	}
+	FILE* pData = fopen(pFile->filename.c_str(), "rb");
+	if(pData==NULL) { pFile->error = "can't open the file"; return false; }
+	bool found = FindDataChunk(pData, &pFile->dataOffset);
+	fclose(pData);
+	if(!found) { pFile->error = "no data chunk"; return false; }
+	pFile->computed.assign(pFile->expected.size(), 0);
+	pFile->unreadable.assign(pFile->expected.size(), 0);
+	return true;
+}
+
+// Verifying thread, takes the next VERIFY_JOB_BLOCKS blocks of a file until there are none left
+static int VerifyThread(void* arg)
+{
+	SpiVerify* pVerify = (SpiVerify*)arg;
+	vector<unsigned char> buffer;
+	for(;;)
+	{
+		unsigned job = SpiAtomicIncrement(&pVerify->nextJob) - 1;
+		if(job >= pVerify->jobs.size()) return 0;
+		SpiVerifyFile* pFile = &(*pVerify->pFiles)[pVerify->jobs[job].first];
+		long long first = pVerify->jobs[job].second;
+		long long last = min(first + VERIFY_JOB_BLOCKS, (long long)pFile->expected.size());
+		buffer.resize(pFile->blockbytes);
+		FILE* pData = fopen(pFile->filename.c_str(), "rb");
+		for(long long b=first; b<last; b++)
+		{
+			size_t bytes = (size_t)min((long long)pFile->blockbytes, pFile->bytes - b * pFile->blockbytes);
+			if(pData==NULL || SpiSeekFile(pData, pFile->dataOffset + b * pFile->blockbytes)!=0 || fread(&buffer[0], 1, bytes, pData)!=bytes)
+			{
+				pFile->unreadable[b] = 1;
+				continue;
+			}
+			pFile->computed[b] = spi_crc32c(0, &buffer[0], bytes);
+		}
+		if(pData) fclose(pData);
+	}
+}
+
+// --verify, true when every file matches its manifest
+static bool VerifyManifests(int numfiles, char* filenames[], int numthreads)
+{
+	SetupCrc32c();
+	if(numthreads<=0)
+	{
+#ifdef _WIN32
+		SYSTEM_INFO systeminfo;
+		GetSystemInfo(&systeminfo);
+		numthreads = (int)systeminfo.dwNumberOfProcessors;
+#else
+		numthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		numthreads = max(numthreads, 1);
+	}
+	vector<SpiVerifyFile> files(numfiles);
+	SpiVerify verify;
+	verify.pFiles = &files;
+	verify.nextJob = 0;
+	long long total = 0;
+	for(int i=0; i<numfiles; i++)
+	{
+		files[i].filename = filenames[i];
+		if(!LoadManifest(&files[i])) continue;
+		for(long long b=0; b<(long long)files[i].expected.size(); b+=VERIFY_JOB_BLOCKS) verify.jobs.push_back(make_pair(i, b));
+		total += files[i].bytes;
+	}
+	double start = SpiGetSeconds();
+	vector<void*> threads;
+	for(int i=0; i<numthreads && i<(int)verify.jobs.size(); i++)
+	{
+		void* handle = SpiCreateThread(VerifyThread, &verify, NULL);
+		if(handle) threads.push_back(handle);
+	}
+	if(threads.empty()) VerifyThread(&verify); //without threads the jobs are done here
+	for(size_t i=0; i<threads.size(); i++) SpiJoinThread(threads[i]);
+	double seconds = SpiGetSeconds() - start;
+	int numfailed = 0;
+	for(int i=0; i<numfiles; i++)
+	{
+		SpiVerifyFile* pFile = &files[i];
+		unsigned crc = 0;
+		for(size_t b=0; b<pFile->computed.size() && pFile->error.empty(); b++)
+		{
+			char error[64];
+			sprintf(error, "block at byte %lld ", (long long)b * pFile->blockbytes);
+			if(pFile->unreadable[b]) pFile->error = string(error) + "unreadable";
+			else if(pFile->computed[b]!=pFile->expected[b]) pFile->error = string(error) + "doesn't match";
+			crc = Crc32cCombine(crc, pFile->computed[b], min((long long)pFile->blockbytes, pFile->bytes - (long long)b * pFile->blockbytes));
+		}
+		if(pFile->error.empty() && crc!=pFile->crc) pFile->error = "the data's crc32c doesn't match";
+		if(!pFile->error.empty()) numfailed++;
+		printf("verify, %s, %lld bytes in %u blocks, %s\n", pFile->filename.c_str(), max(pFile->bytes, 0LL), (unsigned)pFile->expected.size(), pFile->error.empty() ? "ok" : ("FAILED, " + pFile->error).c_str());
+	}
+	printf("verify, %d files, %d FAILED, %.1f MB/s on %d threads with %s\n", numfiles, numfailed, seconds>0.0 ? total / seconds / 1e6 : 0.0, max((int)threads.size(), 1),
+		(spi_crc32c==Crc32cSoftware) ? "slicing-by-8" : "sse4.2");
+	return numfailed==0 && numfiles>0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    retrospective capture
+//
+// --retro=10 records each session into filename.retro instead of its file,
+// a circular file holding the last 10 minutes of captured samples (rounded
+// up to a power of two samples): nothing played before
+// someone thinks of saving is lost, and the disk use is bounded. a save,
+// the midi action save, the control command save or the s key, keeps the
+// --retrobefore=300 seconds before it and the --retroafter=120 seconds
+// after it as a standalone wav, filename_save_001.wav, ... main writes it
+// once the writer has the seconds after on disk, or when the take ends: a
+// header padded to a 4096 byte block by a JUNK chunk, then the window's one
+// or two ranges of the circular file with copy_file_range(), in the kernel
+// and without a copy at all on file systems with reflinks (xfs, btrfs),
+// the window starting on a block boundary for that (up to a block's worth
+// of frames early). win32 and the file systems that refuse go through a
+// buffer. the circular file holds the samples as captured, so int8 can't
+// be saved, and --mirror, --fanout, --matrix, --outrate and --writer=gather
+// don't apply. splits and file changes don't either.
+///////////////////////////////////////////////////////////////////////////////
+
+#define RETRO_HEADER_BYTES (4096) //a block, the samples after it can be shared by reflink
+#define RETRO_MARGIN_SECONDS (30) //more than a save in the circular file, for the copy's time
+#define RETRO_BUFFER_BYTES (1<<20)
+
+unsigned global_retrocapacity = 0; //samples in the circular file, a power of 2, 0 without --retro
+double global_retrobefore = 300.0; //--retrobefore, seconds
+double global_retroafter = 120.0; //--retroafter
+
+// Parse --retro, --retrobefore and --retroafter, after SetupSamplePipeline.
+// False when a save doesn't fit in the circular file.
+bool SetupRetro(double minutes, double before, double after)
+{
+	double samples = minutes * 60.0 * global_samplerate * global_numchannels;
+	if(before<0.0 || after<0.0 || before+after+RETRO_MARGIN_SECONDS > minutes*60.0)
+	{
+		printf("error, --retro=%g minutes can't hold --retrobefore=%g and --retroafter=%g seconds plus %d\n", minutes, before, after, RETRO_MARGIN_SECONDS);
+		return false;
+	}
+	if(samples > 2147483648.0)
+	{
+		printf("error, --retro=%g minutes is more than 2^31 samples\n", minutes);
+		return false;
+	}
+	global_retrocapacity = 4096;
+	while(global_retrocapacity < samples) global_retrocapacity <<= 1;
+	global_retrobefore = before;
+	global_retroafter = after;
+	printf("retrospective capture, %.1f minutes circular files, saves of %g seconds before and %g after\n",
+		global_retrocapacity / ((double)global_samplerate * global_numchannels) / 60.0, before, after);
+	return true;
+}
+
+static bool OpenRetroFile(SpiTarget* pTarget)
+{
+	string filename = pTarget->filename + ".retro";
+#ifdef _WIN32
+	pTarget->fd = _open(filename.c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	pTarget->fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	pTarget->headerBytes = 0;
+	pTarget->headerPending = false;
+	return pTarget->fd>=0;
+}
+
+// Write the ring regions around the circular file, disarmed tracks silenced
+static ring_buffer_size_t WriteRegionsToRetroFile(SpiTarget* pTarget, void* ptr[2], ring_buffer_size_t sizes[2])
+{
+	SpiSession* pSession = pTarget->pSession;
+	for(int i=0; i<2 && ptr[i]!=NULL; i++)
+	{
+		char* p = (char*)ptr[i];
+		long left = sizes[i];
+		SilenceDisarmedTracks(pSession, p, left, (int)(pTarget->samplesWritten % global_numchannels));
+		while(left>0)
+		{
+			unsigned position = (unsigned)(pTarget->samplesWritten & (global_retrocapacity-1));
+			long count = min(left, (long)(global_retrocapacity - position));
+			struct iovec iov = { p, (size_t)count * global_samplebytes };
+			if(!SpiWriteGather(pTarget->fd, &iov, 1, (long long)position * global_samplebytes))
+			{
+				SpiLog("session %d, write error on %s.retro, %ld samples lost\n", pSession->index, pTarget->filename, count);
+				TargetWriteFailed(pTarget);
+			}
+			if(position + count == global_retrocapacity) SpiStoreRelease(&pSession->retrowrapped, 1);
+			PaUtil_WriteMemoryBarrier();
+			SpiAtomicStore64(&pTarget->samplesWritten, pTarget->samplesWritten + count);
+			p += count * global_samplebytes;
+			left -= count;
+		}
+	}
+	int splitsegment = SpiLoadAcquire(&pSession->splitsegment);
+	if(pTarget->segmentIndex < splitsegment) SpiStoreRelease(&pTarget->segmentIndex, splitsegment); //one circular file, no splits
+	return sizes[0] + (ptr[1] ? sizes[1] : 0);
+}
+
+// BuildWavHeader's header with a JUNK chunk before the data chunk, headerBytes long
+static void BuildPaddedWavHeader(unsigned char* header, long long dataBytes, int headerBytes)
+{
+	memset(header, 0, headerBytes);
+	BuildWavHeader(header, dataBytes);
+	unsigned datasize = header[40] | (header[41]<<8) | (header[42]<<16) | ((unsigned)header[43]<<24);
+	memcpy(header + headerBytes-8, header+36, 8);
+	memset(header+36, 0, 8);
+	memcpy(header+36, "JUNK", 4);
+	PutLittleEndian(header+40, headerBytes-52, 4);
+	PutLittleEndian(header+4, datasize + headerBytes-8, 4);
+}
+
+// Copy bytes between two files at the given offsets, in the kernel where it
+// can, through the buffer otherwise
+static bool CopyFileBytes(int from, long long fromOffset, int to, long long toOffset, long long bytes, vector<char>& buffer)
+{
+#ifdef __linux__
+	while(bytes>0)
+	{
+		loff_t in = (loff_t)fromOffset, out = (loff_t)toOffset;
+		ssize_t copied = copy_file_range(from, &in, to, &out, (size_t)min(bytes, 1LL<<30), 0);
+		if(copied<0 && errno==EINTR) continue;
+		if(copied<=0) break; //ENOSYS, EXDEV, ... the rest goes through the buffer
+		fromOffset += copied;
+		toOffset += copied;
+		bytes -= copied;
+	}
+#endif
+	if(bytes>0 && buffer.empty()) buffer.resize(RETRO_BUFFER_BYTES);
+	while(bytes>0)
+	{
+		long long chunk = min(bytes, (long long)buffer.size());
+#ifdef _WIN32
+		if(_lseeki64(from, fromOffset, SEEK_SET)<0) return false;
+		long long got = _read(from, &buffer[0], (unsigned)chunk);
+#else
+		long long got = pread(from, &buffer[0], (size_t)chunk, (off_t)fromOffset);
+		if(got<0 && errno==EINTR) continue;
+#endif
+		if(got<=0) return false;
+		struct iovec iov = { &buffer[0], (size_t)got };
+		if(!SpiWriteGather(to, &iov, 1, toOffset)) return false;
+		fromOffset += got;
+		toOffset += got;
+		bytes -= got;
+	}
+	return true;
+}
+
+// filename_save_001.wav for the session's first save
+static string RetroSaveFilename(SpiSession* pSession, unsigned number)
+{
+	char suffix[16];
+	sprintf(suffix, "_save_%03u", number);
+	const string& filename = pSession->filename;
+	size_t dot = filename.find_last_of('.');
+	if(dot==string::npos) return filename + suffix + ".wav";
+	return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+// Write save number i once the circular file has its seconds after, or
+// what there is when final. False while it has to wait.
+static bool SaveRetroWindow(SpiSession* pSession, unsigned i, bool final)
+{
+	SpiTarget* pTarget = &pSession->data.targets[0];
+	long long trigger = pSession->retrosamples[i];
+	long long before = (long long)(global_retrobefore * global_samplerate) * global_numchannels;
+	long long after = (long long)(global_retroafter * global_samplerate) * global_numchannels;
+	long long written = SpiAtomicLoad64(&pTarget->samplesWritten);
+	PaUtil_ReadMemoryBarrier();
+	if(written - trigger < after && !final) return false;
+	double startseconds = SpiGetSeconds();
+	// Whole frames of the stream, the circular file's offsets only are modular
+	long long end = (written - trigger < after) ? written - written % global_numchannels : trigger + after;
+	long long oldest = SpiLoadAcquire(&pSession->retrowrapped) ? max(written - (long long)global_retrocapacity, 0LL) : 0;
+	oldest += (global_numchannels - oldest % global_numchannels) % global_numchannels;
+	long long start = (trigger - oldest < before) ? oldest : trigger - before;
+	// Back to a block boundary of the circular file, for reflinks, on a frame
+	// and while the samples are still there
+	unsigned blocksamples = RETRO_HEADER_BYTES;
+	while(blocksamples % 2==0 && (blocksamples/2 * global_samplebytes) % RETRO_HEADER_BYTES==0) blocksamples /= 2;
+	long long early = (start & (global_retrocapacity-1)) % blocksamples;
+	for(int k = 0; k < global_numchannels; k++, early += blocksamples)
+	{
+		if((start - early) % global_numchannels || start - early < oldest) continue;
+		start -= early;
+		break;
+	}
+
+	string filename = RetroSaveFilename(pSession, i+1);
+	string retrofilename = pTarget->filename + ".retro";
+#ifdef _WIN32
+	int from = _open(retrofilename.c_str(), _O_RDONLY | _O_BINARY);
+	int to = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int from = open(retrofilename.c_str(), O_RDONLY);
+	int to = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	unsigned char header[RETRO_HEADER_BYTES];
+	long long bytes = (long long)(end - start) * global_samplebytes;
+	BuildPaddedWavHeader(header, bytes, RETRO_HEADER_BYTES);
+	struct iovec iov = { header, sizeof(header) };
+	bool ok = (from>=0 && to>=0 && SpiWriteGather(to, &iov, 1, 0));
+	vector<char> buffer;
+	long long offset = RETRO_HEADER_BYTES;
+	for(long long position = start; ok && position < end; )
+	{
+		unsigned first = (unsigned)(position & (global_retrocapacity-1));
+		unsigned count = (unsigned)min(end - position, (long long)(global_retrocapacity - first));
+		ok = CopyFileBytes(from, (long long)first * global_samplebytes, to, offset, (long long)count * global_samplebytes, buffer);
+		offset += (long long)count * global_samplebytes;
+		position += count;
+	}
+#ifdef _WIN32
+	if(from>=0) _close(from);
+	if(to>=0) _close(to);
+#else
+	if(from>=0) close(from);
+	if(to>=0) close(to);
+#endif
+	// The writer must not have come round to the window's start during the copy
+	PaUtil_ReadMemoryBarrier();
+	if(SpiLoadAcquire(&pSession->retrowrapped) && SpiAtomicLoad64(&pTarget->samplesWritten) - global_retrocapacity > start) ok = false;
+	if(!ok) SpiLog("session %d, can't save %s, %u frames lost\n", pSession->index, filename, (end - start)/global_numchannels);
+	else SpiLog("session %d, %f seconds saved to %s in %f ms\n", pSession->index, (double)(end - start)/global_numchannels/global_samplerate, filename, (SpiGetSeconds()-startseconds)*1000.0);
+	return true;
+}
+
+// Write the saves that can be, by main. Final once the take is over.
+static void SpiRetro_Poll(SpiSession* pSession, bool final)
+{
+	if(global_retrocapacity==0) return;
+	while(pSession->retrosaved < pSession->numretrosaves)
+	{
+		PaUtil_ReadMemoryBarrier();
+		if(!SaveRetroWindow(pSession, pSession->retrosaved, final)) break;
+		SpiStoreRelease(&pSession->retrosaved, pSession->retrosaved + 1);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    waveform overview
+//
+// with --peaks, the writer reduces what it drains into a min/max/rms pyramid
+// of 256, 4096 and 65536 frame buckets per channel and appends it to
+// filename.peak, so an editor has the overview the moment recording stops.
+// only the 256 frame level looks at samples, the upper levels fold its
+// buckets. the file is a 40 byte header followed by records appended as
+// buckets complete, all little endian:
+//
+//    header  "SPIPEAK\0", version 1, sample rate, channels, levels (3),
+//            bucket frames of each level, frames covered so far
+//    record  level, bucket index, frames in the bucket (uint32 each), then
+//            per channel min, max, rms as int16 (full scale 32767)
+//
+// the header's frame count is patched after each drain's records are
+// flushed, a reader may take every whole record as valid. the last bucket
+// of each level is partial. disarmed tracks read as silence.
+///////////////////////////////////////////////////////////////////////////////
+
+#define PEAK_LEVELS (3)
+#define PEAK_HEADER_BYTES (40)
+#define PEAK_RECORD_BYTES(channels) (12 + 6*(channels))
+#define PEAK_BUFFER_BYTES (16384)
+
+static const long peakbucketframes[PEAK_LEVELS] = { 256, 4096, 65536 };
+bool global_peaks = false; //--peaks
+
+typedef struct
+{
+	float minimum;
+	float maximum;
+	double sumsquares;
+} PeakAccumulator;
+
+struct SpiPeakFile
+{
+	FILE* file;
+	PeakAccumulator levels[PEAK_LEVELS][MAX_CHANNELS];
+	long levelframes[PEAK_LEVELS]; //frames in each level's open bucket
+	unsigned buckets[PEAK_LEVELS]; //completed buckets of each level
+	unsigned frames; //frames covered by the completed 256 frame buckets
+	int channel; //channel of the next sample
+	long pendingbytes;
+	unsigned char pending[PEAK_BUFFER_BYTES]; //records not yet handed to the file
+};
+
+// Reduce samples, in[0] belongs to channel pPeaks->channel
+typedef void (*PeakFunction)(SpiPeakFile* pPeaks, const void* pIn, long samples, const int* keep);
+PeakFunction global_peakfunction = NULL;
+
+static void AppendPeakRecord(SpiPeakFile* pPeaks, int level)
+{
+	if(pPeaks->pendingbytes + PEAK_RECORD_BYTES(global_numchannels) > PEAK_BUFFER_BYTES)
+	{
+		fwrite(pPeaks->pending, 1, pPeaks->pendingbytes, pPeaks->file);
+		pPeaks->pendingbytes = 0;
+	}
+	unsigned char* p = pPeaks->pending + pPeaks->pendingbytes;
+	long frames = pPeaks->levelframes[level];
+	PutLittleEndian(p, level, 4);
+	PutLittleEndian(p+4, pPeaks->buckets[level], 4);
+	PutLittleEndian(p+8, frames, 4);
+	p += 12;
+	for(int c=0; c<global_numchannels; c++)
+	{
+		const PeakAccumulator& acc = pPeaks->levels[level][c];
+		float rms = (float)sqrt(acc.sumsquares / max(frames, 1L));
+		short values[3];
+		ConvertSample(acc.minimum, values[0]);
+		ConvertSample(acc.maximum, values[1]);
+		ConvertSample(rms, values[2]);
+		for(int v=0; v<3; v++, p+=2) PutLittleEndian(p, (unsigned short)values[v], 2);
+	}
+	pPeaks->pendingbytes += PEAK_RECORD_BYTES(global_numchannels);
+}
+
+// Close the open 256 frame bucket, fold it into the upper levels and close those that are full
+static void CompletePeakBucket(SpiPeakFile* pPeaks, bool final)
+{
+	for(int level=1; level<PEAK_LEVELS && pPeaks->levelframes[0]>0; level++)
+	{
+		for(int c=0; c<global_numchannels; c++)
+		{
+			const PeakAccumulator& below = pPeaks->levels[0][c];
+			PeakAccumulator& acc = pPeaks->levels[level][c];
+			if(pPeaks->levelframes[level]==0) acc = below;
+			else
+			{
+				acc.minimum = min(acc.minimum, below.minimum);
+				acc.maximum = max(acc.maximum, below.maximum);
+				acc.sumsquares += below.sumsquares;
+			}
+		}
+		pPeaks->levelframes[level] += pPeaks->levelframes[0];
+	}
+	pPeaks->frames += pPeaks->levelframes[0];
+	for(int level=PEAK_LEVELS-1; level>=0; level--)
+	{
+		if(pPeaks->levelframes[level]==0) continue;
+		if(pPeaks->levelframes[level]<peakbucketframes[level] && !final) continue;
+		AppendPeakRecord(pPeaks, level);
+		pPeaks->buckets[level]++;
+		pPeaks->levelframes[level] = 0;
+	}
+}
+
+static inline void AddPeakSample(PeakAccumulator& acc, float v, bool first)
+{
+	acc.minimum = first ? v : min(acc.minimum, v);
+	acc.maximum = first ? v : max(acc.maximum, v);
+	acc.sumsquares = (first ? 0.0 : acc.sumsquares) + v*v;
+}
+
+// Whole frames of one bucket, first when they open it. The channel loop
+// unrolls when Channels is known.
+template<int Channels, typename In>
+static void ReducePeakFrames(const In* in, long frames, PeakAccumulator* acc, const int* keep, bool first)
+{
+	const int channels = Channels ? Channels : global_numchannels;
+	for(long f=0; f<frames; f++, in+=channels, first=false)
+	{
+		for(int c=0; c<(Channels ? Channels : channels); c++)
+		{
+			float v;
+			ConvertSample(KeepSample(in[c], keep[c]), v);
+			AddPeakSample(acc[c], v, first);
+		}
+	}
+}
+
+#ifdef SPI_SSE
+// Float frames with 1, 2 or 4 channels, four samples per step. Lane l always
+// holds channel l%Channels, the lanes are folded into the channels at the end.
+template<int Channels>
+static void ReducePeakFrames(const float* in, long frames, PeakAccumulator* acc, const int* keep, bool first)
+{
+	if(Channels!=1 && Channels!=2 && Channels!=4)
+	{
+		ReducePeakFrames<Channels, float>(in, frames, acc, keep, first);
+		return;
+	}
+	long samples = frames*Channels;
+	long vectorsamples = samples & ~3L;
+	if(vectorsamples==0)
+	{
+		ReducePeakFrames<Channels, float>(in, frames, acc, keep, first);
+		return;
+	}
+	__m128 vkeep = _mm_setr_ps((float)keep[0], (float)keep[1%Channels], (float)keep[2%Channels], (float)keep[3%Channels]);
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(in), vkeep);
+	__m128 vmin = v, vmax = v, vsum = _mm_mul_ps(v, v);
+	for(long i=4; i<vectorsamples; i+=4)
+	{
+		v = _mm_mul_ps(_mm_loadu_ps(in+i), vkeep);
+		vmin = _mm_min_ps(vmin, v);
+		vmax = _mm_max_ps(vmax, v);
+		vsum = _mm_add_ps(vsum, _mm_mul_ps(v, v));
+	}
+	float mins[4], maxs[4], sums[4];
+	_mm_storeu_ps(mins, vmin);
+	_mm_storeu_ps(maxs, vmax);
+	_mm_storeu_ps(sums, vsum);
+	for(int l=0; l<4; l++)
+	{
+		PeakAccumulator& a = acc[l%Channels];
+		bool firstlane = first && l<Channels;
+		a.minimum = firstlane ? mins[l] : min(a.minimum, mins[l]);
+		a.maximum = firstlane ? maxs[l] : max(a.maximum, maxs[l]);
+		a.sumsquares = (firstlane ? 0.0 : a.sumsquares) + sums[l];
+	}
+	ReducePeakFrames<Channels, float>(in+vectorsamples, (samples-vectorsamples)/Channels, acc, keep, false);
+}
+#endif
+
+template<typename In, int Channels>
+static void AccumulatePeaks(SpiPeakFile* pPeaks, const void* pIn, long samples, const int* keep)
+{
+	const In* in = (const In*)pIn;
+	const int channels = Channels ? Channels : global_numchannels;
+	PeakAccumulator* acc = pPeaks->levels[0];
+	long i = 0;
+	while(i<samples)
+	{
+		// partial frames, at the ring's wrap point
+		if(pPeaks->channel!=0 || samples-i<channels)
+		{
+			float v;
+			ConvertSample(KeepSample(in[i], keep[pPeaks->channel]), v);
+			AddPeakSample(acc[pPeaks->channel], v, pPeaks->levelframes[0]==0);
+			i++;
+			if(++pPeaks->channel==channels)
+			{
+				pPeaks->channel = 0;
+				if(++pPeaks->levelframes[0]==peakbucketframes[0]) CompletePeakBucket(pPeaks, false);
+			}
+			continue;
+		}
+		long frames = min((samples-i)/channels, peakbucketframes[0] - pPeaks->levelframes[0]);
+		ReducePeakFrames<Channels>(in+i, frames, acc, keep, pPeaks->levelframes[0]==0);
+		i += frames*channels;
+		pPeaks->levelframes[0] += frames;
+		if(pPeaks->levelframes[0]==peakbucketframes[0]) CompletePeakBucket(pPeaks, false);
+	}
+}
+
+template<typename In>
+static PeakFunction SelectPeakForChannels(int channels)
+{
+	switch(channels)
+	{
+	case 1: return &AccumulatePeaks<In, 1>;
+	case 2: return &AccumulatePeaks<In, 2>;
+	case 4: return &AccumulatePeaks<In, 4>;
+	case 6: return &AccumulatePeaks<In, 6>;
+	case 8: return &AccumulatePeaks<In, 8>;
+	default: return &AccumulatePeaks<In, 0>;
+	}
+}
+
+// Select the reduction for the captured format, after SetupSamplePipeline()
+static void SetupPeaks()
+{
+	switch(global_sampleformat)
+	{
+	case paFloat32: global_peakfunction = SelectPeakForChannels<float>(global_numchannels); break;
+	case paInt32: global_peakfunction = SelectPeakForChannels<int>(global_numchannels); break;
+	case paInt24: global_peakfunction = SelectPeakForChannels<Int24>(global_numchannels); break;
+	case paInt16: global_peakfunction = SelectPeakForChannels<short>(global_numchannels); break;
+	case paInt8: global_peakfunction = SelectPeakForChannels<signed char>(global_numchannels); break;
+	default: global_peakfunction = SelectPeakForChannels<unsigned char>(global_numchannels); break;
+	}
+}
+
+// Hand the pending records to the file, then patch the header's frame count
+static void FlushPeaks(SpiPeakFile* pPeaks)
+{
+	if(pPeaks->pendingbytes==0) return;
+	fwrite(pPeaks->pending, 1, pPeaks->pendingbytes, pPeaks->file);
+	pPeaks->pendingbytes = 0;
+	fflush(pPeaks->file);
+	unsigned char frames[4];
+	PutLittleEndian(frames, pPeaks->frames, 4);
+	fseek(pPeaks->file, PEAK_HEADER_BYTES-4, SEEK_SET);
+	fwrite(frames, 1, 4, pPeaks->file);
+	fseek(pPeaks->file, 0, SEEK_END);
+	fflush(pPeaks->file);
+}
+
+static SpiPeakFile* OpenPeakFile(SpiSession* pSession)
+{
+	SpiPeakFile* pPeaks = (SpiPeakFile*)SpiAllocateMemory(sizeof(SpiPeakFile), "peak file");
+	if(pPeaks==NULL) return NULL;
+	string peakfilename = pSession->filename + ".peak";
+	pPeaks->file = fopen(peakfilename.c_str(), "wb");
+	if(pPeaks->file==NULL)
+	{
+		printf("error, can't open %s\n", peakfilename.c_str());
+		SpiFreeMemory(pPeaks);
+		return NULL;
+	}
+	unsigned char header[PEAK_HEADER_BYTES] = "SPIPEAK";
+	PutLittleEndian(header+8, 1, 4);
+	PutLittleEndian(header+12, global_samplerate, 4);
+	PutLittleEndian(header+16, global_numchannels, 4);
+	PutLittleEndian(header+20, PEAK_LEVELS, 4);
+	for(int level=0; level<PEAK_LEVELS; level++) PutLittleEndian(header+24+4*level, peakbucketframes[level], 4);
+	fwrite(header, 1, PEAK_HEADER_BYTES, pPeaks->file);
+	fflush(pPeaks->file);
+	return pPeaks;
+}
+
+// Reduce the samples a drain just wrote, in the two ring regions
+static void UpdatePeaks(SpiSession* pSession, void* ptr[2], ring_buffer_size_t sizes[2], ring_buffer_size_t written)
+{
+	SpiPeakFile* pPeaks = pSession->data.peaks;
+	int keep[MAX_CHANNELS];
+	unsigned armedmask = SpiLoadAcquire(&pSession->armedchannelmask);
+	for(int c=0; c<global_numchannels; c++) keep[c] = (armedmask>>c) & 1;
+	for(int i=0; i<2 && ptr[i]!=NULL && written>0; i++)
+	{
+		ring_buffer_size_t count = min(sizes[i], written);
+		global_peakfunction(pPeaks, ptr[i], count, keep);
+		written -= count;
+	}
+	FlushPeaks(pPeaks);
+}
+
+// Write the partial buckets and close the file
+static void ClosePeakFile(SpiSession* pSession)
+{
+	SpiPeakFile* pPeaks = pSession->data.peaks;
+	if(pPeaks==NULL) return;
+	CompletePeakBucket(pPeaks, true);
+	FlushPeaks(pPeaks);
+	fclose(pPeaks->file);
+	SpiLog("session %d, %u buckets written to %s.peak\n", pSession->index, pPeaks->buckets[0], pSession->filename);
+	SpiFreeMemory(pPeaks);
+	pSession->data.peaks = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    loudness
+//
+// with --loudness, the writer measures what it drains per ITU-R BS.1770-4 /
+// EBU R128: k-weighting (the high shelf and the rlb high-pass as transposed
+// direct form II biquads), mean squares over 100 ms sub-blocks, momentary
+// (400 ms) and short-term (3 s) loudness, integrated loudness gated at -70
+// LUFS and 10 LU below the ungated level, and the true peak of the 4x
+// oversampled signal (the 48 tap interpolator of annex 2). filters run on
+// all channels of a frame at once, four per step with SSE. the 400 ms blocks
+// go into a 0.01 LU histogram, so the integrated level is available at any
+// time with fixed memory. 6 channels are taken as 5.1: the lfe is left out,
+// the surrounds weigh 1.41. readings are in the stats and status events, the
+// final ones go to filename.loudness when the session finishes.
+///////////////////////////////////////////////////////////////////////////////
+
+#define LOUDNESS_SUBBLOCKS (30) //3 s of 100 ms sub-blocks, for the short-term loudness
+#define LOUDNESS_BINS (7500) //0.01 LU from -70 to +5 LUFS
+#define LOUDNESS_ABSOLUTE_GATE (-70.0)
+#define LOUDNESS_RELATIVE_GATE (-10.0)
+#define TRUEPEAK_TAPS (12)
+#define TRUEPEAK_PHASES (4)
+
+static const float truepeakcoefficients[TRUEPEAK_PHASES][TRUEPEAK_TAPS] =
+{
+	{ 0.0017089843750f, 0.0109863281250f, -0.0196533203125f, 0.0332031250000f, -0.0594482421875f, 0.1373291015625f, 0.9721679687500f, -0.1022949218750f, 0.0476074218750f, -0.0266113281250f, 0.0148925781250f, -0.0083007812500f },
+	{ -0.0291748046875f, 0.0292968750000f, -0.0517578125000f, 0.0891113281250f, -0.1665039062500f, 0.4650878906250f, 0.7797851562500f, -0.2003173828125f, 0.1015625000000f, -0.0582275390625f, 0.0330810546875f, -0.0189208984375f },
+	{ -0.0189208984375f, 0.0330810546875f, -0.0582275390625f, 0.1015625000000f, -0.2003173828125f, 0.7797851562500f, 0.4650878906250f, -0.1665039062500f, 0.0891113281250f, -0.0517578125000f, 0.0292968750000f, -0.0291748046875f },
+	{ -0.0083007812500f, 0.0148925781250f, -0.0266113281250f, 0.0476074218750f, -0.1022949218750f, 0.9721679687500f, 0.1373291015625f, -0.0594482421875f, 0.0332031250000f, -0.0196533203125f, 0.0109863281250f, 0.0017089843750f }
+};
+
+bool global_loudness = false; //--loudness
+
+struct SpiLoudness
+{
+	// per channel, padded to whole groups of four
+	float b[2][3], a[2][2]; //the two k-weighting biquads, a0 normalized to 1
+	float z[2][2][CHANNEL_GROUPS*4]; //their state
+	float sumsquares[CHANNEL_GROUPS*4]; //k-weighted, this sub-block
+	float history[2*TRUEPEAK_TAPS][CHANNEL_GROUPS*4]; //last input samples, twice, see LoudnessFrame()
+	float truepeak[CHANNEL_GROUPS*4];
+	float weights[MAX_CHANNELS];
+	float frame[CHANNEL_GROUPS*4]; //the frame being assembled, silence in the padding
+	int channel; //channel of the next sample
+	int historypos;
+	long subblockframes; //frames in the open sub-block
+	long subblocklength;
+	double subblocks[LOUDNESS_SUBBLOCKS]; //weighted mean squares of the last sub-blocks
+	unsigned numsubblocks;
+	unsigned histogramcounts[LOUDNESS_BINS];
+	double histogramenergies[LOUDNESS_BINS];
+	// readings, published for the control thread
+	volatile float momentary;
+	volatile float shortterm;
+	volatile float integrated;
+	volatile float truepeakdb;
+	float momentarymax;
+	float shorttermmax;
+};
+
+// Reduce samples, in[0] belongs to channel pLoudness->channel
+typedef void (*LoudnessFunction)(SpiLoudness* pLoudness, const void* pIn, long samples, const int* keep);
+LoudnessFunction global_loudnessfunction = NULL;
+
+static double EnergyToLoudness(double energy)
+{
+	return (energy>0.0) ? -0.691 + 10.0*log10(energy) : -HUGE_VAL;
+}
+
+static double LoudnessToEnergy(double loudness)
+{
+	return pow(10.0, (loudness + 0.691) / 10.0);
+}
+
+// Mean energy of the last count sub-blocks, or of those there are
+static double MeanSubblockEnergy(SpiLoudness* pLoudness, unsigned count)
+{
+	count = min(count, min(pLoudness->numsubblocks, (unsigned)LOUDNESS_SUBBLOCKS));
+	if(count==0) return 0.0;
+	double energy = 0.0;
+	for(unsigned i=1; i<=count; i++) energy += pLoudness->subblocks[(pLoudness->numsubblocks - i) % LOUDNESS_SUBBLOCKS];
+	return energy / count;
+}
+
+// Integrated loudness of the gated 400 ms blocks so far
+static double IntegratedLoudness(SpiLoudness* pLoudness)
+{
+	double energy = 0.0;
+	unsigned count = 0;
+	for(int bin=0; bin<LOUDNESS_BINS; bin++)
+	{
+		energy += pLoudness->histogramenergies[bin];
+		count += pLoudness->histogramcounts[bin];
+	}
+	if(count==0) return -HUGE_VAL;
+	double relativegate = EnergyToLoudness(energy/count) + LOUDNESS_RELATIVE_GATE;
+	int firstbin = max(0, (int)ceil((relativegate - LOUDNESS_ABSOLUTE_GATE) * 100.0));
+	energy = 0.0;
+	count = 0;
+	for(int bin=firstbin; bin<LOUDNESS_BINS; bin++)
+	{
+		energy += pLoudness->histogramenergies[bin];
+		count += pLoudness->histogramcounts[bin];
+	}
+	return (count>0) ? EnergyToLoudness(energy/count) : -HUGE_VAL;
+}
+
+// Close a 100 ms sub-block: it completes a 400 ms block, the readings are updated
+static void CompleteLoudnessSubblock(SpiLoudness* pLoudness)
+{
+	double energy = 0.0;
+	for(int c=0; c<global_numchannels; c++)
+	{
+		energy += pLoudness->weights[c] * pLoudness->sumsquares[c] / pLoudness->subblockframes;
+		pLoudness->sumsquares[c] = 0.0f;
+	}
+	pLoudness->subblocks[pLoudness->numsubblocks % LOUDNESS_SUBBLOCKS] = energy;
+	pLoudness->numsubblocks++;
+	pLoudness->subblockframes = 0;
+
+	double blockenergy = MeanSubblockEnergy(pLoudness, 4);
+	double momentary = EnergyToLoudness(blockenergy);
+	if(pLoudness->numsubblocks>=4 && momentary>=LOUDNESS_ABSOLUTE_GATE)
+	{
+		int bin = min((int)((momentary - LOUDNESS_ABSOLUTE_GATE) * 100.0), LOUDNESS_BINS-1);
+		pLoudness->histogramcounts[bin]++;
+		pLoudness->histogramenergies[bin] += blockenergy;
+	}
+	double shortterm = EnergyToLoudness(MeanSubblockEnergy(pLoudness, LOUDNESS_SUBBLOCKS));
+	float truepeak = 0.0f;
+	for(int c=0; c<global_numchannels; c++) truepeak = max(truepeak, pLoudness->truepeak[c]);
+	pLoudness->momentary = (float)momentary;
+	pLoudness->shortterm = (float)shortterm;
+	pLoudness->integrated = (float)IntegratedLoudness(pLoudness);
+	pLoudness->truepeakdb = (float)((truepeak>0.0f) ? 20.0*log10(truepeak) : -HUGE_VAL);
+	if(pLoudness->numsubblocks>=4) pLoudness->momentarymax = max(pLoudness->momentarymax, (float)momentary);
+	if(pLoudness->numsubblocks>=LOUDNESS_SUBBLOCKS) pLoudness->shorttermmax = max(pLoudness->shorttermmax, (float)shortterm);
+}
+
+// Filter one whole frame, pLoudness->frame. The input history is stored
+// twice, TRUEPEAK_TAPS apart, so the taps always read it contiguously.
+static void LoudnessFrame(SpiLoudness* pLoudness)
+{
+	int pos = pLoudness->historypos;
+	int groups = (global_numchannels+3)/4;
+#ifdef SPI_SSE
+	for(int g=0; g<groups*4; g+=4)
+	{
+		__m128 x = _mm_loadu_ps(pLoudness->frame+g);
+		_mm_storeu_ps(pLoudness->history[pos]+g, x);
+		_mm_storeu_ps(pLoudness->history[pos+TRUEPEAK_TAPS]+g, x);
+		// k-weighting
+		for(int f=0; f<2; f++)
+		{
+			__m128 z0 = _mm_loadu_ps(pLoudness->z[f][0]+g), z1 = _mm_loadu_ps(pLoudness->z[f][1]+g);
+			__m128 y = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(pLoudness->b[f][0]), x), z0);
+			z0 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(pLoudness->b[f][1]), x), _mm_mul_ps(_mm_set1_ps(pLoudness->a[f][0]), y)), z1);
+			z1 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(pLoudness->b[f][2]), x), _mm_mul_ps(_mm_set1_ps(pLoudness->a[f][1]), y));
+			_mm_storeu_ps(pLoudness->z[f][0]+g, z0);
+			_mm_storeu_ps(pLoudness->z[f][1]+g, z1);
+			x = y;
+		}
+		_mm_storeu_ps(pLoudness->sumsquares+g, _mm_add_ps(_mm_loadu_ps(pLoudness->sumsquares+g), _mm_mul_ps(x, x)));
+		// true peak, the absolute value of each oversampled point
+		__m128 signmask = _mm_set1_ps(-0.0f);
+		__m128 peak = _mm_loadu_ps(pLoudness->truepeak+g);
+		for(int phase=0; phase<TRUEPEAK_PHASES; phase++)
+		{
+			__m128 y = _mm_setzero_ps();
+			for(int k=0; k<TRUEPEAK_TAPS; k++)
+				y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(truepeakcoefficients[phase][k]), _mm_loadu_ps(pLoudness->history[pos+k]+g)));
+			peak = _mm_max_ps(peak, _mm_andnot_ps(signmask, y));
+		}
+		_mm_storeu_ps(pLoudness->truepeak+g, peak);
+	}
+#else
+	for(int c=0; c<groups*4; c++)
+	{
+		float x = pLoudness->frame[c];
+		pLoudness->history[pos][c] = x;
+		pLoudness->history[pos+TRUEPEAK_TAPS][c] = x;
+		for(int f=0; f<2; f++)
+		{
+			float y = pLoudness->b[f][0]*x + pLoudness->z[f][0][c];
+			pLoudness->z[f][0][c] = pLoudness->b[f][1]*x - pLoudness->a[f][0]*y + pLoudness->z[f][1][c];
+			pLoudness->z[f][1][c] = pLoudness->b[f][2]*x - pLoudness->a[f][1]*y;
+			x = y;
+		}
+		pLoudness->sumsquares[c] += x*x;
+		for(int phase=0; phase<TRUEPEAK_PHASES; phase++)
+		{
+			float y = 0.0f;
+			for(int k=0; k<TRUEPEAK_TAPS; k++) y += truepeakcoefficients[phase][k] * pLoudness->history[pos+k][c];
+			pLoudness->truepeak[c] = max(pLoudness->truepeak[c], (float)fabs(y));
+		}
+	}
+#endif
+	// history[pos+k] is the input k frames ago, the next frame goes one slot earlier
+	pLoudness->historypos = (pos + TRUEPEAK_TAPS - 1) % TRUEPEAK_TAPS;
+	if(++pLoudness->subblockframes==pLoudness->subblocklength) CompleteLoudnessSubblock(pLoudness);
+}
+
+template<typename In>
+static void AccumulateLoudness(SpiLoudness* pLoudness, const void* pIn, long samples, const int* keep)
+{
+	const In* in = (const In*)pIn;
+	for(long i=0; i<samples; i++)
+	{
+		ConvertSample(KeepSample(in[i], keep[pLoudness->channel]), pLoudness->frame[pLoudness->channel]);
+		if(++pLoudness->channel==global_numchannels)
+		{
+			pLoudness->channel = 0;
+			LoudnessFrame(pLoudness);
+		}
+	}
+}
+
+// Select the conversion for the captured format, after SetupSamplePipeline()
+static void SetupLoudness()
+{
+	switch(global_sampleformat)
+	{
+	case paFloat32: global_loudnessfunction = &AccumulateLoudness<float>; break;
+	case paInt32: global_loudnessfunction = &AccumulateLoudness<int>; break;
+	case paInt24: global_loudnessfunction = &AccumulateLoudness<Int24>; break;
+	case paInt16: global_loudnessfunction = &AccumulateLoudness<short>; break;
+	case paInt8: global_loudnessfunction = &AccumulateLoudness<signed char>; break;
+	default: global_loudnessfunction = &AccumulateLoudness<unsigned char>; break;
+	}
+}
+
+// K-weighting coefficients for the sample rate, as in BS.1770-4 but not tied to 48 kHz
+static void SetupKWeighting(SpiLoudness* pLoudness, double samplerate)
+{
+	double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+	double k = tan(SPI_PI * f0 / samplerate);
+	double vh = pow(10.0, gain / 20.0), vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k/q + k*k;
+	pLoudness->b[0][0] = (float)((vh + vb*k/q + k*k) / a0);
+	pLoudness->b[0][1] = (float)(2.0*(k*k - vh) / a0);
+	pLoudness->b[0][2] = (float)((vh - vb*k/q + k*k) / a0);
+	pLoudness->a[0][0] = (float)(2.0*(k*k - 1.0) / a0);
+	pLoudness->a[0][1] = (float)((1.0 - k/q + k*k) / a0);
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(SPI_PI * f0 / samplerate);
+	a0 = 1.0 + k/q + k*k;
+	pLoudness->b[1][0] = 1.0f;
+	pLoudness->b[1][1] = -2.0f;
+	pLoudness->b[1][2] = 1.0f;
+	pLoudness->a[1][0] = (float)(2.0*(k*k - 1.0) / a0);
+	pLoudness->a[1][1] = (float)((1.0 - k/q + k*k) / a0);
+}
+
+// A meter for the captured format, its sidecar is written when the session closes
+static SpiLoudness* OpenLoudness()
+{
+	SpiLoudness* pLoudness = (SpiLoudness*)SpiAllocateMemory(sizeof(SpiLoudness), "loudness meter");
+	if(pLoudness==NULL) return NULL;
+	SetupKWeighting(pLoudness, global_samplerate);
+	for(int c=0; c<MAX_CHANNELS; c++) pLoudness->weights[c] = 1.0f;
+	if(global_numchannels==6)
+	{
+		pLoudness->weights[3] = 0.0f; //lfe
+		pLoudness->weights[4] = 1.41f;
+		pLoudness->weights[5] = 1.41f;
+	}
+	pLoudness->subblocklength = global_samplerate/10;
+	pLoudness->momentary = pLoudness->shortterm = pLoudness->integrated = pLoudness->truepeakdb = (float)-HUGE_VAL;
+	pLoudness->momentarymax = pLoudness->shorttermmax = (float)-HUGE_VAL;
+	return pLoudness;
+}
+
+// Measure the samples a drain just wrote, in the two ring regions
+static void UpdateLoudness(SpiSession* pSession, void* ptr[2], ring_buffer_size_t sizes[2], ring_buffer_size_t written)
+{
+	int keep[MAX_CHANNELS];
+	unsigned armedmask = SpiLoadAcquire(&pSession->armedchannelmask);
+	for(int c=0; c<global_numchannels; c++) keep[c] = (armedmask>>c) & 1;
+	for(int i=0; i<2 && ptr[i]!=NULL && written>0; i++)
+	{
+		ring_buffer_size_t count = min(sizes[i], written);
+		global_loudnessfunction(pSession->data.loudness, ptr[i], count, keep);
+		written -= count;
+	}
+}
+
+// Append the readings to a status line
+static void FormatLoudness(SpiLoudness* pLoudness, char* buffer, size_t size)
+{
+	snprintf(buffer, size, " momentary=%.1f shortterm=%.1f integrated=%.1f truepeak=%.1f",
+		pLoudness->momentary, pLoudness->shortterm, pLoudness->integrated, pLoudness->truepeakdb);
+	buffer[size-1] = '\0';
+}
+
+// Write the final readings to filename.loudness and free the meter
+static void CloseLoudness(SpiSession* pSession)
+{
+	SpiLoudness* pLoudness = pSession->data.loudness;
+	if(pLoudness==NULL) return;
+	string loudnessfilename = pSession->filename + ".loudness";
+	FILE* pFile = fopen(loudnessfilename.c_str(), "w");
+	if(pFile)
+	{
+		fprintf(pFile, "integrated\t%.1f\tLUFS\n", pLoudness->integrated);
+		fprintf(pFile, "momentary max\t%.1f\tLUFS\n", pLoudness->momentarymax);
+		fprintf(pFile, "short-term max\t%.1f\tLUFS\n", pLoudness->shorttermmax);
+		fprintf(pFile, "true peak\t%.1f\tdBTP\n", pLoudness->truepeakdb);
+		for(int c=0; c<global_numchannels; c++)
+		{
+			fprintf(pFile, "true peak %d\t%.1f\tdBTP\n", c+1, (pLoudness->truepeak[c]>0.0f) ? 20.0*log10(pLoudness->truepeak[c]) : -HUGE_VAL);
+		}
+		fclose(pFile);
+	}
+	SpiLog("session %d, integrated loudness %f LUFS, true peak %f dBTP\n", pSession->index, (double)pLoudness->integrated, (double)pLoudness->truepeakdb);
+	SpiFreeMemory(pLoudness);
+	pSession->data.loudness = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    spill arena
+//
+// with --spillseconds=N, a pool of fixed size chunks holding N seconds per
+// session is allocated up front (locked and prefaulted with --lockmemory)
+// and shared by the sessions through a lock-free free list. when a ring is
+// nearly full, the callback diverts into chunks instead of dropping, and
+// publishes each full chunk to its session's spill queue. the writer drains
+// the ring, then the published chunks in order, and gives them back. the
+// callback goes back to the ring once the writer has taken every published
+// chunk, copying the one it was filling in first, so the recording order is
+// kept: ring, chunks, ring. the free list head packs a 16 bit tag with the
+// 16 bit index of the first free chunk, the tag defeats the aba problem.
+///////////////////////////////////////////////////////////////////////////////
+
+#define SPILL_CHUNK_SAMPLES (8192)
+#define SPILL_NONE (0xffff)
+#define MAX_SPILL_CHUNKS (0xfffe)
+
+typedef struct
+{
+	char* chunks;
+	long chunkSamples; //whole frames
+	long chunkBytes;
+	unsigned numChunks; //0 when there is no arena
+	unsigned queueSize; //of each session's spill queue, a power of 2 above numChunks
+	unsigned short* next; //free list links
+	volatile unsigned head; //tag<<16 | first free chunk
+} SpiSpillArena;
+
+struct SpiSpillEntry
+{
+	unsigned chunk;
+	long samples;
+};
+
+SpiSpillArena global_spillarena;
+
+static char* SpiSpill_Chunk(unsigned chunk)
+{
+	return global_spillarena.chunks + (size_t)chunk * global_spillarena.chunkBytes;
+}
+
+// Take a free chunk, SPILL_NONE when the arena is exhausted
+static unsigned SpiSpill_Pop()
+{
+	for(;;)
+	{
+		unsigned head = global_spillarena.head;
+		unsigned chunk = head & 0xffff;
+		if(chunk==SPILL_NONE) return SPILL_NONE;
+		unsigned newhead = ((head + 0x10000) & 0xffff0000) | global_spillarena.next[chunk];
+		if(SpiAtomicCompareAndSwap(&global_spillarena.head, head, newhead)) return chunk;
+	}
+}
+
+static void SpiSpill_Push(unsigned chunk)
+{
+	for(;;)
+	{
+		unsigned head = global_spillarena.head;
+		global_spillarena.next[chunk] = (unsigned short)(head & 0xffff);
+		unsigned newhead = ((head + 0x10000) & 0xffff0000) | chunk;
+		if(SpiAtomicCompareAndSwap(&global_spillarena.head, head, newhead)) return;
+	}
+}
+
+// Allocate seconds of chunks for each session, all of them free
+static bool SpiSpill_Init(double seconds, int numsessions)
+{
+	SpiSpillArena* pArena = &global_spillarena;
+	pArena->chunkSamples = SPILL_CHUNK_SAMPLES - SPILL_CHUNK_SAMPLES % global_numchannels;
+	pArena->chunkBytes = pArena->chunkSamples * global_samplebytes;
+	double chunks = ceil(seconds * global_samplerate * global_numchannels / pArena->chunkSamples) * numsessions;
+	pArena->numChunks = (unsigned)min(chunks, (double)MAX_SPILL_CHUNKS);
+	pArena->queueSize = 1;
+	while(pArena->queueSize <= pArena->numChunks) pArena->queueSize <<= 1;
+	pArena->chunks = (char*)SpiAllocateMemory((size_t)pArena->numChunks * pArena->chunkBytes, "spill arena");
+	pArena->next = (unsigned short*)SpiAllocateMemory(pArena->numChunks * sizeof(unsigned short), "spill arena links");
+	if(pArena->chunks==NULL || pArena->next==NULL)
+	{
+		printf("Could not allocate the spill arena.\n");
+		pArena->numChunks = 0;
+		return false;
+	}
+	for(unsigned i=0; i<pArena->numChunks; i++) pArena->next[i] = (unsigned short)((i+1<pArena->numChunks) ? i+1 : SPILL_NONE);
+	pArena->head = 0;
+	printf("spill arena of %u chunks, %f seconds for each of %d sessions\n", pArena->numChunks,
+		(double)pArena->numChunks * pArena->chunkSamples / (global_samplerate * global_numchannels) / numsessions, numsessions);
+	return true;
+}
+
+static void SpiSpill_Free()
+{
+	SpiFreeMemory(global_spillarena.chunks);
+	SpiFreeMemory(global_spillarena.next);
+	global_spillarena.numChunks = 0;
+}
+
+// Chunks held by a session, published or being filled
+static unsigned SpillChunksHeld(paTestData* pData)
+{
+	return (pData->spillWrite - SpiLoadAcquire(&pData->spillRead)) + ((pData->spillOpen!=SPILL_NONE) ? 1 : 0);
+}
+
+// Hand the chunk being filled to the writer, from the callback or once the stream is closed
+static void PublishSpillChunk(paTestData* pData)
+{
+	if(pData->spillOpen==SPILL_NONE) return;
+	SpiSpillEntry* pEntry = &pData->spillQueue[pData->spillWrite & (global_spillarena.queueSize-1)];
+	pEntry->chunk = pData->spillOpen;
+	pEntry->samples = pData->spillOpenSamples;
+	pData->spillOpen = SPILL_NONE;
+	PaUtil_WriteMemoryBarrier();
+	SpiStoreRelease(&pData->spillWrite, pData->spillWrite + 1);
+}
+
+// Callback side, divert count samples into chunks, returns the samples kept
+static ring_buffer_size_t SpillSamples(SpiSession* pSession, const void* pIn, ring_buffer_size_t count)
+{
+	paTestData* pData = &pSession->data;
+	if(!pData->spilling)
+	{
+		pData->spilling = 1;
+		SpiLog("session %d, ring buffer nearly full, spilling\n", pSession->index);
+	}
+	const char* in = (const char*)pIn;
+	ring_buffer_size_t kept = 0;
+	while(kept<count)
+	{
+		if(pData->spillOpen==SPILL_NONE)
+		{
+			pData->spillOpen = SpiSpill_Pop();
+			if(pData->spillOpen==SPILL_NONE) break; //arena exhausted
+			pData->spillOpenSamples = 0;
+		}
+		long n = min((long)(count - kept), global_spillarena.chunkSamples - pData->spillOpenSamples);
+		memcpy(SpiSpill_Chunk(pData->spillOpen) + pData->spillOpenSamples*global_samplebytes, in + kept*global_samplebytes, n*global_samplebytes);
+		pData->spillOpenSamples += n;
+		kept += n;
+		if(pData->spillOpenSamples==global_spillarena.chunkSamples) PublishSpillChunk(pData);
+	}
+	SpiAtomicStore64(&pData->spilledSamples, pData->spilledSamples + kept);
+	pData->spillPeakChunks = max(pData->spillPeakChunks, SpillChunksHeld(pData));
+	return kept;
+}
+
+// Callback side, back to the ring once the writer has taken every published
+// chunk and the ring has room for the chunk being filled plus some margin
+static bool EndSpill(SpiSession* pSession, ring_buffer_size_t margin)
+{
+	paTestData* pData = &pSession->data;
+	if(pData->spillWrite!=SpiLoadAcquire(&pData->spillRead)) return false;
+	PaUtil_ReadMemoryBarrier();
+	long open = (pData->spillOpen==SPILL_NONE) ? 0 : pData->spillOpenSamples;
+	if((long)SpiFrameRing_WriteAvailable(&pData->ring, (open + margin)/global_numchannels) * global_numchannels < open + margin) return false;
+	if(open>0) SpiFrameRing_Write(&pData->ring, SpiSpill_Chunk(pData->spillOpen), open/global_numchannels);
+	if(pData->spillOpen!=SPILL_NONE) SpiSpill_Push(pData->spillOpen);
+	pData->spillOpen = SPILL_NONE;
+	pData->spilling = 0;
+	SpiLog("session %d, spill drained, back to the ring buffer\n", pSession->index);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    write coalescing
+//
+// drains are cut so that each write ends on a multiple of the file's
+// preferred i/o size (st_blksize, the cluster size on win32). the batch a
+// writer waits for before claiming a ring adapts between one block and
+// bufferSize/NUM_WRITES_PER_BUFFER: it doubles while writes are quick and
+// the ring stays nearly empty, it halves when a write takes longer than
+// half the time its batch took to record or the ring is left over a
+// quarter full. past half full the ring is flushed whole, unaligned.
+///////////////////////////////////////////////////////////////////////////////
+
+#define MIN_BLOCK_BYTES (512)
+#define MAX_BLOCK_BYTES (1<<20)
+#define DEFAULT_BLOCK_BYTES (4096)
+
+// The preferred i/o size of the filesystem holding filename, DEFAULT_BLOCK_BYTES when unknown
+static long PreferredBlockBytes(const string& filename)
+{
+	long blockBytes = DEFAULT_BLOCK_BYTES;
+#ifdef _WIN32
+	char fullpath[MAX_PATH];
+	DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+	if(GetFullPathNameA(filename.c_str(), MAX_PATH, fullpath, NULL)>=3 && fullpath[1]==':')
+	{
+		fullpath[3] = '\0'; //the drive's root, "c:\"
+		if(GetDiskFreeSpaceA(fullpath, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters))
+			blockBytes = (long)(sectorsPerCluster * bytesPerSector);
+	}
+#else
+	struct stat st;
+	if(stat(filename.c_str(), &st)==0 && st.st_blksize>0) blockBytes = (long)st.st_blksize;
+#endif
+	return min(max(blockBytes, (long)MIN_BLOCK_BYTES), (long)MAX_BLOCK_BYTES);
+}
+
+// Query the block size once the target's first file exists and start with the largest batch
+static void SetupWriteCoalescing(SpiTarget* pTarget)
+{
+	paTestData* pData = &pTarget->pSession->data;
+	pTarget->blockBytes = PreferredBlockBytes(SegmentFilename(pTarget, 0));
+	pTarget->minBatchSamples = max(pTarget->blockBytes / pTarget->pPipeline->outbytes, 1L);
+	pTarget->maxBatchSamples = max(RingCapacitySamples(pData) / NUM_WRITES_PER_BUFFER, (ring_buffer_size_t)pTarget->minBatchSamples);
+	SpiStoreRelease(&pTarget->batchSamples, pTarget->maxBatchSamples);
+	SpiLog("session %d, %s, %ld byte blocks, batches of %ld samples and up\n", pTarget->pSession->index, pTarget->filename, pTarget->blockBytes, pTarget->minBatchSamples);
+}
+
+// The samples of available to write now: up to the last block boundary of
+// the output, or all of them when flushing or past half full
+static ring_buffer_size_t CoalescedCount(SpiTarget* pTarget, ring_buffer_size_t available, bool flush)
+{
+	paTestData* pData = &pTarget->pSession->data;
+	if(flush || pTarget->blockBytes==0 || available >= RingCapacitySamples(pData)/2) return available;
+	//only the gather writer knows where its samples land, libsndfile's header is its own
+	long long dataOffset = (pTarget->fd>=0) ? pTarget->headerBytes : 0;
+	//bytes in the file for each captured sample, fewer when only some channels are written
+	long long outbytes = pTarget->pPipeline->outbytes;
+	long long position = dataOffset + (long long)pTarget->samplesWritten * outbytes * pTarget->numchannels / global_numchannels;
+	long long end = position + (long long)available * outbytes * pTarget->numchannels / global_numchannels;
+	long long alignedEnd = end - end % pTarget->blockBytes;
+	if(alignedEnd <= position) return 0;
+	return (ring_buffer_size_t)((alignedEnd - position) * global_numchannels / (outbytes * pTarget->numchannels));
+}
+
+static ring_buffer_size_t TargetReadAvailable(SpiTarget* pTarget);
+
+// Adapt the target's batch to the time the last write took and the lag it left
+static void AdaptBatchSize(SpiTarget* pTarget, ring_buffer_size_t written, double writeSeconds)
+{
+	paTestData* pData = &pTarget->pSession->data;
+	double recordSeconds = (double)written / (global_samplerate * global_numchannels);
+	double level = (double)TargetReadAvailable(pTarget) / RingCapacitySamples(pData);
+	ring_buffer_size_t batch = pTarget->batchSamples;
+	if(writeSeconds > recordSeconds/2 || level > 0.25)
+		batch = max(batch/2, (ring_buffer_size_t)pTarget->minBatchSamples);
+	else if(writeSeconds < recordSeconds/8 && level < 1.0/16)
+		batch = min(batch*2, pTarget->maxBatchSamples);
+	if(batch != pTarget->batchSamples)
+	{
+		SpiStoreRelease(&pTarget->batchSamples, batch);
+		SpiLog("%s, write of %ld samples took %f ms, batches now %ld samples\n", pTarget->filename, (long)written, writeSeconds*1000.0, (long)batch);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    output targets
+//
+// with --mirror=dir1,dir2 the take also goes to a file of the same name in
+// each directory. every target has its own cursor on the session's ring, its
+// own spill cursor, writer state and block size, and is claimed by the
+// writer pool on its own, so a slow disk only delays its own files. the
+// ring's read index follows the slowest active cursor: whichever writer
+// moves a cursor advances it with a compare and swap, and the spilled chunks
+// go back to the arena once every active target has written them. a write
+// error fails the target while another one is still active. a target
+// lagging over 3/4 of what its session can buffer (ring and spill arena)
+// while another is under 1/4 is dropped, so that it stops holding the ring
+// and the others keep recording. the writers look after each write and main
+// on each poll, so a target stuck in a stalled write is dropped even when
+// no writer is free. the gate doesn't wait for that write: the file is
+// whole up to where it began, the write itself may end with newer samples.
+// there is a writer per target by default. the first target feeds the
+// overview and the meter.
+///////////////////////////////////////////////////////////////////////////////
+
+static const char* TargetStateName(int state)
+{
+	if(state==TARGET_FAILED) return "failed";
+	if(state==TARGET_DROPPED) return "dropped";
+	return "active";
+}
+
+// Samples in the ring the target has not written yet
+static ring_buffer_size_t TargetReadAvailable(SpiTarget* pTarget)
+{
+	SpiFrameRing* pRing = &pTarget->pSession->data.ring;
+	return (ring_buffer_size_t)SpiFrameRing_Distance(pRing, SpiLoadAcquire(&pTarget->readFrame), SpiLoadAcquire(&pRing->writeFrame)) * global_numchannels;
+}
+
+// The ring's spans from the target's cursor, up to count samples in whole
+// frames, the owner of the target only
+static ring_buffer_size_t GetTargetReadRegions(SpiTarget* pTarget, ring_buffer_size_t count, void* ptr[2], ring_buffer_size_t sizes[2])
+{
+	unsigned spans[2];
+	unsigned frames = SpiFrameRing_GetReadSpans(&pTarget->pSession->data.ring, pTarget->readFrame, &pTarget->cachedWriteFrame, count/global_numchannels, ptr, spans);
+	sizes[0] = spans[0] * global_numchannels;
+	sizes[1] = spans[1] * global_numchannels;
+	return frames * global_numchannels;
+}
+
+// Move the ring's read index up to the slowest active cursor
+static void AdvanceRingGate(paTestData* pData)
+{
+	SpiFrameRing* pRing = &pData->ring;
+	for(;;)
+	{
+		unsigned readFrame = SpiLoadAcquire(&pRing->readFrame);
+		unsigned writeFrame = SpiLoadAcquire(&pRing->writeFrame);
+		unsigned gate = writeFrame;
+		unsigned slowest = 0;
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			SpiTarget* pTarget = &pData->targets[t];
+			if(SpiLoadAcquire(&pTarget->state)!=TARGET_ACTIVE) continue;
+			unsigned cursor = SpiLoadAcquire(&pTarget->readFrame);
+			unsigned behind = SpiFrameRing_Distance(pRing, cursor, writeFrame);
+			if(behind > slowest)
+			{
+				slowest = behind;
+				gate = cursor;
+			}
+		}
+		unsigned held = SpiFrameRing_Distance(pRing, readFrame, writeFrame) * global_numchannels;
+		if(held > (unsigned)SpiLoadAcquire(&pData->ringPeak)) SpiStoreRelease(&pData->ringPeak, (ring_buffer_size_t)held); //the most it held, seen before each move
+		if(gate==readFrame) return;
+		PaUtil_FullMemoryBarrier(); //done reading before the callback may write
+		if(SpiAtomicCompareAndSwap(&pRing->readFrame, readFrame, gate)) return;
+		//another writer moved it first, look again
+	}
+}
+
+// Give the chunks every active target has written back to the arena. The
+// queue entries are read before spillRead lets the callback reuse them, so
+// one writer at a time does it, looking again after the others' progress.
+static void ReleaseSpilledChunks(paTestData* pData)
+{
+	for(;;)
+	{
+		if(!SpiAtomicCompareAndSwap(&pData->spillReleasing, 0, 1)) return; //its holder looks again when done
+		unsigned spillRead = pData->spillRead;
+		unsigned slowest = SpiLoadAcquire(&pData->spillWrite) - spillRead;
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			SpiTarget* pTarget = &pData->targets[t];
+			if(SpiLoadAcquire(&pTarget->state)==TARGET_ACTIVE) slowest = min(slowest, SpiLoadAcquire(&pTarget->spillRead) - spillRead);
+		}
+		for(unsigned i=0; i<slowest; i++)
+		{
+			SpiSpill_Push(pData->spillQueue[(spillRead + i) & (global_spillarena.queueSize-1)].chunk);
+		}
+		PaUtil_WriteMemoryBarrier();
+		SpiStoreRelease(&pData->spillRead, spillRead + slowest);
+		SpiStoreRelease(&pData->spillReleasing, 0u);
+		if(slowest==0) return;
+	}
+}
+
+// Samples the target is behind the callback, in the ring and in spilled chunks
+static long TargetLag(SpiTarget* pTarget)
+{
+	paTestData* pData = &pTarget->pSession->data;
+	return (long)TargetReadAvailable(pTarget) + (long)(SpiLoadAcquire(&pData->spillWrite) - SpiLoadAcquire(&pTarget->spillRead)) * global_spillarena.chunkSamples;
+}
+
+// Drop the active targets too far behind the fastest one, see output targets
+static void DropLaggingTargets(paTestData* pData)
+{
+	if(pData->numTargets<2) return;
+	long capacity = RingCapacitySamples(pData);
+	if(global_numsessions>0) capacity += (long)((double)global_spillarena.numChunks * global_spillarena.chunkSamples / global_numsessions);
+	long fastest = capacity;
+	for(int t=0; t<pData->numTargets; t++)
+	{
+		if(SpiLoadAcquire(&pData->targets[t].state)==TARGET_ACTIVE) fastest = min(fastest, TargetLag(&pData->targets[t]));
+	}
+	if(fastest >= capacity/4) return;
+	bool dropped = false;
+	for(int t=0; t<pData->numTargets; t++)
+	{
+		SpiTarget* pTarget = &pData->targets[t];
+		long lag = TargetLag(pTarget);
+		if(SpiLoadAcquire(&pTarget->state)!=TARGET_ACTIVE || lag <= capacity/4*3) continue;
+		if(SpiAtomicCompareAndSwap(&pTarget->state, TARGET_ACTIVE, TARGET_DROPPED))
+		{
+			pTarget->intactSamples = SpiAtomicLoad64(&pTarget->samplesWritten);
+			SpiLog("session %d, %s is %ld frames behind, target dropped\n", pTarget->pSession->index, pTarget->filename, lag/global_numchannels);
+			dropped = true;
+		}
+	}
+	if(dropped)
+	{
+		AdvanceRingGate(pData);
+		ReleaseSpilledChunks(pData);
+	}
+}
+
+// Write samples with the target's writer, the first target also feeds the overview and the meter
+static ring_buffer_size_t WriteTargetRegions(SpiTarget* pTarget, void* ptr[2], ring_buffer_size_t sizes[2])
+{
+    SpiSession* pSession = pTarget->pSession;
+    paTestData* pData = &pSession->data;
+    double start = PaUtil_GetTime();
+    if (global_selftest) SelfTestStall();
+    ring_buffer_size_t elementsWritten = pTarget->writeRegions(pTarget, ptr, sizes);
+    ObserveLatency(&pTarget->writeLatency, PaUtil_GetTime() - start);
+    if (pTarget->index == 0)
+    {
+        if (pData->peaks) UpdatePeaks(pSession, ptr, sizes, elementsWritten);
+        if (pData->loudness) UpdateLoudness(pSession, ptr, sizes, elementsWritten);
+    }
+    return elementsWritten;
+}
+
+// Write the chunks published up to spillEnd, the last target to write a chunk gives it back
+static void DrainSpill(SpiTarget* pTarget, unsigned spillEnd)
+{
+    paTestData* pData = &pTarget->pSession->data;
+    while (pTarget->spillRead != spillEnd && SpiLoadAcquire(&pTarget->state) == TARGET_ACTIVE)
+    {
+        SpiSpillEntry* pEntry = &pData->spillQueue[pTarget->spillRead & (global_spillarena.queueSize-1)];
+        void* ptr[2] = { SpiSpill_Chunk(pEntry->chunk), NULL };
+        ring_buffer_size_t sizes[2] = { pEntry->samples, 0 };
+        WriteTargetRegions(pTarget, ptr, sizes);
+        PaUtil_WriteMemoryBarrier();
+        SpiStoreRelease(&pTarget->spillRead, pTarget->spillRead + 1);
+    }
+    ReleaseSpilledChunks(pData);
+}
+
+// Write the target's part of the ring up to the last block boundary, or
+// everything readable when flushing, the caller owns the target. Spilled
+// chunks come after all of the ring's contents.
+static void DrainTarget(SpiTarget* pTarget, bool flush)
+{
+    paTestData* pData = &pTarget->pSession->data;
+    // The chunks published up to now, those published later may follow newer ring contents
+    unsigned spillEnd = SpiLoadAcquire(&pData->spillWrite);
+    PaUtil_ReadMemoryBarrier();
+    bool spilled = (spillEnd != pTarget->spillRead);
+    ring_buffer_size_t elementsInBuffer = CoalescedCount(pTarget, TargetReadAvailable(pTarget), flush || spilled);
+    void* ptr[2] = {0};
+    ring_buffer_size_t sizes[2] = {0};
+ 
+    /* Like PaUtil_GetRingBufferReadRegions, we read directly from the ring buffer */
+    ring_buffer_size_t elementsRead = (elementsInBuffer == 0) ? 0 : GetTargetReadRegions(pTarget, elementsInBuffer, ptr, sizes);
+    if (elementsRead > 0)
+    {
+        // The regions stay ours until the gate moves past our cursor, after the write returned
+        double start = PaUtil_GetTime();
+        ring_buffer_size_t elementsWritten = WriteTargetRegions(pTarget, ptr, sizes);
+        PaUtil_FullMemoryBarrier();
+        SpiStoreRelease(&pTarget->readFrame, SpiFrameRing_Advance(&pData->ring, pTarget->readFrame, elementsWritten/global_numchannels));
+        AdvanceRingGate(pData);
+        if (!flush && !spilled) AdaptBatchSize(pTarget, elementsWritten, PaUtil_GetTime() - start);
+    }
+    if (spilled && TargetReadAvailable(pTarget) == 0) DrainSpill(pTarget, spillEnd);
+    if (!flush) DropLaggingTargets(pData); //the final drain writes every target out
+}
+
+static bool ClaimTarget(SpiTarget* pTarget)
+{
+    return SpiAtomicCompareAndSwap(&pTarget->writerBusy, 0, 1);
+}
+
+static void ReleaseTarget(SpiTarget* pTarget)
+{
+    PaUtil_WriteMemoryBarrier();
+    SpiStoreRelease(&pTarget->writerBusy, 0u);
+}
+
+// Close the target's file, once it is finished, failed or dropped
+static void CloseTarget(SpiTarget* pTarget)
+{
+	if(pTarget->resampler && pTarget->state==TARGET_ACTIVE) FlushResampler(pTarget);
+	if(pTarget->file)
+	{
+		fclose(pTarget->file);
+		pTarget->file = 0;
+		if(pTarget->manifest) FinishManifest(pTarget, SegmentFilename(pTarget, pTarget->segmentIndex));
+		FinalizeFile(pTarget, SegmentFilename(pTarget, pTarget->segmentIndex), -1, NULL, 0);
+	}
+	CloseGatherSegment(pTarget);
+}
+
+// Claim the active target furthest behind, among those with at least their
+// current batch to write or spilled chunks. Returns NULL when none needs a
+// writer.
+static SpiTarget* ClaimFullestTarget()
+{
+    for (;;)
+    {
+        SpiTarget* pFullest = NULL;
+        double fullestLevel = 0.0;
+        for (int i = 0; i < global_numsessions; i++)
+        {
+            paTestData* pData = &global_sessions[i]->data;
+            if (SpiLoadAcquire(&pData->finished)) continue;
+            for (int t = 0; t < pData->numTargets; t++)
+            {
+                SpiTarget* pTarget = &pData->targets[t];
+                if (SpiLoadAcquire(&pTarget->writerBusy) || SpiLoadAcquire(&pTarget->state) != TARGET_ACTIVE) continue;
+                // The owner's last look at the write index first, the callback's line when it shows less than a batch
+                unsigned cachedWriteFrame = SpiLoadAcquire(&pTarget->cachedWriteFrame);
+                ring_buffer_size_t batch = SpiLoadAcquire(&pTarget->batchSamples);
+                ring_buffer_size_t elementsInBuffer = SpiFrameRing_ReadAvailable(&pData->ring, SpiLoadAcquire(&pTarget->readFrame), &cachedWriteFrame, batch/global_numchannels) * global_numchannels;
+                bool spilled = (SpiLoadAcquire(&pData->spillWrite) != SpiLoadAcquire(&pTarget->spillRead));
+                if (elementsInBuffer < batch && !spilled) continue;
+                double level = (double)elementsInBuffer / RingCapacitySamples(pData);
+                if (spilled) level += 1.0; //a session spilling goes first
+                if (level > fullestLevel)
+                {
+                    pFullest = pTarget;
+                    fullestLevel = level;
+                }
+            }
+        }
+        if (pFullest == NULL) return NULL;
+        if (ClaimTarget(pFullest)) return pFullest;
+        //another writer took it first, look again
+    }
+}
+
+// The file of a target for the session's filename, in the target's --mirror
+// directory and with its --fanout suffix
+static string TargetFilename(const SpiTarget* pTarget, const string& filename)
+{
+	string name = filename;
+	if(!pTarget->directory.empty())
+	{
+		size_t slash = name.find_last_of("/\\");
+		name = pTarget->directory + ((slash==string::npos) ? name : name.substr(slash+1));
+	}
+	if(!pTarget->suffix.empty())
+	{
+		size_t dot = name.find_last_of('.');
+		size_t slash = name.find_last_of("/\\");
+		if(dot!=string::npos && slash!=string::npos && dot<slash) dot = string::npos;
+		name = (dot==string::npos) ? name + pTarget->suffix : name.substr(0, dot) + pTarget->suffix + name.substr(dot);
+	}
+	return name;
+}
+
+// Add a target for each directory of the comma separated list, a file
+// named like the session's in each. Returns false past MAX_TARGETS.
+static bool AddMirrorTargets(SpiSession* pSession, const string& directories)
+{
+	paTestData* pData = &pSession->data;
+	pData->targets[0].filename = pSession->filename;
+	pData->targets[0].fileformat = pSession->fileformat;
+	size_t begin = 0;
+	while(begin < directories.size())
+	{
+		size_t comma = directories.find(',', begin);
+		if(comma==string::npos) comma = directories.size();
+		string directory = directories.substr(begin, comma-begin);
+		begin = comma+1;
+		if(directory.empty()) continue;
+		if(pData->numTargets==MAX_TARGETS) return false;
+		char last = directory[directory.size()-1];
+		if(last!='/' && last!='\\') directory += "/";
+		SpiTarget* pTarget = &pData->targets[pData->numTargets++];
+		pTarget->directory = directory;
+		pTarget->filename = TargetFilename(pTarget, pSession->filename);
+		pTarget->fileformat = pSession->fileformat;
+	}
+	return true;
+}
+
+// Add a target for each --fanout encoding, next to the session's file.
+// Returns false past MAX_TARGETS.
+static bool AddFanoutTargets(SpiSession* pSession)
+{
+	paTestData* pData = &pSession->data;
+	for(int i=0; i<global_numfanouts; i++)
+	{
+		SpiFanout* pFanout = &global_fanouts[i];
+		if(pData->numTargets==MAX_TARGETS) return false;
+		SpiTarget* pTarget = &pData->targets[pData->numTargets++];
+		pTarget->suffix = pFanout->suffix;
+		pTarget->filename = TargetFilename(pTarget, pSession->filename);
+		pTarget->fileformat = ContainerFormat(pSession->filename) | pFanout->pipeline.subformat;
+		pTarget->pPipeline = &pFanout->pipeline;
+		pTarget->numchannels = pFanout->numchannels;
+		pTarget->channelmap = (pFanout->allchannels || global_routedchannels>0) ? NULL : pFanout->channelmap;
+		pTarget->matrix = (global_routedchannels>0) ? &pFanout->matrix : NULL;
+	}
+	return true;
+}
+
+#define MAX_WRITERS (16)
+
+// Every session's callback and every writer keeps its log ring, plus main, midi, control, config and finalizer threads
+typedef char spilog_rings_cover_threads[(SPILOG_MAX_THREADS >= MAX_SESSIONS + MAX_WRITERS + 8) ? 1 : -1];
+
+typedef struct
+{
+    int                 numThreads;
+    void               *threadHandles[MAX_WRITERS];
+    volatile int        threadSyncFlag; //set to ask the writers to return
+#ifndef _WIN32
+    pthread_mutex_t     threadMutex; //guards threadSyncFlag for the timed waits
+    pthread_cond_t      threadCond;
+#endif
+} SpiWriterPool;
+
+SpiWriterPool global_writerpool;
+
+// Sleep for up to msec, returns as soon as a stop is requested
+static void waitForThreadSync(SpiWriterPool* pPool, long msec)
+{
+#ifdef _WIN32
+    (void)pPool; //the stop flag is polled, there is no condition to wait on
+    Pa_Sleep(msec);
+#else
+    struct timeval now;
+    struct timespec deadline;
+    gettimeofday(&now, NULL);
+    long long nsec = (long long)now.tv_usec * 1000 + (long long)msec * 1000000;
+    deadline.tv_sec = now.tv_sec + (time_t)(nsec / 1000000000);
+    deadline.tv_nsec = (long)(nsec % 1000000000);
+    pthread_mutex_lock(&pPool->threadMutex);
+    if (!pPool->threadSyncFlag) pthread_cond_timedwait(&pPool->threadCond, &pPool->threadMutex, &deadline);
+    pthread_mutex_unlock(&pPool->threadMutex);
+#endif
+}
+
+// This routine is run by each writer thread to write data from the session rings into their files (during Recording)
+static int threadFunctionWriterPool(void* ptr)
+{
+    SpiWriterPool* pPool = (SpiWriterPool*)ptr;
+    while (!pPool->threadSyncFlag)
+    {
+        SpiTarget* pTarget = ClaimFullestTarget();
+        if (pTarget)
+        {
+            DrainTarget(pTarget, false);
+            if (pTarget->state != TARGET_ACTIVE) CloseTarget(pTarget); //failed or dropped, its file ends here
+            ReleaseTarget(pTarget);
+            continue;
+        }
+ 
+        /* Sleep a little while... */
+        waitForThreadSync(pPool, 20);
+    }
+    return 0;
+}
+
+/* Start numThreads writers, with the scheduling and cpus of global_writerthreadconfig */
+static PaError startWriterPool( SpiWriterPool* pPool, int numThreads ) 
+{
+#ifndef _WIN32
+    pthread_mutex_init(&pPool->threadMutex, NULL);
+    pthread_cond_init(&pPool->threadCond, NULL);
+#endif
+    pPool->threadSyncFlag = 0;
+    pPool->numThreads = 0;
+    for (int i = 0; i < numThreads && i < MAX_WRITERS; i++)
+    {
+        pPool->threadHandles[i] = SpiCreateThread(threadFunctionWriterPool, pPool, &global_writerthreadconfig);
+        if (pPool->threadHandles[i] == NULL) return paUnanticipatedHostError;
+        pPool->numThreads++;
+    }
+    return paNoError;
+}
+
+/* Ask the writers to return and wait for them, the final drain of each session is done by FinishSession() */
+static int stopWriterPool( SpiWriterPool* pPool )
+{
+    if (pPool->numThreads == 0) return paNoError;
+#ifdef _WIN32
+    pPool->threadSyncFlag = 1;
+#else
+    pthread_mutex_lock(&pPool->threadMutex);
+    pPool->threadSyncFlag = 1;
+    pthread_cond_broadcast(&pPool->threadCond);
+    pthread_mutex_unlock(&pPool->threadMutex);
+#endif
+    for (int i = 0; i < pPool->numThreads; i++)
+    {
+        SpiJoinThread(pPool->threadHandles[i]);
+        pPool->threadHandles[i] = 0;
+    }
+    pPool->numThreads = 0;
+#ifndef _WIN32
+    pthread_cond_destroy(&pPool->threadCond);
+    pthread_mutex_destroy(&pPool->threadMutex);
+#endif
+
+    return paNoError;
+}
+ 
+
+ 
+///////////////////////////////////////////////////////////////////////////////
+//    take manager
+//
+// with --takes=4 the session records four takes of the seconds argument
+// back to back, --takes=0 until it is stopped, each take in a segment file
+// of its own (take.wav, take_001.wav, ...). the stream, the ring and the
+// writers go on from one take to the next: the callback splits at the
+// frame the take reaches its length, so consecutive files neither share
+// nor miss a frame. the next command (control socket, midi map or the n
+// key) ends the current take at its buffer's first frame and starts the
+// next one there. a take starts only once every active target has reached
+// the previous split, which a take longer than the ring guarantees without
+// --spillseconds; when it can't, the session completes instead.
+//
+// every file a writer is done with, at a split or when its session
+// finishes, goes to the finalizer thread, which writes the gather writer's
+// header, syncs the file to disk and closes it, so a writer goes on with
+// the next take's file at once. the finalizer's queue is bounded, when it
+// is full (or the thread couldn't start) the writer does it itself.
+// Terminate() waits for the queue to be empty.
+///////////////////////////////////////////////////////////////////////////////
+
+#define FINALIZER_QUEUE_SIZE (64) //must be a power of 2
+#define FINALIZER_POLL_MS    (20)
+
+unsigned global_numtakes = 1; //--takes, 0 for no limit
+
+typedef struct
+{
+	volatile unsigned sequence;
+	int session;
+	int fd; //the gather writer's, -1 to open the file by name
+	int headerBytes;
+	unsigned char header[WAV_HEADER_BYTES];
+	double queuedSeconds;
+	string filename;
+} SpiFinalizeJob;
+
+typedef struct
+{
+	SpiFinalizeJob jobs[FINALIZER_QUEUE_SIZE];
+	volatile unsigned enqueuePos;
+	unsigned dequeuePos;
+	void* thread;
+	volatile int syncFlag; //set to ask the finalizer to return once the queue is empty
+} SpiFinalizer;
+
+SpiFinalizer global_finalizer;
+
+static void SetupFinalizeJob(SpiFinalizeJob* pJob, SpiTarget* pTarget, const string& filename, int fd, const unsigned char* header, int headerBytes)
+{
+	pJob->session = pTarget->pSession->index;
+	pJob->fd = fd;
+	pJob->headerBytes = headerBytes;
+	if(headerBytes>0) memcpy(pJob->header, header, headerBytes);
+	pJob->queuedSeconds = SpiGetSeconds();
+	pJob->filename = filename;
+}
+
+// Write the header, sync and close one finished file
+static void FinalizeJob(SpiFinalizeJob* pJob)
+{
+	int fd = pJob->fd;
+#ifdef _WIN32
+	if(fd<0) fd = _open(pJob->filename.c_str(), _O_WRONLY | _O_BINARY);
+#else
+	if(fd<0) fd = open(pJob->filename.c_str(), O_WRONLY);
+#endif
+	if(fd<0)
+	{
+		//a segment nothing was written to has no file
+		if(errno!=ENOENT) SpiLog("session %d, can't open %s to sync it\n", pJob->session, pJob->filename);
+		return;
+	}
+	if(pJob->headerBytes>0)
+	{
+		struct iovec iov = { pJob->header, (size_t)pJob->headerBytes };
+		if(!SpiWriteGather(fd, &iov, 1, 0)) SpiLog("session %d, can't write the wav header of %s\n", pJob->session, pJob->filename);
+	}
+#ifdef _WIN32
+	bool synced = (_commit(fd)==0);
+	_close(fd);
+#else
+	bool synced = (fsync(fd)==0);
+	close(fd);
+#endif
+	if(!synced) SpiLog("session %d, can't sync %s\n", pJob->session, pJob->filename);
+	else SpiLog("session %d, %s synced and closed in %.1f ms\n", pJob->session, pJob->filename, (SpiGetSeconds() - pJob->queuedSeconds) * 1000.0);
+}
+
+// Hand over a file the target is done with, by its writer or by main once
+// the session is finished. Never waits for the disk unless the queue is full.
+static void FinalizeFile(SpiTarget* pTarget, const string& filename, int fd, const unsigned char* header, int headerBytes)
+{
+	SpiFinalizer* pFinalizer = &global_finalizer;
+	while(pFinalizer->thread)
+	{
+		unsigned pos = SpiLoadAcquire(&pFinalizer->enqueuePos);
+		SpiFinalizeJob* pJob = &pFinalizer->jobs[pos & (FINALIZER_QUEUE_SIZE-1)];
+		PaUtil_ReadMemoryBarrier();
+		int diff = (int)(SpiLoadAcquire(&pJob->sequence) - pos);
+		if(diff<0) break; //full
+		if(diff==0 && SpiAtomicCompareAndSwap(&pFinalizer->enqueuePos, pos, pos+1))
+		{
+			SetupFinalizeJob(pJob, pTarget, filename, fd, header, headerBytes);
+			PaUtil_WriteMemoryBarrier();
+			SpiStoreRelease(&pJob->sequence, pos+1);
+			return;
+		}
+	}
+	SpiFinalizeJob job;
+	SetupFinalizeJob(&job, pTarget, filename, fd, header, headerBytes);
+	FinalizeJob(&job);
+}
+
+static int threadFunctionFinalizer(void* ptr)
+{
+	SpiFinalizer* pFinalizer = (SpiFinalizer*)ptr;
+	for(;;)
+	{
+		SpiFinalizeJob* pJob = &pFinalizer->jobs[pFinalizer->dequeuePos & (FINALIZER_QUEUE_SIZE-1)];
+		if(SpiLoadAcquire(&pJob->sequence) != pFinalizer->dequeuePos+1)
+		{
+			if(SpiLoadAcquire(&pFinalizer->syncFlag)) return 0;
+			Pa_Sleep(FINALIZER_POLL_MS);
+			continue;
+		}
+		PaUtil_ReadMemoryBarrier();
+		FinalizeJob(pJob);
+		pJob->filename.clear();
+		PaUtil_FullMemoryBarrier();
+		SpiStoreRelease(&pJob->sequence, pFinalizer->dequeuePos + FINALIZER_QUEUE_SIZE);
+		pFinalizer->dequeuePos++;
+	}
+}
+
+// Before the writers, without the thread they finalize their files themselves
+static void SpiFinalizer_Start()
+{
+	SpiFinalizer* pFinalizer = &global_finalizer;
+	for(unsigned i=0; i<FINALIZER_QUEUE_SIZE; i++) pFinalizer->jobs[i].sequence = i;
+	pFinalizer->enqueuePos = 0;
+	pFinalizer->dequeuePos = 0;
+	pFinalizer->syncFlag = 0;
+	pFinalizer->thread = SpiCreateThread(threadFunctionFinalizer, pFinalizer, NULL);
+	if(pFinalizer->thread==NULL) printf("can't start the finalizer thread, files are synced by the writers\n");
+}
+
+// Once the writers are stopped and the sessions finished, the queue is emptied first
+static void SpiFinalizer_Stop()
+{
+	SpiFinalizer* pFinalizer = &global_finalizer;
+	if(pFinalizer->thread==NULL) return;
+	SpiStoreRelease(&pFinalizer->syncFlag, 1);
+	SpiJoinThread(pFinalizer->thread);
+	pFinalizer->thread = NULL;
+}
+
+static bool SplitPending(SpiSession* pSession);
+
+// Callback side, split at the buffer's current frame and count the next
+// take from there. Returns false while the previous split isn't written.
+static bool StartNextTake(SpiSession* pSession, const char* source)
+{
+	paTestData* pData = &pSession->data;
+	if(SplitPending(pSession))
+	{
+		SpiLog("session %d, take %u can't start via %s, the previous split isn't written yet\n", pSession->index, pData->takeIndex+2, source);
+		return false;
+	}
+	SpiAtomicStore64(&pSession->splitsample, pData->sampleIndex - (pData->sampleIndex % global_numchannels));
+	PaUtil_WriteMemoryBarrier();
+	SpiStoreRelease(&pSession->splitsegment, pSession->splitsegment + 1);
+	pData->takeFrames = 0;
+	SpiStoreRelease(&pData->takeIndex, pData->takeIndex + 1);
+	SpiLog("session %d, take %u at frame %u via %s\n", pSession->index, pData->takeIndex+1, pSession->splitsample/global_numchannels, source);
+	return true;
+}
+
+// The last of --takes ends the session, not the next command
+static bool LastTake(SpiSession* pSession)
+{
+	return global_numtakes!=0 && pSession->data.takeIndex+1>=global_numtakes;
+}
+
+ 
+///////////////////////////////////////////////////////////////////////////////
+//    record windows
+//
+// the callback counts the frames the device delivers (stream frames) and
+// records only those inside the session's record windows, while not
+// paused, up to the take's length (the seconds argument) in frames, so the
+// files are exactly as long as asked. a window is start-stop, each end in
+// frames, in seconds with an s suffix or a wall-clock hh:mm[:ss] (the next
+// one to come), the stop may be left out. --windows=10s-20s,30s- applies
+// to every session, a --windows= token to one line of --sessions. wall-clock
+// ends are resolved to stream frames just before the stream starts, to the
+// second. once the take has its length or its last window is over, the
+// callback completes the stream and signals global_completionevent, main
+// waits on it between keyboard polls and closes the session at once.
+///////////////////////////////////////////////////////////////////////////////
+
+#define SPI_FOREVER (0x7fffffffffffffffLL) //no end, compared against, never added to
+#define SPI_MAXFRAMES (0x3fffffffffffffffLL) //the farthest window end or take length
+
+typedef struct
+{
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	sem_t semaphore;
+#endif
+} SpiEvent;
+
+SpiEvent global_completionevent; //a take completed or a stop was requested
+
+static void SpiEvent_Init(SpiEvent* pEvent)
+{
+#ifdef _WIN32
+	pEvent->handle = CreateEvent(NULL, FALSE, FALSE, NULL); //auto-reset
+#else
+	sem_init(&pEvent->semaphore, 0, 0);
+#endif
+}
+
+// From the callback or a signal handler, never blocks
+static void SpiEvent_Signal(SpiEvent* pEvent)
+{
+#ifdef _WIN32
+	SetEvent(pEvent->handle);
+#else
+	sem_post(&pEvent->semaphore);
+#endif
+}
+
+// Wait up to msec, returns true when signaled
+static bool SpiEvent_Wait(SpiEvent* pEvent, long msec)
+{
+#ifdef _WIN32
+	return WaitForSingleObject(pEvent->handle, (DWORD)msec)==WAIT_OBJECT_0;
+#else
+	struct timeval now;
+	struct timespec deadline;
+	gettimeofday(&now, NULL);
+	long long nsec = (long long)now.tv_usec * 1000 + (long long)msec * 1000000;
+	deadline.tv_sec = now.tv_sec + (time_t)(nsec / 1000000000);
+	deadline.tv_nsec = (long)(nsec % 1000000000);
+	while(sem_timedwait(&pEvent->semaphore, &deadline)!=0)
+	{
+		if(errno!=EINTR) return false;
+	}
+	return true;
+#endif
+}
+
+// One end of a record window in stream frames, false when it can't be read
+static bool ParseWindowEnd(const string& text, long long* pFrame)
+{
+	int hours, minutes, seconds = 0;
+	char* end;
+	double value;
+	if(sscanf(text.c_str(), "%d:%d:%d", &hours, &minutes, &seconds)>=2)
+	{
+		time_t now = time(NULL);
+		struct tm when = *localtime(&now);
+		when.tm_hour = hours;
+		when.tm_min = minutes;
+		when.tm_sec = seconds;
+		value = difftime(mktime(&when), now);
+		if(value<0.0) value += 24*60*60; //tomorrow
+		value *= global_samplerate;
+	}
+	else
+	{
+		value = strtod(text.c_str(), &end);
+		if(end==text.c_str() || value<0.0) return false;
+		if(*end=='s') value *= global_samplerate, end++;
+		if(*end!='\0') return false;
+	}
+	*pFrame = (long long)min(value + 0.5, (double)SPI_MAXFRAMES);
+	return true;
+}
+
+static bool CompareWindows(const SpiRecordWindow& a, const SpiRecordWindow& b)
+{
+	return a.start < b.start;
+}
+
+// Resolve the session's windows and its length in frames, one open window
+// without --windows. Sorted, overlapping windows are merged.
+static bool SetupRecordWindows(SpiSession* pSession)
+{
+	double frames = max((double)pSession->secondsRecord, 0.0) * global_samplerate + 0.5;
+	pSession->recordframes = (frames >= (double)SPI_MAXFRAMES) ? SPI_FOREVER : (long long)frames;
+	pSession->numwindows = 0;
+	const string& spec = pSession->windowsspec;
+	size_t begin = 0;
+	while(begin < spec.size())
+	{
+		size_t comma = spec.find(',', begin);
+		if(comma==string::npos) comma = spec.size();
+		string window = spec.substr(begin, comma-begin);
+		begin = comma+1;
+		if(window.empty()) continue;
+		if(pSession->numwindows==MAX_WINDOWS)
+		{
+			printf("error, at most %d record windows\n", MAX_WINDOWS);
+			return false;
+		}
+		SpiRecordWindow* pWindow = &pSession->windows[pSession->numwindows];
+		size_t dash = window.find('-');
+		pWindow->stop = SPI_FOREVER;
+		if(dash==string::npos || !ParseWindowEnd(window.substr(0, dash), &pWindow->start)
+			|| (dash+1<window.size() && !ParseWindowEnd(window.substr(dash+1), &pWindow->stop)) || pWindow->stop<=pWindow->start)
+		{
+			printf("error, invalid record window %s, expected start-stop in frames, seconds (10.5s) or hh:mm:ss\n", window.c_str());
+			return false;
+		}
+		pSession->numwindows++;
+	}
+	if(pSession->numwindows==0)
+	{
+		pSession->windows[0].start = 0;
+		pSession->windows[0].stop = SPI_FOREVER;
+		pSession->numwindows = 1;
+	}
+	sort(pSession->windows, pSession->windows + pSession->numwindows, CompareWindows);
+	int merged = 0;
+	for(int i=1; i<pSession->numwindows; i++)
+	{
+		if(pSession->windows[i].start <= pSession->windows[merged].stop) pSession->windows[merged].stop = max(pSession->windows[merged].stop, pSession->windows[i].stop);
+		else pSession->windows[++merged] = pSession->windows[i];
+	}
+	pSession->numwindows = merged+1;
+	return true;
+}
+
+// Callback side, write count samples to the ring, or to the spill arena
+// when it is nearly full, requested is the whole buffer's size
+static void CaptureSamples(SpiSession* pSession, const void* rptr, ring_buffer_size_t count, ring_buffer_size_t requested)
+{
+    paTestData *data = &pSession->data;
+    // Room for two buffers from the last look at the writers' index, or a new look
+    ring_buffer_size_t elementsWriteable = SpiFrameRing_WriteAvailable(&data->ring, 2*requested/global_numchannels) * global_numchannels;
+    ring_buffer_size_t elementsToWrite = min(elementsWriteable, count);
+    elementsToWrite -= elementsToWrite % global_numchannels; //whole frames only
+
+    // Nearly full, less than two buffers left, divert into the spill arena until the writer catches up
+    if (global_spillarena.numChunks > 0 && (data->spilling ? !EndSpill(pSession, 2*requested) : elementsWriteable < 2*requested))
+    {
+        elementsToWrite = SpillSamples(pSession, rptr, count);
+        SpiAtomicStore64(&data->sampleIndex, data->sampleIndex + elementsToWrite);
+    }
+    else
+    {
+        SpiAtomicStore64(&data->sampleIndex, data->sampleIndex + SpiFrameRing_Write(&data->ring, rptr, elementsToWrite/global_numchannels) * global_numchannels);
+    }
+
+    if (elementsToWrite < count)
+    {
+        SpiAtomicStore64(&data->droppedSamples, data->droppedSamples + (count - elementsToWrite));
+        SpiLog("session %d, ring buffer full, %ld samples dropped\n", pSession->index, (long)(count - elementsToWrite));
+    }
+}
+
+// Callback side, the take is over
+static void CompleteTake(SpiSession* pSession)
+{
+    pSession->data.complete = 1;
+    SpiLog("session %d, take complete, %u frames recorded\n", pSession->index, pSession->data.recordedFrames);
+    SpiEvent_Signal(&global_completionevent);
+}
+
+/* This routine will be called by the PortAudio engine when audio is needed.
+** It may be called at interrupt level on some machines so don't do anything
+** that could mess up the system like calling malloc() or free().
+*/
+static int recordBuffer( const void *inputBuffer, void *outputBuffer,
+                         unsigned long framesPerBuffer,
+                         const PaStreamCallbackTimeInfo* timeInfo,
+                         PaStreamCallbackFlags statusFlags,
+                         void *userData )
+{
+    SpiSession *pSession = (SpiSession*)userData;
+    paTestData *data = &pSession->data;
+    if (data->firstSampleSeconds == 0.0) data->firstSampleSeconds = SpiGetSeconds(); //for the startup timing
+	DrainCommandQueue(pSession); //control socket and keyboard commands
+	ApplyPendingConfig(pSession); //hot reconfiguration, at this buffer's first frame
+    // The device's position places the record windows, paused or not
+    long long streamFrame = data->streamFrames;
+    data->streamFrames += framesPerBuffer;
+    if (data->complete) return paComplete;
+	if(pSession->pauserecording) return paContinue;
+
+    ring_buffer_size_t elementsRequested = (ring_buffer_size_t)(framesPerBuffer * global_numchannels);
+    const char *rptr = (const char*)inputBuffer;
+ 
+    (void) outputBuffer; /* Prevent unused variable warnings. */
+    (void) timeInfo;
+ 
+    // The parts of the buffer inside the record windows, up to the take's length
+    long long bufferEnd = streamFrame + (long long)framesPerBuffer;
+    long long position = streamFrame;
+    while (position < bufferEnd && !data->complete)
+    {
+        SpiRecordWindow* pWindow = &pSession->windows[data->windowIndex];
+        if (position >= pWindow->stop)
+        {
+            if (++data->windowIndex == pSession->numwindows) CompleteTake(pSession);
+            continue;
+        }
+        long long begin = max(position, pWindow->start);
+        if (begin >= bufferEnd) break;
+        long long end = min(bufferEnd, pWindow->stop);
+        if (pSession->recordframes != SPI_FOREVER) end = min(end, begin + (pSession->recordframes - data->takeFrames));
+        CaptureSamples(pSession, rptr + (size_t)(begin - streamFrame) * global_numchannels * global_samplebytes, (ring_buffer_size_t)((end - begin) * global_numchannels), elementsRequested);
+        SpiAtomicStore64(&data->recordedFrames, data->recordedFrames + (end - begin));
+        data->takeFrames += end - begin;
+        // The next of --takes starts right after, see take manager
+        if (pSession->recordframes != SPI_FOREVER && data->takeFrames == pSession->recordframes && (LastTake(pSession) || !StartNextTake(pSession, "length"))) CompleteTake(pSession);
+        position = end;
+    }
+
+    // Rare events only, spilog never blocks the callback
+    if (statusFlags & paInputOverflow)
+    {
+        SpiStoreRelease(&data->inputOverflows, data->inputOverflows + 1);
+        SpiLog("session %d, input overflow reported by the audio device\n", pSession->index);
+    }
+ 
+    return data->complete ? paComplete : paContinue;
+}
+
+// The stream's callback, with --metrics each buffer's duration is counted
+static int recordCallback( const void *inputBuffer, void *outputBuffer,
+                           unsigned long framesPerBuffer,
+                           const PaStreamCallbackTimeInfo* timeInfo,
+                           PaStreamCallbackFlags statusFlags,
+                           void *userData )
+{
+    if (!global_metrics) return recordBuffer(inputBuffer, outputBuffer, framesPerBuffer, timeInfo, statusFlags, userData);
+    double entered = SpiGetSeconds();
+    int result = recordBuffer(inputBuffer, outputBuffer, framesPerBuffer, timeInfo, statusFlags, userData);
+    ObserveLatency(&((SpiSession*)userData)->data.callbackLatency, SpiGetSeconds() - entered);
+    return result;
+}
+ 
+
+ 
+static unsigned NextPowerOf2(unsigned val)
+{
+    val--;
+    val = (val >> 1) | val;
+    val = (val >> 2) | val;
+    val = (val >> 4) | val;
+    val = (val >> 8) | val;
+    val = (val >> 16) | val;
+    return ++val;
+}
+ 
+
+//migrated out of the main scope so Terminate() can see it
+PaError             err = paNoError;
+
+
+///////////////////////////////////////////////////////////////////////////////
+//    midi control mapping
+//
+// a mapping file compiles into flat 16x128 tables (control changes, notes
+// and program changes) indexed by midi channel and number, so dispatching
+// an incoming message is one lookup and never allocates. one line per rule:
+//
+//   # comment
+//   <cc|note|program> <channel 1-16|*> <number 0-127|*> <onaction> [<offaction>] [threshold=N] [hysteresis=N]
+//
+// actions: none, pause, resume, toggle, marker, split, stop, arm:<track>,
+// disarm:<track> (track 1 for the first recorded channel), save (see
+// retrospective capture), next (see take manager).
+//
+// cc and note rules are edge triggered, onaction fires when the value rises
+// to threshold (default 64 for cc, 1 for note velocity), offaction fires when
+// it falls below threshold-hysteresis. program rules fire onaction on every
+// matching program change. without a mapping file, the legacy behavior is
+// compiled in: cc midictrlnumber on midichannelid, 0-63 record and 64-127
+// pause. each session has its own tables, a message from a midi input goes
+// through the tables of every session listening to that input.
+///////////////////////////////////////////////////////////////////////////////
+
+
+static const char* midiactionnames[] = { "none", "pause", "resume", "toggle", "marker", "split", "stop", "arm", "disarm", "save", "next" };
+
+static void ClearMidiMap(SpiMidiMap* pMap)
+{
+	for(int c=0; c<16; c++)
+	{
+		for(int n=0; n<128; n++)
+		{
+			MidiControlRule rule = { MIDIACTION_NONE, 0, MIDIACTION_NONE, 0, 64, 0 };
+			pMap->ccmap[c][n] = rule;
+			pMap->notemap[c][n] = rule;
+			pMap->programmap[c][n] = rule;
+		}
+	}
+	pMap->usesnotes = false;
+	pMap->usesprograms = false;
+}
+
+// "arm:2" gives MIDIACTION_ARM with param 1, returns false on unknown action
+// and on arm or disarm without their track
+static bool ParseMidiAction(const char* token, unsigned char* pAction, unsigned char* pParam)
+{
+	char name[32];
+	int param = 0;
+	const char* colon = strchr(token, ':');
+	size_t namelength = colon ? (size_t)(colon-token) : strlen(token);
+	if(namelength >= sizeof(name)) return false;
+	memcpy(name, token, namelength);
+	name[namelength] = '\0';
+	if(colon) param = atoi(colon+1) - 1;
+	for(int i=0; i<(int)(sizeof(midiactionnames)/sizeof(midiactionnames[0])); i++)
+	{
+		if(strcmp(name, midiactionnames[i])==0)
+		{
+			if((i==MIDIACTION_ARM || i==MIDIACTION_DISARM) && (colon==NULL || param<0 || param>31)) return false;
+			*pAction = (unsigned char)i;
+			*pParam = (unsigned char)param;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Compile a mapping file into the lookup tables, on error the tables are left empty
+bool LoadMidiMap(SpiMidiMap* pMap, const char* filename)
+{
+	FILE* pFile = fopen(filename, "r");
+	if(pFile==NULL)
+	{
+		printf("error, can't open midi mapping file %s\n", filename);
+		return false;
+	}
+	ClearMidiMap(pMap);
+	char line[256];
+	int linenumber = 0;
+	bool ok = true;
+	while(fgets(line, sizeof(line), pFile))
+	{
+		linenumber++;
+		char* tokens[8];
+		int numtokens = 0;
+		char* hash = strchr(line, '#');
+		if(hash) *hash = '\0';
+		for(char* t=strtok(line, " \t\r\n"); t && numtokens<8; t=strtok(NULL, " \t\r\n")) tokens[numtokens++] = t;
+		if(numtokens==0) continue;
+		if(numtokens<4)
+		{
+			printf("error, midi mapping file %s line %d: expected <source> <channel> <number> <action>\n", filename, linenumber);
+			ok = false;
+			continue;
+		}
+
+		MidiControlRule (*table)[128] = NULL;
+		int defaultthreshold = 64;
+		if(strcmp(tokens[0], "cc")==0) table = pMap->ccmap;
+		else if(strcmp(tokens[0], "note")==0) { table = pMap->notemap; defaultthreshold = 1; pMap->usesnotes = true; }
+		else if(strcmp(tokens[0], "program")==0) { table = pMap->programmap; pMap->usesprograms = true; }
+		int channel = (strcmp(tokens[1], "*")==0) ? -1 : atoi(tokens[1]) - 1;
+		int number = (strcmp(tokens[2], "*")==0) ? -1 : atoi(tokens[2]);
+		MidiControlRule rule = { MIDIACTION_NONE, 0, MIDIACTION_NONE, 0, (unsigned char)defaultthreshold, 0 };
+		bool lineok = (table!=NULL) && channel>=-1 && channel<16 && number>=-1 && number<128 &&
+			ParseMidiAction(tokens[3], &rule.onAction, &rule.onParam);
+		for(int i=4; i<numtokens && lineok; i++)
+		{
+			if(strncmp(tokens[i], "threshold=", 10)==0) rule.threshold = (unsigned char)min(127, max(0, atoi(tokens[i]+10)));
+			else if(strncmp(tokens[i], "hysteresis=", 11)==0) rule.hysteresis = (unsigned char)min(127, max(0, atoi(tokens[i]+11)));
+			else lineok = ParseMidiAction(tokens[i], &rule.offAction, &rule.offParam);
+		}
+		if(!lineok)
+		{
+			printf("error, midi mapping file %s line %d is invalid\n", filename, linenumber);
+			ok = false;
+			continue;
+		}
+		for(int c=0; c<16; c++)
+		{
+			if(channel!=-1 && c!=channel) continue;
+			for(int n=0; n<128; n++)
+			{
+				if(number!=-1 && n!=number) continue;
+				table[c][n] = rule;
+			}
+		}
+	}
+	fclose(pFile);
+	if(!ok) ClearMidiMap(pMap);
+	return ok;
+}
+
+// Legacy single control mapping, cc 0-63 record and 64-127 pause
+void SetDefaultMidiMap(SpiMidiMap* pMap, int midichannelid, int midictrlnumber)
+{
+	ClearMidiMap(pMap);
+	MidiControlRule rule = { MIDIACTION_PAUSE, 0, MIDIACTION_RESUME, 0, 64, 0 };
+	pMap->ccmap[midichannelid & MIDI_CHN_MASK][midictrlnumber & 0x7f] = rule;
+}
+
+// A split is pending while an active target hasn't reached the last one
+static bool SplitPending(SpiSession* pSession)
+{
+	paTestData* pData = &pSession->data;
+	for(int t=0; t<pData->numTargets; t++)
+	{
+		if(SpiLoadAcquire(&pData->targets[t].state)==TARGET_ACTIVE && SpiLoadAcquire(&pData->targets[t].segmentIndex) < pSession->splitsegment) return true;
+	}
+	return false;
+}
+
+// Runs on the audio callback as it drains its queue, must not block. A stop
+// only sets flags main polls, it also runs on the midi and control threads.
+static void DoMidiAction(SpiSession* pSession, int action, int param, const char* source = "midi")
+{
+	paTestData* pData = &pSession->data;
+	int index = pSession->index;
+	switch(action)
+	{
+	case MIDIACTION_PAUSE:
+		SpiStoreRelease(&pSession->pauserecording, true); //pause recording
+		SpiLog("session %d, pause via %s\n", index, source);
+		break;
+	case MIDIACTION_RESUME:
+		SpiStoreRelease(&pSession->pauserecording, false); //keep recording
+		SpiLog("session %d, unpause via %s\n", index, source);
+		break;
+	case MIDIACTION_TOGGLE:
+		SpiStoreRelease(&pSession->pauserecording, !pSession->pauserecording);
+		SpiLog(pSession->pauserecording ? "session %d, pause via %s\n" : "session %d, unpause via %s\n", index, source);
+		break;
+	case MIDIACTION_MARKER:
+		if(pSession->nummarkers<MAX_MARKERS)
+		{
+			pSession->markerframes[pSession->nummarkers] = pData->sampleIndex/global_numchannels;
+			PaUtil_WriteMemoryBarrier();
+			SpiStoreRelease(&pSession->nummarkers, pSession->nummarkers + 1);
+			SpiLog("session %d, marker %u at frame %u via %s\n", index, pSession->nummarkers, pSession->markerframes[pSession->nummarkers-1], source);
+		}
+		break;
+	case MIDIACTION_SPLIT:
+		if(!SplitPending(pSession))
+		{
+			SpiAtomicStore64(&pSession->splitsample, pData->sampleIndex - (pData->sampleIndex % global_numchannels));
+			PaUtil_WriteMemoryBarrier();
+			SpiStoreRelease(&pSession->splitsegment, pSession->splitsegment + 1);
+			SpiLog("session %d, split at frame %u via %s\n", index, pSession->splitsample/global_numchannels, source);
+		}
+		break;
+	case MIDIACTION_STOP:
+		pSession->stoprequested = true;
+		SpiEvent_Signal(&global_completionevent); //main closes the session
+		SpiLog("session %d, stop via %s\n", index, source);
+		break;
+	case MIDIACTION_ARM:
+		SpiStoreRelease(&pSession->armedchannelmask, pSession->armedchannelmask | (1u<<param));
+		SpiLog("session %d, track %d armed via %s\n", index, param+1, source);
+		break;
+	case MIDIACTION_DISARM:
+		SpiStoreRelease(&pSession->armedchannelmask, pSession->armedchannelmask & ~(1u<<param));
+		SpiLog("session %d, track %d disarmed via %s\n", index, param+1, source);
+		break;
+	case MIDIACTION_SAVE:
+		if(global_retrocapacity==0) SpiLog("session %d, save via %s without --retro\n", index, source);
+		else if(pSession->numretrosaves<MAX_RETRO_SAVES)
+		{
+			pSession->retrosamples[pSession->numretrosaves] = pData->sampleIndex - (pData->sampleIndex % global_numchannels);
+			PaUtil_WriteMemoryBarrier();
+			SpiStoreRelease(&pSession->numretrosaves, pSession->numretrosaves + 1);
+			SpiLog("session %d, save %u at frame %u via %s\n", index, pSession->numretrosaves, pData->sampleIndex/global_numchannels, source);
+		}
+		break;
+	case MIDIACTION_NEXT:
+		//on the callback only, it owns the take's count, see take manager
+		if(LastTake(pSession)) SpiLog("session %d, next via %s on the last take, stop ends it\n", index, source);
+		else StartNextTake(pSession, source);
+		break;
+	}
+}
+
+// On the midi thread, every action but a stop goes through the callback's
+// queue, the callback owns the split, save, marker and take state
+static void DoMidiThreadAction(SpiSession* pSession, int action, int param)
+{
+	if(action==MIDIACTION_NONE) return;
+	if(action==MIDIACTION_STOP) DoMidiAction(pSession, action, param);
+	else if(!SpiCommand_Post(pSession, action, param, "midi")) SpiLog("session %d, midi action %d dropped, the command queue is full\n", pSession->index, action);
+}
+
+static void DispatchMidiRule(SpiSession* pSession, const MidiControlRule* pRule, signed char* pState, int value)
+{
+	if(value >= pRule->threshold)
+	{
+		if(*pState!=1)
+		{
+			*pState = 1;
+			DoMidiThreadAction(pSession, pRule->onAction, pRule->onParam);
+		}
+	}
+	else if(value < (int)pRule->threshold - (int)pRule->hysteresis)
+	{
+		if(*pState!=0)
+		{
+			*pState = 0;
+			DoMidiThreadAction(pSession, pRule->offAction, pRule->offParam);
+		}
+	}
+}
+
+// One table lookup per message, in the session's current settings. The
+// rule states start over when the settings change.
+void DispatchMidiMessage(SpiSession* pSession, PmMessage message)
+{
+	const SpiConfig* pConfig = pSession->config;
+	PaUtil_ReadMemoryBarrier();
+	if(pConfig!=pSession->midiconfig)
+	{
+		memset(pSession->ccstates, -1, sizeof(pSession->ccstates));
+		memset(pSession->notestates, -1, sizeof(pSession->notestates));
+		pSession->midiconfig = pConfig;
+	}
+	const SpiMidiMap* pMap = &pConfig->midimap;
+	int msgstatus = Pm_MessageStatus(message);
+	int chan = msgstatus & MIDI_CHN_MASK;
+	int data1 = Pm_MessageData1(message) & 0x7f;
+	SpiStoreRelease(&pSession->midievents, pSession->midievents + 1);
+	switch(msgstatus & MIDI_CODE_MASK)
+	{
+	case MIDI_CTRL:
+		DispatchMidiRule(pSession, &pMap->ccmap[chan][data1], &pSession->ccstates[chan][data1], Pm_MessageData2(message));
+		break;
+	case MIDI_ON_NOTE:
+		DispatchMidiRule(pSession, &pMap->notemap[chan][data1], &pSession->notestates[chan][data1], Pm_MessageData2(message));
+		break;
+	case MIDI_OFF_NOTE:
+		DispatchMidiRule(pSession, &pMap->notemap[chan][data1], &pSession->notestates[chan][data1], 0);
+		break;
+	case MIDI_CH_PROGRAM:
+		DoMidiThreadAction(pSession, pMap->programmap[chan][data1].onAction, pMap->programmap[chan][data1].onParam);
+		break;
+	}
+}
+
+// Runs on the midi thread for each message read from global_midiinputs[midiinput]
+void DispatchMidiInput(int midiinput, PmMessage message)
+{
+	for(int i=0; i<global_numsessions; i++)
+	{
+		if(global_sessions[i]->midiinput==midiinput) DispatchMidiMessage(global_sessions[i], message);
+	}
+}
+
+// Markers go into a text sidecar next to the recording, one frame offset per line
+void WriteMarkerFile(SpiSession* pSession)
+{
+	if(pSession->nummarkers==0) return;
+	string markerfilename = pSession->filename + ".markers";
+	FILE* pFile = fopen(markerfilename.c_str(), "w");
+	if(pFile==NULL) return;
+	for(unsigned i=0; i<pSession->nummarkers; i++)
+	{
+		fprintf(pFile, "%u\t%lld\t%f\n", i+1, pSession->markerframes[i], pSession->markerframes[i]/(double)global_samplerate);
+	}
+	fclose(pFile);
+	printf("%u markers written to %s\n", pSession->nummarkers, markerfilename.c_str());
+}
+
+ 
+///////////////////////////////////////////////////////////////////////////////
+//    hot reconfiguration
+//
+// the session's file, its encoding and its midi control change while
+// recording, with the control socket's set command or a line of the
+// --config=file.txt that main re-reads whenever it changes:
+//
+//    [@<session>] file=take2.wav encoding=pcm24 midichannel=2 midicc=64 midimap=map.txt
+//
+// (midichannel is 1-16, an empty midimap= goes back to the midichannel and
+// midicc rule, midimap=map.txt reads the file again, edited under the same
+// name or not). the settings are an SpiConfig snapshot that is never
+// modified once published: a change copies the session's current one,
+// edits the copy and publishes it as pending. the callback swaps it in at
+// the first frame of its next buffer, a pointer store and no lock. the midi
+// thread reads the new map on its next message. a new file or encoding
+// splits the take at that frame, once the previous split is written, and
+// each target takes up its new file as its writer gets there: the stream,
+// the ring and the writers go on. mirrors and fan-outs follow the new file,
+// the fan-outs keep their encodings. replaced snapshots stay allocated
+// until the session is freed, so nobody has to wait for the readers of one
+// to be done with it. the sidecars (.peak, .loudness, .markers) cover the
+// whole take under the startup name.
+///////////////////////////////////////////////////////////////////////////////
+
+#define CONFIG_LINE_BYTES (512)
+
+volatile unsigned global_reconfiguring = 0; //1 while the control thread or main builds a change
+string global_configpath; //--config=file.txt, empty for none
+time_t global_configmtime = 0;
+double global_nextconfigseconds = 0.0;
+
+// The settings at startup, once the session's targets are added. Returns
+// false when the session's --midimap doesn't load, its errors are printed.
+static bool CreateConfig(SpiSession* pSession)
+{
+	SpiConfig* pConfig = new SpiConfig;
+	pConfig->generation = 0;
+	pConfig->split = false;
+	pConfig->filename = pSession->filename;
+	pConfig->pipeline = global_pipeline;
+	pConfig->midichannelid = pSession->midichannelid;
+	pConfig->midictrlnumber = pSession->midictrlnumber;
+	pConfig->midimapfilename = pSession->midimapfilename;
+	if(pConfig->midimapfilename.empty())
+	{
+		SetDefaultMidiMap(&pConfig->midimap, pConfig->midichannelid, pConfig->midictrlnumber);
+	}
+	else if(!LoadMidiMap(&pConfig->midimap, pConfig->midimapfilename.c_str()))
+	{
+		//recording with other controls than the ones asked for is worse than not starting
+		delete pConfig;
+		return false;
+	}
+	for(int t=0; t<pSession->data.numTargets; t++)
+	{
+		SpiTarget* pTarget = &pSession->data.targets[t];
+		pConfig->filenames[t] = pTarget->filename;
+		pConfig->fileformats[t] = pTarget->fileformat;
+		pConfig->pipelines[t] = pTarget->pPipeline;
+		pTarget->config = pConfig;
+	}
+	pConfig->previous = NULL;
+	pSession->config = pConfig;
+	pSession->splitconfig = pConfig;
+	return true;
+}
+
+static void FreeConfigs(SpiSession* pSession)
+{
+	SpiConfig* pConfig = pSession->pendingconfig ? pSession->pendingconfig : pSession->config;
+	while(pConfig)
+	{
+		SpiConfig* pPrevious = pConfig->previous;
+		delete pConfig;
+		pConfig = pPrevious;
+	}
+}
+
+// Apply one "key=value" to the copy of the current settings
+static bool ApplySetting(SpiSession* pSession, SpiConfig* pConfig, const string& key, const string& value, string& error)
+{
+	paTestData* pData = &pSession->data;
+	if((key=="file" || key=="encoding") && global_retrocapacity>0)
+	{
+		error = "--retro records one circular file as captured";
+		return false;
+	}
+	if(key=="file")
+	{
+		if(value.empty()) { error = "file= needs a file name"; return false; }
+		pConfig->filename = value;
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			pConfig->filenames[t] = TargetFilename(&pData->targets[t], value);
+			pConfig->fileformats[t] = ContainerFormat(pConfig->filenames[t]) | (pConfig->fileformats[t] & SF_FORMAT_SUBMASK);
+		}
+	}
+	else if(key=="encoding")
+	{
+		if(global_gatherwriter) { error = "--writer=gather writes samples as captured"; return false; }
+		if(!SelectSamplePipeline(value, GetOption("dither", "0")!="0", &pConfig->pipeline) || pConfig->pipeline.convert==NULL)
+		{
+			error = "unknown encoding " + value;
+			return false;
+		}
+		if(global_manifestblock>0 && !ManifestCovers(&pConfig->pipeline))
+		{
+			error = "--manifest can't follow libsndfile's quantization to " + value;
+			return false;
+		}
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			if(!pData->targets[t].suffix.empty()) continue; //a fan-out's own encoding
+			pConfig->pipelines[t] = &pConfig->pipeline;
+			pConfig->fileformats[t] = (pConfig->fileformats[t] & SF_FORMAT_TYPEMASK) | pConfig->pipeline.subformat;
+		}
+	}
+	else if(key=="midichannel" || key=="midicc")
+	{
+		int number = atoi(value.c_str());
+		bool channel = (key=="midichannel");
+		if(number<(channel ? 1 : 0) || number>(channel ? 16 : 127)) { error = channel ? "midichannel must be 1 to 16" : "midicc must be 0 to 127"; return false; }
+		if(channel) pConfig->midichannelid = number-1;
+		else pConfig->midictrlnumber = number;
+	}
+	else if(key=="midimap")
+	{
+		pConfig->midimapfilename = value;
+	}
+	else
+	{
+		error = "unknown setting " + key;
+		return false;
+	}
+	return true;
+}
+
+// Build the session's next settings from "key=value ..." and publish them
+// for the callback. False with the reason in error, true as well when
+// nothing changes.
+static bool ReconfigureSession(SpiSession* pSession, const string& settings, string& error)
+{
+	if(!SpiAtomicCompareAndSwap(&global_reconfiguring, 0, 1))
+	{
+		error = "another change is being made";
+		return false;
+	}
+	SpiConfig* pCurrent = pSession->config;
+	SpiConfig* pConfig = NULL;
+	bool ok = (SpiLoadAcquire(&pSession->pendingconfig)==NULL);
+	if(!ok) error = "the previous change isn't applied yet";
+	if(ok)
+	{
+		pConfig = new SpiConfig(*pCurrent);
+		pConfig->generation = pCurrent->generation+1;
+		pConfig->previous = pCurrent;
+	}
+	bool midimapgiven = false; //reloaded even with the same name, the file may have been edited
+	size_t begin = 0;
+	while(ok && begin<settings.size())
+	{
+		size_t space = settings.find_first_of(" \t\r\n", begin);
+		if(space==string::npos) space = settings.size();
+		string setting = settings.substr(begin, space-begin);
+		begin = space+1;
+		if(setting.empty()) continue;
+		size_t equal = setting.find('=');
+		if(equal==string::npos)
+		{
+			error = "expected key=value, not " + setting;
+			ok = false;
+		}
+		else
+		{
+			ok = ApplySetting(pSession, pConfig, setting.substr(0, equal), setting.substr(equal+1), error);
+			if(setting.compare(0, equal, "midimap")==0) midimapgiven = true;
+		}
+	}
+	bool midichanged = ok && (pConfig->midichannelid!=pCurrent->midichannelid || pConfig->midictrlnumber!=pCurrent->midictrlnumber ||
+		pConfig->midimapfilename!=pCurrent->midimapfilename || midimapgiven);
+	if(midichanged)
+	{
+		if(pConfig->midimapfilename.empty()) SetDefaultMidiMap(&pConfig->midimap, pConfig->midichannelid, pConfig->midictrlnumber);
+		else if(!LoadMidiMap(&pConfig->midimap, pConfig->midimapfilename.c_str()))
+		{
+			error = "can't load midimap " + pConfig->midimapfilename;
+			ok = false;
+		}
+		else if((pConfig->midimap.usesnotes && !notes) || (pConfig->midimap.usesprograms && !pgchanges))
+		{
+			error = "the midi inputs filter notes and program changes out, a map using them is needed at startup";
+			ok = false;
+		}
+	}
+	if(ok)
+	{
+		pConfig->split = (pConfig->filename!=pCurrent->filename);
+		for(int t=0; t<pSession->data.numTargets; t++)
+		{
+			const SamplePipeline* pNew = pConfig->pipelines[t];
+			const SamplePipeline* pOld = pCurrent->pipelines[t];
+			if(pNew->convert!=pOld->convert || pNew->subformat!=pOld->subformat) pConfig->split = true;
+		}
+		if(pConfig->split || midichanged)
+		{
+			SpiLog("session %d, settings %d published, %s, %s\n", pSession->index, pConfig->generation, pConfig->filename,
+				pConfig->split ? "new files" : "midi only");
+			PaUtil_WriteMemoryBarrier();
+			SpiStoreRelease(&pSession->pendingconfig, pConfig);
+			pConfig = NULL;
+		}
+	}
+	delete pConfig; //failed or unchanged
+	PaUtil_FullMemoryBarrier();
+	global_reconfiguring = 0;
+	return ok;
+}
+
+// Swap in the pending settings, by the callback at the first frame of its
+// buffer. A new file or encoding waits for the previous split to be written.
+void ApplyPendingConfig(SpiSession* pSession)
+{
+	SpiConfig* pConfig = SpiLoadAcquire(&pSession->pendingconfig);
+	if(pConfig==NULL) return;
+	PaUtil_ReadMemoryBarrier();
+	paTestData* pData = &pSession->data;
+	if(pConfig->split)
+	{
+		if(SplitPending(pSession)) return;
+		SpiStoreRelease(&pSession->splitconfig, pConfig);
+		SpiAtomicStore64(&pSession->splitsample, pData->sampleIndex - (pData->sampleIndex % global_numchannels));
+		PaUtil_WriteMemoryBarrier();
+		SpiStoreRelease(&pSession->splitsegment, pSession->splitsegment + 1);
+	}
+	SpiStoreRelease(&pSession->config, pConfig);
+	PaUtil_WriteMemoryBarrier();
+	SpiStoreRelease(&pSession->pendingconfig, (SpiConfig*)NULL);
+	SpiLog("session %d, settings %d applied at frame %u\n", pSession->index, pConfig->generation, pData->sampleIndex/global_numchannels);
+}
+
+// Watch --config, the settings it holds at startup are not applied
+static void SpiConfigFile_Start(const string& path)
+{
+	global_configpath = path;
+	struct stat st;
+	if(!path.empty() && stat(path.c_str(), &st)==0) global_configmtime = st.st_mtime;
+}
+
+// Re-read --config once a second when its modification time changes, each
+// line applies to its @<session> or to every session, a session's lines
+// make one change
+static void SpiConfigFile_Poll(double now)
+{
+	if(global_configpath.empty() || now<global_nextconfigseconds) return;
+	global_nextconfigseconds = now + 1.0;
+	struct stat st;
+	if(stat(global_configpath.c_str(), &st)!=0 || st.st_mtime==global_configmtime) return;
+	global_configmtime = st.st_mtime;
+	FILE* pFile = fopen(global_configpath.c_str(), "r");
+	if(pFile==NULL) return;
+	char line[CONFIG_LINE_BYTES];
+	vector<string> settings(global_numsessions);
+	while(fgets(line, sizeof(line), pFile))
+	{
+		char* hash = strchr(line, '#');
+		if(hash) *hash = '\0';
+		char* p = line;
+		int target = -1;
+		while(*p==' ' || *p=='\t') p++;
+		if(*p=='@') target = (int)strtol(p+1, &p, 10);
+		for(int i=0; i<global_numsessions; i++)
+		{
+			if(target==-1 || target==i) settings[i] += string(" ") + p;
+		}
+	}
+	fclose(pFile);
+	for(int i=0; i<global_numsessions; i++)
+	{
+		string error;
+		if(!ReconfigureSession(global_sessions[i], settings[i], error)) SpiLog("session %d, %s, %s\n", i, global_configpath, error);
+	}
+}
+
+ 
+/*******************************************************************/
+///////////////////////////////////////////////////////////////////////////////
+//    control socket
+//
+// --control=/path/to/socket serves a line protocol on a unix domain socket,
+// one command per line:
+//
+//    [@<session>] pause, resume, toggle, marker, split, stop, arm <track>,
+//    disarm <track>, save, next, stats, set <key>=<value> ...
+//
+// without @<session> a command goes to every session. set changes settings
+// while recording, see hot reconfiguration. each command is answered with
+// "ok <command>", "error <reason>" or, for stats, one "stats session=N ..."
+// line per session. status changes, whatever their source (socket, keyboard
+// or midi), are pushed to every connected client as "event session=N ..."
+// lines, plus "event status session=N ..." lines once per second.
+//
+// the socket is served by its own event loop (select() with a short timeout)
+// and commands reach the audio callbacks through a lock-free bounded queue
+// per session that its callback drains on each buffer, so they take effect
+// within one buffer. the keyboard posts into the same queues.
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAX_CONTROL_CLIENTS   (8)
+#define CONTROL_LINE_BYTES    (256)
+#define CONTROL_POLL_MS       (20)
+#define MAIN_POLL_MS          (20)
+#define CONTROL_SET           (-1) //not a midi action, see hot reconfiguration
+
+static void SpiCommand_Init(SpiSession* pSession)
+{
+	SpiCommandQueue* q = &pSession->commandqueue;
+	for(unsigned i=0; i<COMMAND_QUEUE_SIZE; i++) q->slots[i].sequence = i;
+	q->enqueuePos = 0;
+	q->dequeuePos = 0;
+	q->dropped = 0;
+}
+
+// Never blocks, returns false when the queue is full
+static bool SpiCommand_Post(SpiSession* pSession, int action, int param, const char* source)
+{
+	SpiCommandQueue* q = &pSession->commandqueue;
+	for(;;)
+	{
+		unsigned pos = SpiLoadAcquire(&q->enqueuePos);
+		SpiCommandSlot* pSlot = &q->slots[pos & (COMMAND_QUEUE_SIZE-1)];
+		PaUtil_ReadMemoryBarrier();
+		int diff = (int)(SpiLoadAcquire(&pSlot->sequence) - pos);
+		if(diff<0)
+		{
+			(void)SpiAtomicIncrement(&q->dropped);
+			return false;
+		}
+		if(diff==0 && SpiAtomicCompareAndSwap(&q->enqueuePos, pos, pos+1))
+		{
+			pSlot->action = action;
+			pSlot->param = param;
+			pSlot->source = source;
+			PaUtil_WriteMemoryBarrier();
+			SpiStoreRelease(&pSlot->sequence, pos+1);
+			return true;
+		}
+	}
+}
+
+// Called by the session's audio callback at the start of each buffer
+void DrainCommandQueue(SpiSession* pSession)
+{
+	SpiCommandQueue* q = &pSession->commandqueue;
+	for(;;)
+	{
+		SpiCommandSlot* pSlot = &q->slots[q->dequeuePos & (COMMAND_QUEUE_SIZE-1)];
+		if(SpiLoadAcquire(&pSlot->sequence) != q->dequeuePos+1) break;
+		PaUtil_ReadMemoryBarrier();
+		DoMidiAction(pSession, pSlot->action, pSlot->param, pSlot->source);
+		PaUtil_FullMemoryBarrier();
+		SpiStoreRelease(&pSlot->sequence, q->dequeuePos + COMMAND_QUEUE_SIZE);
+		q->dequeuePos++;
+	}
+}
+
+// One line describing a session's state, for stats replies and status events
+static void FormatControlStatus(SpiSession* pSession, char* buffer, size_t size)
+{
+	paTestData* pData = &pSession->data;
+	long long frames = SpiAtomicLoad64(&pData->sampleIndex)/global_numchannels;
+	snprintf(buffer, size, "session=%d frames=%lld seconds=%.3f written=%lld paused=%d segment=%d take=%u markers=%u armed=0x%x ring=%ld/%ld finished=%d logdropped=%u cmddropped=%u",
+		pSession->index, frames, (double)frames/global_samplerate, SpiAtomicLoad64(&pData->targets[0].samplesWritten)/global_numchannels, SpiLoadAcquire(&pSession->pauserecording) ? 1 : 0,
+		SpiLoadAcquire(&pData->targets[0].segmentIndex), SpiLoadAcquire(&pData->takeIndex)+1, SpiLoadAcquire(&pSession->nummarkers), SpiLoadAcquire(&pSession->armedchannelmask),
+		(long)SpiFrameRing_Fill(&pData->ring) * global_numchannels, (long)RingCapacitySamples(pData),
+		SpiLoadAcquire(&pData->finished) ? 1 : 0, SpiLog_GetDroppedCount(), SpiLoadAcquire(&pSession->commandqueue.dropped));
+	buffer[size-1] = '\0';
+	size_t used = strlen(buffer);
+	if(global_spillarena.numChunks>0 && used+1<size)
+	{
+		snprintf(buffer+used, size-used, " spill=%u/%u spilled=%lld", SpillChunksHeld(pData), global_spillarena.numChunks, SpiAtomicLoad64(&pData->spilledSamples)/global_numchannels);
+		buffer[size-1] = '\0';
+		used = strlen(buffer);
+	}
+	for(int t=0; pData->numTargets>1 && t<pData->numTargets && used+1<size; t++)
+	{
+		snprintf(buffer+used, size-used, " target%d=%s,%ld", t, TargetStateName(SpiLoadAcquire(&pData->targets[t].state)), TargetLag(&pData->targets[t])/global_numchannels);
+		buffer[size-1] = '\0';
+		used = strlen(buffer);
+	}
+	if(pData->loudness && used+1<size) FormatLoudness(pData->loudness, buffer+used, size-used);
+}
+
+// Parse one command line, returns false for unknown commands. *pSession is
+// the target session, -1 for all of them, *pSettings what follows set.
+static bool ParseControlCommand(const char* line, int* pSession, int* pAction, int* pParam, const char** pSettings)
+{
+	char name[32] = "";
+	int track = 0;
+	*pSession = -1;
+	*pParam = 0;
+	if(line[0]=='@')
+	{
+		char* end;
+		*pSession = (int)strtol(line+1, &end, 10);
+		if(end==line+1 || *pSession<0 || *pSession>=global_numsessions) return false;
+		line = end;
+	}
+	int n = sscanf(line, "%31s %d", name, &track);
+	if(n<1) return false;
+	if(strcmp(name, "pause")==0) *pAction = MIDIACTION_PAUSE;
+	else if(strcmp(name, "resume")==0) *pAction = MIDIACTION_RESUME;
+	else if(strcmp(name, "toggle")==0) *pAction = MIDIACTION_TOGGLE;
+	else if(strcmp(name, "marker")==0) *pAction = MIDIACTION_MARKER;
+	else if(strcmp(name, "split")==0) *pAction = MIDIACTION_SPLIT;
+	else if(strcmp(name, "stop")==0) *pAction = MIDIACTION_STOP;
+	else if(strcmp(name, "save")==0) *pAction = MIDIACTION_SAVE;
+	else if(strcmp(name, "next")==0) *pAction = MIDIACTION_NEXT;
+	else if(strcmp(name, "stats")==0) *pAction = MIDIACTION_NONE;
+	else if(strcmp(name, "set")==0)
+	{
+		*pAction = CONTROL_SET;
+		*pSettings = strstr(line, "set") + 3;
+	}
+	else if(strcmp(name, "arm")==0 || strcmp(name, "disarm")==0)
+	{
+		if(n<2 || track<1 || track>global_numchannels) return false;
+		*pAction = (name[0]=='a') ? MIDIACTION_ARM : MIDIACTION_DISARM;
+		*pParam = track-1;
+	}
+	else return false;
+	return true;
+}
+
+string global_controlpath; //--control=path, empty for no control socket
+void* global_controlthread = NULL;
+volatile int global_controlsyncflag = 0;
+
+#ifndef _WIN32
+typedef struct
+{
+	int fd; //-1 when unused
+	char line[CONTROL_LINE_BYTES];
+	int length;
+} SpiControlClient;
+
+int global_controlfd = -1;
+SpiControlClient global_controlclients[MAX_CONTROL_CLIENTS];
+
+// Best effort, a client that can't keep up with the replies is dropped
+static void SendControlLine(SpiControlClient* pClient, const char* line)
+{
+	if(pClient->fd<0) return;
+	size_t length = strlen(line);
+	if(send(pClient->fd, line, length, MSG_NOSIGNAL)!=(ssize_t)length)
+	{
+		close(pClient->fd);
+		pClient->fd = -1;
+	}
+}
+
+static void BroadcastControlLine(const char* line)
+{
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++) SendControlLine(&global_controlclients[i], line);
+}
+
+static void HandleControlLine(SpiControlClient* pClient, char* line)
+{
+	char reply[512];
+	int target, action, param;
+	const char* settings = "";
+	string error;
+	size_t length = strlen(line);
+	while(length>0 && (line[length-1]=='\r' || line[length-1]==' ')) line[--length] = '\0';
+	if(length==0) return;
+	if(!ParseControlCommand(line, &target, &action, &param, &settings))
+	{
+		snprintf(reply, sizeof(reply), "error unknown command %.64s\n", line);
+		SendControlLine(pClient, reply);
+		return;
+	}
+	bool queued = true;
+	for(int i=0; i<global_numsessions; i++)
+	{
+		SpiSession* pSession = global_sessions[i];
+		if(target!=-1 && target!=i) continue;
+		if(action==MIDIACTION_NONE)
+		{
+			strcpy(reply, "stats ");
+			FormatControlStatus(pSession, reply+6, sizeof(reply)-7);
+			strcat(reply, "\n");
+			SendControlLine(pClient, reply);
+		}
+		else if(action==MIDIACTION_STOP)
+		{
+			//main polls the flag, no need to go through the callback
+			DoMidiAction(pSession, action, param, "control");
+		}
+		else if(action==CONTROL_SET)
+		{
+			//a new snapshot, the callback swaps it in
+			ReconfigureSession(pSession, settings, error);
+		}
+		else if(!SpiCommand_Post(pSession, action, param, "control"))
+		{
+			queued = false;
+		}
+	}
+	if(action==MIDIACTION_NONE) return;
+	if(!error.empty()) snprintf(reply, sizeof(reply), "error %.200s\n", error.c_str());
+	else if(queued) snprintf(reply, sizeof(reply), "ok %.64s\n", line);
+	else snprintf(reply, sizeof(reply), "error command queue full\n");
+	SendControlLine(pClient, reply);
+}
+
+typedef struct
+{
+	bool paused;
+	unsigned markers;
+	unsigned saves;
+	unsigned take;
+	int segment;
+	unsigned armed;
+	bool finished;
+	int targetstates[MAX_TARGETS];
+	const SpiConfig* config;
+} SpiControlSnapshot;
+
+static void TakeControlSnapshot(SpiSession* pSession, SpiControlSnapshot* pSnapshot)
+{
+	pSnapshot->paused = SpiLoadAcquire(&pSession->pauserecording);
+	pSnapshot->markers = SpiLoadAcquire(&pSession->nummarkers);
+	pSnapshot->saves = SpiLoadAcquire(&pSession->retrosaved);
+	pSnapshot->take = SpiLoadAcquire(&pSession->data.takeIndex);
+	pSnapshot->segment = SpiLoadAcquire(&pSession->data.targets[0].segmentIndex);
+	pSnapshot->armed = SpiLoadAcquire(&pSession->armedchannelmask);
+	pSnapshot->finished = (SpiLoadAcquire(&pSession->data.finished)!=0);
+	pSnapshot->config = SpiLoadAcquire(&pSession->config);
+	for(int t=0; t<MAX_TARGETS; t++) pSnapshot->targetstates[t] = SpiLoadAcquire(&pSession->data.targets[t].state);
+}
+
+// Compare a session's state with the last one seen and push the changes
+static void PushControlEvents(SpiSession* pSession, SpiControlSnapshot* pSnapshot)
+{
+	char line[512];
+	int index = pSession->index;
+	bool paused = SpiLoadAcquire(&pSession->pauserecording);
+	if(paused!=pSnapshot->paused)
+	{
+		pSnapshot->paused = paused;
+		snprintf(line, sizeof(line), "event session=%d %s frame=%lld\n", index, pSnapshot->paused ? "pause" : "resume", SpiAtomicLoad64(&pSession->data.sampleIndex)/global_numchannels);
+		BroadcastControlLine(line);
+	}
+	while(pSnapshot->markers<SpiLoadAcquire(&pSession->nummarkers))
+	{
+		PaUtil_ReadMemoryBarrier();
+		snprintf(line, sizeof(line), "event session=%d marker number=%u frame=%lld\n", index, pSnapshot->markers+1, pSession->markerframes[pSnapshot->markers]);
+		BroadcastControlLine(line);
+		pSnapshot->markers++;
+	}
+	while(pSnapshot->saves<SpiLoadAcquire(&pSession->retrosaved))
+	{
+		pSnapshot->saves++;
+		snprintf(line, sizeof(line), "event session=%d save number=%u file=%.200s\n", index, pSnapshot->saves, RetroSaveFilename(pSession, pSnapshot->saves).c_str());
+		BroadcastControlLine(line);
+	}
+	unsigned take = SpiLoadAcquire(&pSession->data.takeIndex);
+	if(take!=pSnapshot->take)
+	{
+		pSnapshot->take = take;
+		snprintf(line, sizeof(line), "event session=%d take number=%u frame=%lld\n", index, pSnapshot->take+1, SpiAtomicLoad64(&pSession->splitsample)/global_numchannels);
+		BroadcastControlLine(line);
+	}
+	int segment = SpiLoadAcquire(&pSession->data.targets[0].segmentIndex);
+	if(segment!=pSnapshot->segment)
+	{
+		pSnapshot->segment = segment;
+		snprintf(line, sizeof(line), "event session=%d split segment=%d\n", index, pSnapshot->segment);
+		BroadcastControlLine(line);
+	}
+	const SpiConfig* config = SpiLoadAcquire(&pSession->config);
+	if(config!=pSnapshot->config)
+	{
+		pSnapshot->config = config;
+		PaUtil_ReadMemoryBarrier();
+		snprintf(line, sizeof(line), "event session=%d settings generation=%d file=%.200s midichannel=%d midicc=%d\n", index, pSnapshot->config->generation,
+			pSnapshot->config->filename.c_str(), pSnapshot->config->midichannelid+1, pSnapshot->config->midictrlnumber);
+		BroadcastControlLine(line);
+	}
+	unsigned armed = SpiLoadAcquire(&pSession->armedchannelmask);
+	if(armed!=pSnapshot->armed)
+	{
+		pSnapshot->armed = armed;
+		snprintf(line, sizeof(line), "event session=%d armed mask=0x%x\n", index, pSnapshot->armed);
+		BroadcastControlLine(line);
+	}
+	for(int t=0; t<pSession->data.numTargets; t++)
+	{
+		int state = SpiLoadAcquire(&pSession->data.targets[t].state);
+		if(state==pSnapshot->targetstates[t]) continue;
+		pSnapshot->targetstates[t] = state;
+		snprintf(line, sizeof(line), "event session=%d target=%d %s\n", index, t, TargetStateName(pSnapshot->targetstates[t]));
+		BroadcastControlLine(line);
+	}
+	if(SpiLoadAcquire(&pSession->data.finished) && !pSnapshot->finished)
+	{
+		pSnapshot->finished = true;
+		snprintf(line, sizeof(line), "event session=%d stop\n", index);
+		BroadcastControlLine(line);
+	}
+}
+
+static int threadFunctionControl(void* ptr)
+{
+	(void)ptr;
+	SpiControlSnapshot snapshots[MAX_SESSIONS];
+	unsigned ticks = 0;
+	for(int i=0; i<global_numsessions; i++) TakeControlSnapshot(global_sessions[i], &snapshots[i]);
+
+	// Mark thread started
+	SpiStoreRelease(&global_controlsyncflag, 0);
+	while(!SpiLoadAcquire(&global_controlsyncflag))
+	{
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(global_controlfd, &readfds);
+		int maxfd = global_controlfd;
+		for(int i=0; i<MAX_CONTROL_CLIENTS; i++)
+		{
+			if(global_controlclients[i].fd<0) continue;
+			FD_SET(global_controlclients[i].fd, &readfds);
+			maxfd = max(maxfd, global_controlclients[i].fd);
+		}
+		struct timeval timeout = { 0, CONTROL_POLL_MS*1000 };
+		int ready = select(maxfd+1, &readfds, NULL, NULL, &timeout);
+		if(ready>0 && FD_ISSET(global_controlfd, &readfds))
+		{
+			int fd = accept(global_controlfd, NULL, NULL);
+			int i;
+			for(i=0; fd>=0 && i<MAX_CONTROL_CLIENTS && global_controlclients[i].fd>=0; i++);
+			if(fd>=0 && i==MAX_CONTROL_CLIENTS)
+			{
+				send(fd, "error too many clients\n", 23, MSG_NOSIGNAL);
+				close(fd);
+			}
+			else if(fd>=0)
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				global_controlclients[i].fd = fd;
+				global_controlclients[i].length = 0;
+			}
+		}
+		for(int i=0; ready>0 && i<MAX_CONTROL_CLIENTS; i++)
+		{
+			SpiControlClient* pClient = &global_controlclients[i];
+			if(pClient->fd<0 || !FD_ISSET(pClient->fd, &readfds)) continue;
+			ssize_t n = recv(pClient->fd, pClient->line+pClient->length, CONTROL_LINE_BYTES-1-pClient->length, 0);
+			if(n<=0)
+			{
+				close(pClient->fd);
+				pClient->fd = -1;
+				continue;
+			}
+			pClient->length += (int)n;
+			pClient->line[pClient->length] = '\0';
+			char* pLine = pClient->line;
+			char* pEnd;
+			while(pClient->fd>=0 && (pEnd = strchr(pLine, '\n'))!=NULL)
+			{
+				*pEnd = '\0';
+				HandleControlLine(pClient, pLine);
+				pLine = pEnd+1;
+			}
+			if(pClient->fd<0) continue;
+			pClient->length -= (int)(pLine - pClient->line);
+			memmove(pClient->line, pLine, pClient->length+1);
+			if(pClient->length==CONTROL_LINE_BYTES-1)
+			{
+				//no newline in sight, discard
+				SendControlLine(pClient, "error line too long\n");
+				pClient->length = 0;
+			}
+		}
+		for(int i=0; i<global_numsessions; i++) PushControlEvents(global_sessions[i], &snapshots[i]);
+		if(++ticks % (1000/CONTROL_POLL_MS) == 0)
+		{
+			for(int i=0; i<global_numsessions; i++)
+			{
+				char line[512];
+				strcpy(line, "event status ");
+				FormatControlStatus(global_sessions[i], line+13, sizeof(line)-14);
+				strcat(line, "\n");
+				BroadcastControlLine(line);
+			}
+		}
+	}
+	for(int i=0; i<global_numsessions; i++) PushControlEvents(global_sessions[i], &snapshots[i]);
+	BroadcastControlLine("event exit\n");
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++)
+	{
+		if(global_controlclients[i].fd>=0) close(global_controlclients[i].fd);
+		global_controlclients[i].fd = -1;
+	}
+	SpiStoreRelease(&global_controlsyncflag, 0);
+	return 0;
+}
+
+static bool SpiControl_Start(const string& path)
+{
+	struct sockaddr_un address;
+	if(path.length()>=sizeof(address.sun_path))
+	{
+		printf("error, control socket path %s is too long\n", path.c_str());
+		return false;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	unlink(path.c_str()); //left over by a previous run
+	global_controlfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(global_controlfd<0 || bind(global_controlfd, (struct sockaddr*)&address, sizeof(address))<0 || listen(global_controlfd, MAX_CONTROL_CLIENTS)<0)
+	{
+		printf("error, can't listen on control socket %s (%s)\n", path.c_str(), strerror(errno));
+		if(global_controlfd>=0) close(global_controlfd);
+		global_controlfd = -1;
+		return false;
+	}
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++) global_controlclients[i].fd = -1;
+	SpiStoreRelease(&global_controlsyncflag, 1);
+	global_controlthread = SpiCreateThread(threadFunctionControl, NULL, NULL);
+	if(global_controlthread==NULL)
+	{
+		close(global_controlfd);
+		global_controlfd = -1;
+		unlink(path.c_str());
+		return false;
+	}
+	while(SpiLoadAcquire(&global_controlsyncflag)) Pa_Sleep(1);
+	printf("control socket listening on %s\n", path.c_str());
+	return true;
+}
+
+static void SpiControl_Stop()
+{
+	if(global_controlthread==NULL) return;
+	SpiStoreRelease(&global_controlsyncflag, 1);
+	while(SpiLoadAcquire(&global_controlsyncflag)) Pa_Sleep(1);
+	SpiJoinThread(global_controlthread);
+	global_controlthread = NULL;
+	close(global_controlfd);
+	global_controlfd = -1;
+	unlink(global_controlpath.c_str());
+}
+#else
+// No unix domain sockets in the win32 sdk this project builds with
+static bool SpiControl_Start(const string& path)
+{
+	printf("error, --control=%s needs unix domain sockets, not available in this build\n", path.c_str());
+	return false;
+}
+
+static void SpiControl_Stop()
+{
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//    metrics
+//
+// --metrics=spirecord.prom rewrites a text file in the prometheus exposition
+// format every --metricsms (1000 ms by default), for a node exporter textfile
+// collector or anything that can read a file. the file is written next to
+// its final name and renamed over it, a reader never sees half of it.
+//
+// the values come from counters that each have a single writer: the callback
+// keeps the ring's peak fill, the dropped samples, the device overflows and,
+// with --metrics only, a histogram of its own durations. each target keeps a
+// histogram of its write durations, the midi thread counts the messages it
+// dispatches. main reads them without locking, a snapshot may be a buffer
+// old. the sample and frame counters are 64-bit, a counter never goes back
+// (prometheus would take it for a restart).
+///////////////////////////////////////////////////////////////////////////////
+
+#define METRICS_PREFIX "spirecord_"
+
+string global_metricspath; //--metrics=path, empty for no metrics
+double global_metricsperiod = 1.0;
+double global_nextmetricsseconds = 0.0;
+
+enum
+{
+	METRIC_RING_FILL = 0,
+	METRIC_RING_PEAK,
+	METRIC_RING_CAPACITY,
+	METRIC_RECORDED_FRAMES,
+	METRIC_DROPPED_SAMPLES,
+	METRIC_INPUT_OVERFLOWS,
+	METRIC_SPILLED_SAMPLES,
+	METRIC_PAUSED,
+	METRIC_MIDI_EVENTS,
+	METRIC_COMMANDS_DROPPED,
+	NUM_SESSION_METRICS
+};
+
+static const struct { const char* name; const char* type; const char* help; } sessionmetrics[NUM_SESSION_METRICS] = {
+	{ "ring_fill_samples", "gauge", "Samples in the ring not yet written by every target" },
+	{ "ring_peak_samples", "gauge", "Most samples the ring held" },
+	{ "ring_capacity_samples", "gauge", "Size of the ring in samples" },
+	{ "recorded_frames_total", "counter", "Frames captured into the take" },
+	{ "dropped_samples_total", "counter", "Samples lost with the ring and the spill arena full" },
+	{ "input_overflows_total", "counter", "Input overflows reported by the audio device" },
+	{ "spilled_samples_total", "counter", "Samples that went through the spill arena" },
+	{ "paused", "gauge", "1 while recording is paused" },
+	{ "midi_events_total", "counter", "Midi messages dispatched to the session" },
+	{ "commands_dropped_total", "counter", "Commands lost with the session's command queue full" }
+};
+
+enum
+{
+	METRIC_FRAMES_WRITTEN = 0,
+	METRIC_BYTES_WRITTEN,
+	METRIC_TARGET_LAG,
+	METRIC_TARGET_ACTIVE,
+	METRIC_WRITE_ERRORS,
+	NUM_TARGET_METRICS
+};
+
+static const struct { const char* name; const char* type; const char* help; } targetmetrics[NUM_TARGET_METRICS] = {
+	{ "written_frames_total", "counter", "Frames written to the target's files" },
+	{ "written_bytes_total", "counter", "Sample bytes written to the target's files, headers excluded" },
+	{ "target_lag_frames", "gauge", "Frames captured but not yet written to the target" },
+	{ "target_active", "gauge", "1 while the target is written, 0 once it failed or was dropped" },
+	{ "write_errors_total", "counter", "Failed writes to the target's files" }
+};
+
+static double SessionMetricValue(SpiSession* pSession, int metric)
+{
+	paTestData* pData = &pSession->data;
+	switch(metric)
+	{
+	case METRIC_RING_FILL: return (double)SpiFrameRing_Fill(&pData->ring) * global_numchannels;
+	case METRIC_RING_PEAK: return (double)SpiLoadAcquire(&pData->ringPeak);
+	case METRIC_RING_CAPACITY: return (double)RingCapacitySamples(pData);
+	case METRIC_RECORDED_FRAMES: return (double)SpiAtomicLoad64(&pData->recordedFrames);
+	case METRIC_DROPPED_SAMPLES: return (double)SpiAtomicLoad64(&pData->droppedSamples);
+	case METRIC_INPUT_OVERFLOWS: return (double)SpiLoadAcquire(&pData->inputOverflows);
+	case METRIC_SPILLED_SAMPLES: return (double)SpiAtomicLoad64(&pData->spilledSamples);
+	case METRIC_PAUSED: return SpiLoadAcquire(&pSession->pauserecording) ? 1.0 : 0.0;
+	case METRIC_MIDI_EVENTS: return (double)SpiLoadAcquire(&pSession->midievents);
+	case METRIC_COMMANDS_DROPPED: return (double)SpiLoadAcquire(&pSession->commandqueue.dropped);
+	}
+	return 0.0;
+}
+
+static double TargetMetricValue(SpiTarget* pTarget, int metric)
+{
+	long long written = SpiAtomicLoad64(&pTarget->samplesWritten);
+	double samples = (double)written * pTarget->numchannels / global_numchannels;
+	switch(metric)
+	{
+	case METRIC_FRAMES_WRITTEN: return (double)(written / global_numchannels);
+	case METRIC_BYTES_WRITTEN: return samples * pTarget->pPipeline->outbytes;
+	case METRIC_TARGET_LAG: return (double)(TargetLag(pTarget) / global_numchannels);
+	case METRIC_TARGET_ACTIVE: return SpiLoadAcquire(&pTarget->state)==TARGET_ACTIVE ? 1.0 : 0.0;
+	case METRIC_WRITE_ERRORS: return (double)SpiLoadAcquire(&pTarget->writeErrors);
+	}
+	return 0.0;
+}
+
+static void AppendMetricFamily(string& text, const char* name, const char* type, const char* help)
+{
+	text += "# HELP " METRICS_PREFIX;
+	text += name;
+	text += " ";
+	text += help;
+	text += "\n# TYPE " METRICS_PREFIX;
+	text += name;
+	text += " ";
+	text += type;
+	text += "\n";
+}
+
+static void AppendMetric(string& text, const char* name, const char* labels, double value)
+{
+	char number[64];
+	snprintf(number, sizeof(number), " %.15g\n", value);
+	number[sizeof(number)-1] = '\0';
+	text += METRICS_PREFIX;
+	text += name;
+	if(labels[0]!='\0')
+	{
+		text += "{";
+		text += labels;
+		text += "}";
+	}
+	text += number;
+}
+
+// Cumulative buckets, sum and count of one histogram
+static void AppendHistogram(string& text, const char* name, const char* labels, const SpiHistogram* pHistogram)
+{
+	char bucketname[64], bucketlabels[128];
+	snprintf(bucketname, sizeof(bucketname), "%s_bucket", name);
+	double count = 0.0;
+	for(int b=0; b<=LATENCY_BUCKETS; b++)
+	{
+		count += pHistogram->counts[b];
+		if(b<LATENCY_BUCKETS) snprintf(bucketlabels, sizeof(bucketlabels), "%s,le=\"%g\"", labels, global_latencybounds[b]);
+		else snprintf(bucketlabels, sizeof(bucketlabels), "%s,le=\"+Inf\"", labels);
+		bucketlabels[sizeof(bucketlabels)-1] = '\0';
+		AppendMetric(text, bucketname, bucketlabels, count);
+	}
+	snprintf(bucketname, sizeof(bucketname), "%s_sum", name);
+	AppendMetric(text, bucketname, labels, pHistogram->sum);
+	snprintf(bucketname, sizeof(bucketname), "%s_count", name);
+	AppendMetric(text, bucketname, labels, count);
+}
+
+// The file's name as a label value, backslashes and quotes escaped
+static string MetricLabelValue(const string& value)
+{
+	string escaped;
+	for(size_t i=0; i<value.size(); i++)
+	{
+		if(value[i]=='\\' || value[i]=='"') escaped += '\\';
+		if(value[i]=='\n') escaped += "\\n";
+		else escaped += value[i];
+	}
+	return escaped;
+}
+
+static void FormatMetrics(string& text)
+{
+	char labels[64];
+	for(int m=0; m<NUM_SESSION_METRICS; m++)
+	{
+		AppendMetricFamily(text, sessionmetrics[m].name, sessionmetrics[m].type, sessionmetrics[m].help);
+		for(int i=0; i<global_numsessions; i++)
+		{
+			snprintf(labels, sizeof(labels), "session=\"%d\"", i);
+			AppendMetric(text, sessionmetrics[m].name, labels, SessionMetricValue(global_sessions[i], m));
+		}
+	}
+	AppendMetricFamily(text, "callback_duration_seconds", "histogram", "Time spent in the audio callback per buffer");
+	for(int i=0; i<global_numsessions; i++)
+	{
+		snprintf(labels, sizeof(labels), "session=\"%d\"", i);
+		AppendHistogram(text, "callback_duration_seconds", labels, &global_sessions[i]->data.callbackLatency);
+	}
+
+	AppendMetricFamily(text, "target_info", "gauge", "The file each target writes to");
+	for(int i=0; i<global_numsessions; i++)
+	{
+		paTestData* pData = &global_sessions[i]->data;
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			snprintf(labels, sizeof(labels), "session=\"%d\",target=\"%d\",file=\"", i, t);
+			string filelabels = labels + MetricLabelValue(pData->targets[t].filename) + "\"";
+			AppendMetric(text, "target_info", filelabels.c_str(), 1.0);
+		}
+	}
+	for(int m=0; m<NUM_TARGET_METRICS; m++)
+	{
+		AppendMetricFamily(text, targetmetrics[m].name, targetmetrics[m].type, targetmetrics[m].help);
+		for(int i=0; i<global_numsessions; i++)
+		{
+			paTestData* pData = &global_sessions[i]->data;
+			for(int t=0; t<pData->numTargets; t++)
+			{
+				snprintf(labels, sizeof(labels), "session=\"%d\",target=\"%d\"", i, t);
+				AppendMetric(text, targetmetrics[m].name, labels, TargetMetricValue(&pData->targets[t], m));
+			}
+		}
+	}
+	AppendMetricFamily(text, "write_duration_seconds", "histogram", "Time spent in each write to the target's files");
+	for(int i=0; i<global_numsessions; i++)
+	{
+		paTestData* pData = &global_sessions[i]->data;
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			snprintf(labels, sizeof(labels), "session=\"%d\",target=\"%d\"", i, t);
+			AppendHistogram(text, "write_duration_seconds", labels, &pData->targets[t].writeLatency);
+		}
+	}
+
+	AppendMetricFamily(text, "log_records_dropped_total", "counter", "Spilog records lost with a log ring full");
+	AppendMetric(text, "log_records_dropped_total", "", (double)SpiLog_GetDroppedCount());
+}
+
+// Write the metrics next to global_metricspath and rename them over it
+static void WriteMetricsFile()
+{
+	string text;
+	FormatMetrics(text);
+	string temppath = global_metricspath + ".tmp";
+	FILE* pFile = fopen(temppath.c_str(), "wb");
+	if(pFile==NULL)
+	{
+		SpiLog("metrics, can't write %s\n", temppath);
+		return;
+	}
+	bool written = (fwrite(text.data(), 1, text.size(), pFile)==text.size());
+	if(fclose(pFile)!=0) written = false;
+#ifdef _WIN32
+	if(written && !MoveFileExA(temppath.c_str(), global_metricspath.c_str(), MOVEFILE_REPLACE_EXISTING)) written = false;
+#else
+	if(written && rename(temppath.c_str(), global_metricspath.c_str())!=0) written = false;
+#endif
+	if(!written) SpiLog("metrics, can't write %s\n", global_metricspath);
+}
+
+// Called from the main loop, rewrites the file once per period
+static void SpiMetrics_Poll(double now)
+{
+	if(global_metricspath.empty() || now < global_nextmetricsseconds) return;
+	global_nextmetricsseconds = now + global_metricsperiod;
+	WriteMetricsFile();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    session setup and teardown
+///////////////////////////////////////////////////////////////////////////////
+
+// Sessions live in SpiAllocateMemory() blocks, zeroed, and locked with
+// --lockmemory since the callback touches the queue and the state
+static SpiSession* CreateSession()
+{
+	if(global_numsessions==MAX_SESSIONS)
+	{
+		printf("error, at most %d sessions\n", MAX_SESSIONS);
+		return NULL;
+	}
+	void* pMemory = SpiAllocateMemory(sizeof(SpiSession), "session");
+	if(pMemory==NULL) return NULL;
+	SpiSession* pSession = new(pMemory) SpiSession;
+	pSession->index = global_numsessions;
+	pSession->filename = "testrecording.wav"; //usage: spirecord testrecording.wav 10 "E-MU ASIO" 0 1
+	//pSession->filename = "testrecording.w64";
+	pSession->secondsRecord = NUM_SECONDS;
+	//use audio_spi\spidevicesselect.exe to find the name of your devices, only exact name will be matched (name as detected by spidevicesselect.exe)  
+	pSession->audiodevicename = "E-MU ASIO"; //"Wave (2- E-MU E-DSP Audio Proce"
+	//string audiodevicename="Wave (2- E-MU E-DSP Audio Proce"; //"E-MU ASIO"
+	pSession->inputAudioChannelSelectors[0] = 0; // on emu patchmix ASIO device channel 1 (left)
+	pSession->inputAudioChannelSelectors[1] = 1; // on emu patchmix ASIO device channel 2 (right)
+	//pSession->inputAudioChannelSelectors[0] = 2; // on emu patchmix ASIO device channel 3 (left)
+	//pSession->inputAudioChannelSelectors[1] = 3; // on emu patchmix ASIO device channel 4 (right)
+	//pSession->inputAudioChannelSelectors[0] = 8; // on emu patchmix ASIO device channel 9 (left)
+	//pSession->inputAudioChannelSelectors[1] = 9; // on emu patchmix ASIO device channel 10 (right)
+	//pSession->inputAudioChannelSelectors[0] = 10; // on emu patchmix ASIO device channel 11 (left)
+	//pSession->inputAudioChannelSelectors[1] = 11; // on emu patchmix ASIO device channel 12 (right)
+	pSession->armedchannelmask = 0xffffffff;
+	pSession->midiinput = -1;
+	pSession->midichannelid = 0;
+	pSession->midictrlnumber = 64;
+	for(int t=0; t<MAX_TARGETS; t++)
+	{
+		SpiTarget* pTarget = &pSession->data.targets[t];
+		pTarget->pSession = pSession;
+		pTarget->index = t;
+		pTarget->pPipeline = &global_pipeline;
+		pTarget->numchannels = global_routedchannels ? global_routedchannels : global_numchannels;
+		pTarget->matrix = global_routedchannels ? &global_matrix : NULL;
+		pTarget->writeRegions = WriteRegionsToWavFile;
+		pTarget->fd = -1;
+		pTarget->state = TARGET_ACTIVE;
+	}
+	pSession->data.numTargets = 1;
+	pSession->data.spillOpen = SPILL_NONE;
+	SpiCommand_Init(pSession);
+	global_sessions[global_numsessions++] = pSession;
+	return pSession;
+}
+
+// The positional arguments of one session: filename, seconds, audio device,
+// two asio channel selectors, midi device, midi channel and control number
+static void ParseSessionArguments(SpiSession* pSession, int argc, char* argv[], string& midiinputname)
+{
+	if(argc>0)
+	{
+		//first argument is the filename
+		pSession->filename = argv[0];
+	}
+	if(argc>1)
+	{
+		//second argument is the time it will play
+		pSession->secondsRecord = (float)atof(argv[1]);
+	}
+	if(argc>2)
+	{
+		pSession->audiodevicename = argv[2]; //for spi, device name could be "E-MU ASIO", "Speakers (2- E-MU E-DSP Audio Processor (WDM))", etc.
+	}
+	if(argc>3)
+	{
+		pSession->inputAudioChannelSelectors[0]=atoi(argv[3]); //0 for first asio channel (left) or 2, 4, 6, etc.
+	}
+	if(argc>4)
+	{
+		pSession->inputAudioChannelSelectors[1]=atoi(argv[4]); //1 for second asio channel (right) or 3, 5, 7, etc.
+	}
+	if(argc>5)
+	{
+		midiinputname = argv[5]; //"In From MIDI Yoke:  1", "In From MIDI Yoke:  2", ... , "In From MIDI Yoke:  8"
+	}
+	if(argc>6)
+	{
+		pSession->midichannelid = atoi(argv[6]); //0 for midi channel 1, ..., up to 15 for midi channel 16
+	}
+	if(argc>7)
+	{
+		pSession->midictrlnumber = atoi(argv[7]); //midi control number between 0 and 127
+	}
+	//asio channel selectors beyond the two given continue consecutively
+	for(int i=2; i<global_numchannels; i++)
+	{
+		pSession->inputAudioChannelSelectors[i] = pSession->inputAudioChannelSelectors[i-1] + 1;
+	}
+	pSession->fileformat = ContainerFormat(pSession->filename) | global_fileformat;
+}
+
+// --sessions=file.txt, one session per line with the positional arguments
+// (double quotes around names with spaces) and an optional --midimap=file.txt,
+// # starts a comment
+static bool LoadSessionsFile(const char* filename, vector<string>& midiinputnames)
+{
+	FILE* pFile = fopen(filename, "r");
+	if(pFile==NULL)
+	{
+		printf("error, can't open sessions file %s\n", filename);
+		return false;
+	}
+	char line[1024];
+	while(fgets(line, sizeof(line), pFile))
+	{
+		char* tokens[16];
+		int numtokens = 0;
+		string midimapfilename = GetOption("midimap", "");
+		string windowsspec = GetOption("windows", "");
+		char* hash = strchr(line, '#');
+		if(hash) *hash = '\0';
+		for(char* p=line; numtokens<16; )
+		{
+			while(*p==' ' || *p=='\t' || *p=='\r' || *p=='\n') p++;
+			if(*p=='\0') break;
+			char end = ' ';
+			if(*p=='"') { end = '"'; p++; }
+			char* token = p;
+			while(*p!='\0' && *p!=end && (end=='"' || (*p!='\t' && *p!='\r' && *p!='\n'))) p++;
+			if(*p!='\0') *p++ = '\0';
+			if(strncmp(token, "--midimap=", 10)==0) midimapfilename = token+10;
+			else if(strncmp(token, "--windows=", 10)==0) windowsspec = token+10;
+			else tokens[numtokens++] = token;
+		}
+		if(numtokens==0) continue;
+		SpiSession* pSession = CreateSession();
+		if(pSession==NULL)
+		{
+			fclose(pFile);
+			return false;
+		}
+		string midiinputname;
+		ParseSessionArguments(pSession, numtokens, tokens, midiinputname);
+		pSession->midimapfilename = midimapfilename;
+		pSession->windowsspec = windowsspec;
+		midiinputnames.push_back(midiinputname);
+	}
+	fclose(pFile);
+	return global_numsessions>0;
+}
+
+// Ring, staging buffer, stream and file of one session
+static PaError OpenSession(SpiSession* pSession, unsigned numFrames)
+{
+    paTestData* pData = &pSession->data;
+    unsigned numBytes = numFrames * global_numchannels * global_samplebytes;
+    pData->ringBufferData = SpiAllocateMemory( numBytes, "ring buffer" );
+    if( pData->ringBufferData == NULL )
+    {
+        printf("Could not allocate ring buffer data.\n");
+        return paInsufficientMemory;
+    }
  
-            /* By using PaUtil_GetRingBufferReadRegions, we can read directly from the ring buffer */
-            ring_buffer_size_t elementsRead = PaUtil_GetRingBufferReadRegions(&pData->ringBuffer, elementsInBuffer, ptr + 0, sizes + 0, ptr + 1, sizes + 1);
-            if (elementsRead > 0)
+    for (int t = 0; t < pData->numTargets; t++)
+    {
+        pData->targets[t].stagingData = SpiAllocateMemory( STAGING_SAMPLES * 4, "writer staging buffer" );
+        if( pData->targets[t].stagingData == NULL )
+        {
+            printf("Could not allocate writer staging buffer.\n");
+            return paInsufficientMemory;
+        }
+        if (pData->targets[t].matrix)
+        {
+            pData->targets[t].mixData = (float*)SpiAllocateMemory( (STAGING_SAMPLES/global_numchannels) * pData->targets[t].numchannels * sizeof(float), "routing matrix output" );
+            if( pData->targets[t].mixData == NULL )
             {
-                int i;
-                for (i = 0; i < 2 && ptr[i] != NULL; ++i)
-                {
-                    fwrite(ptr[i], pData->ringBuffer.elementSizeBytes, sizes[i], pData->file);
-                }
-                PaUtil_AdvanceRingBufferReadIndex(&pData->ringBuffer, elementsRead);
+                printf("Could not allocate routing matrix output.\n");
+                return paInsufficientMemory;
             }
- 
-            if (pData->threadSyncFlag)
+        }
+        if (global_manifestblock > 0) pData->targets[t].manifest = new SpiManifest();
+        if (global_filerate != global_samplerate)
+        {
+            pData->targets[t].resampler = OpenResampler(pData->targets[t].numchannels);
+            if( pData->targets[t].resampler == NULL )
             {
-                break;
+                printf("Could not allocate resampler.\n");
+                return paInsufficientMemory;
             }
         }
+    }
  
-        /* Sleep a little while... */
-        Pa_Sleep(20);
- 
+    if (!SpiFrameRing_Init(&pData->ring, global_numchannels * global_samplebytes, numFrames, pData->ringBufferData))
+    {
+        printf("Failed to initialize ring buffer of %u frames.\n", numFrames);
+        return paInternalError;
+    }
+
+    if (global_spillarena.numChunks > 0)
+    {
+        pData->spillQueue = (SpiSpillEntry*)SpiAllocateMemory( global_spillarena.queueSize * sizeof(SpiSpillEntry), "spill queue" );
+        if( pData->spillQueue == NULL )
+        {
+            printf("Could not allocate spill queue.\n");
+            return paInsufficientMemory;
+        }
     }
  
-    pData->threadSyncFlag = 0;
-    return 0;
-} 
+	if(0)
+	{
+		pSession->inputParameters.device = Pa_GetDefaultInputDevice(); //default input device 
+		if (pSession->inputParameters.device == paNoDevice) 
+		{
+			fprintf(stderr,"Error: No default input device.\n");
+			return paInvalidDevice;
+		}
+		pSession->inputParameters.channelCount = global_numchannels;
+		pSession->inputParameters.sampleFormat = global_sampleformat;
+		pSession->inputParameters.suggestedLatency = Pa_GetDeviceInfo( pSession->inputParameters.device )->defaultLowInputLatency;
+		pSession->inputParameters.hostApiSpecificStreamInfo = NULL;
+	}
+	else if(!global_selftest)
+	{
+		////////////////////////
+		//audio device selection
+		////////////////////////
+		SelectAudioDevice(pSession);
+	}
+
 
+    // Record some audio. -------------------------------------------- 
+    // (the self test calls recordCallback itself)
+    PaError err = global_selftest ? paNoError : Pa_OpenStream(
+              &pSession->stream,
+              &pSession->inputParameters,
+              NULL,                  // &outputParameters, 
+              global_samplerate,
+              FRAMES_PER_BUFFER,
+              paClipOff,      // we won't output out of range samples so don't bother clipping them 
+              recordCallback,
+              pSession );
+    if( err != paNoError ) return err;
  
-typedef int (*ThreadFunctionType)(void*);
+	if(global_peaks)
+	{
+		// The waveform overview, filename.peak
+		pData->peaks = OpenPeakFile(pSession);
+		if (pData->peaks == NULL) return paInternalError;
+	}
+	if(global_loudness)
+	{
+		pData->loudness = OpenLoudness();
+		if (pData->loudness == NULL) return paInsufficientMemory;
+	}
+	for(int t=0; t<pData->numTargets; t++)
+	{
+		SpiTarget* pTarget = &pData->targets[t];
+		bool opened;
+		if(global_retrocapacity>0)
+		{
+			// Open the circular file, see retrospective capture
+			pTarget->writeRegions = WriteRegionsToRetroFile;
+			opened = OpenRetroFile(pTarget);
+		}
+		else if(global_gatherwriter && pTarget->pPipeline==&global_pipeline)
+		{
+			// Open the first segment, written from ring memory with its prebuilt header
+			pTarget->writeRegions = WriteRegionsGather;
+			opened = OpenGatherSegment(pTarget);
+		}
+		else if(0)
+		{
+			// Open the raw audio 'cache' file...
+			pTarget->file = fopen(FILE_NAME, "wb");
+			pTarget->writeRegions = WriteRegionsToRawFile;
+			opened = (pTarget->file != 0);
+		}
+		else
+		{
+			// Open the wav audio 'cache' file...
+			pTarget->file = fopen(pTarget->filename.c_str(), "wb");
+			pTarget->writeRegions = WriteRegionsToWavFile;
+			opened = (pTarget->file != 0);
+		}
+		if(!opened)
+		{
+			// Without the session's own file there is no take, a mirror can be missed
+			if(t==0) return paInternalError;
+			printf("can't open %s, session %d records without this mirror\n", pTarget->filename.c_str(), pSession->index);
+			SpiStoreRelease(&pTarget->state, (int)TARGET_FAILED);
+			continue;
+		}
+		SetupWriteCoalescing(pTarget);
+	}
+	return paNoError;
+}
+
+// Close the session's stream, write what is left in its ring and spilled
+// chunks and close its file. Once the stream is closed nothing is written
+// into the ring anymore, so draining with the read side claimed empties it.
+static PaError FinishSession(SpiSession* pSession)
+{
+	paTestData* pData = &pSession->data;
+	PaError err = paNoError;
+	if(pData->finished) return paNoError;
+	if(pSession->stream)
+	{
+		err = Pa_CloseStream(pSession->stream);
+		pSession->stream = NULL;
+	}
+	if(pData->ringBufferData)
+	{
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			while(!ClaimTarget(&pData->targets[t])) Pa_Sleep(1);
+		}
+		PublishSpillChunk(pData); //the callback is gone, its last chunk is ours
+		for(int t=0; t<pData->numTargets; t++)
+		{
+			SpiTarget* pTarget = &pData->targets[t];
+			while(SpiLoadAcquire(&pTarget->state)==TARGET_ACTIVE && (TargetReadAvailable(pTarget) > 0 || pTarget->spillRead != pData->spillWrite))
+			{
+				DrainTarget(pTarget, true);
+			}
+		}
+		SpiStoreRelease(&pData->finished, 1);
+		for(int t=0; t<pData->numTargets; t++) ReleaseTarget(&pData->targets[t]);
+	}
+	if(pData->spilledSamples > 0)
+	{
+		SpiLog("session %d, %u frames went through the spill arena, at most %u chunks held\n", pSession->index, pData->spilledSamples/global_numchannels, pData->spillPeakChunks);
+	}
+	SpiStoreRelease(&pData->finished, 1);
+	SpiRetro_Poll(pSession, true);
+    // Close files 
+	for(int t=0; t<pData->numTargets; t++)
+	{
+		SpiTarget* pTarget = &pData->targets[t];
+		CloseTarget(pTarget);
+		SpiLog("session %d finished, %u frames written to %s, %s\n", pSession->index, pTarget->samplesWritten/global_numchannels, pTarget->filename, TargetStateName(pTarget->state));
+	}
+	ClosePeakFile(pSession);
+	CloseLoudness(pSession);
+	WriteMarkerFile(pSession);
+	return err;
+}
+
+static void FreeSession(SpiSession* pSession)
+{
+    if( pSession->data.ringBufferData )       // Sure it is NULL or valid. 
+        SpiFreeMemory( pSession->data.ringBufferData );
+    for (int t = 0; t < pSession->data.numTargets; t++)
+    {
+        SpiFreeMemory( pSession->data.targets[t].stagingData );
+        SpiFreeMemory( pSession->data.targets[t].mixData );
+        FreeResampler( pSession->data.targets[t].resampler );
+        delete pSession->data.targets[t].manifest;
+    }
+    FreeConfigs( pSession );
+    SpiFreeMemory( pSession->data.spillQueue );
+	pSession->~SpiSession();
+	SpiFreeMemory( pSession );
+}
+
+// Open a midi input once, the sessions naming the same device share it.
+// Returns the index in global_midiinputs or -1.
+static int OpenMidiInput(const string& name)
+{
+	for(int i=0; i<global_nummidiinputs; i++)
+	{
+		if(global_midiinputs[i].name==name) return i;
+	}
+	if(global_nummidiinputs==MAX_MIDI_INPUTS)
+	{
+		printf("error, at most %d midi inputs\n", MAX_MIDI_INPUTS);
+		return -1;
+	}
+	map<string,int>::iterator it;
+	it = global_inputmididevicemap.find(name);
+	if(it==global_inputmididevicemap.end())
+	{
+		for(it=global_inputmididevicemap.begin(); it!=global_inputmididevicemap.end(); it++)
+		{
+			printf("%s maps to %d\n", (*it).first.c_str(), (*it).second);
+		}
+		printf("input midi device %s not found\n", name.c_str());
+		return -1;
+	}
+	SpiMidiInput* pInput = &global_midiinputs[global_nummidiinputs];
+	pInput->deviceid = (*it).second;
+	pInput->name = name;
+	printf("%s maps to %d\n", name.c_str(), pInput->deviceid);
+	PmError err = Pm_OpenInput(&pInput->stream, pInput->deviceid, NULL, 512, NULL, NULL);
+	if (err) 
+	{
+		printf("%s\n", Pm_GetErrorText(err));
+		return -1;
+	}
+	return global_nummidiinputs++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    self test
+//
+// --selftest=seed records without an audio device. main calls the sessions'
+// callbacks itself on a simulated clock running --selftestspeed (8) times
+// faster than the sample rate. the buffer sizes, input overflow flags, pause
+// toggles (posted to the command queues) and writer stalls of up to
+// --selfteststallms (50 ms) are drawn from the seed. the ring, spill arena,
+// targets, writer pool and final drain are the real ones.
+//
+// samples are captured as int32 and written as pcm32, and each one holds its
+// frame and channel index. once the sessions are finished, each target's
+// file is read back and compared bit for bit with the frames the callbacks
+// recorded, minus the ones they reported as dropped. a dropped target must
+// hold a prefix of them. record windows are ignored. with --matrix a file
+// holds the mixed sums of those frames, with --outrate it is only counted.
+//
+// built with -fsanitize=thread on posix it also checks the concurrency code:
+// the indices and flags shared between threads are published with
+// SpiStoreRelease and read with SpiLoadAcquire, so a report is a real race,
+// with --control, --mirror, --spillmb and the gather writer as well.
+// thread scheduling differs from run to run, the expected files don't.
+///////////////////////////////////////////////////////////////////////////////
+
+#define SELFTEST_MAX_BUFFER (4096)
+
+typedef struct
+{
+	unsigned start; //stream frame
+	unsigned frames;
+} SpiFrameRange;
+
+int global_selftestseed = 0;
+double global_selftestspeed = 8.0;
+int global_selfteststallms = 50;
+static SPI_THREAD_LOCAL unsigned spi_stallseed = 0;
+
+static unsigned SelfTestRandom(unsigned* pSeed)
+{
+	*pSeed = *pSeed * 1103515245u + 12345u;
+	return *pSeed >> 16;
+}
+
+// Writer side, about one write in 32 takes up to --selfteststallms longer
+void SelfTestStall()
+{
+	if(spi_stallseed==0) spi_stallseed = (unsigned)global_selftestseed * 2654435761u + 1;
+	if(global_selfteststallms>0 && SelfTestRandom(&spi_stallseed)%32==0) Pa_Sleep(1 + SelfTestRandom(&spi_stallseed) % global_selfteststallms);
+}
+
+// Call the sessions' callbacks until every take is complete. Each session's
+// kept stream frames are appended to expected[session].
+static unsigned FeedSelfTest(vector<SpiFrameRange>* expected)
+{
+	static int samples[SELFTEST_MAX_BUFFER*MAX_CHANNELS];
+	unsigned seed = (unsigned)global_selftestseed;
+	unsigned callbacks = 0;
+	double simulated = 0.0;
+	double begin = SpiGetSeconds();
+	int pending = global_numsessions;
+	while(pending>0 && !global_stoprequested)
+	{
+		pending = 0;
+		for(int i=0; i<global_numsessions; i++)
+		{
+			SpiSession* pSession = global_sessions[i];
+			paTestData* pData = &pSession->data;
+			if(pData->complete) continue;
+			pending++;
+			unsigned long frames = 1 + SelfTestRandom(&seed) % ((SelfTestRandom(&seed)%8==0) ? SELFTEST_MAX_BUFFER : 2*FRAMES_PER_BUFFER);
+			PaStreamCallbackFlags flags = (SelfTestRandom(&seed)%64==0) ? paInputOverflow : 0;
+			if(SelfTestRandom(&seed)%50==0) SpiCommand_Post(pSession, MIDIACTION_TOGGLE, 0, "selftest");
+			unsigned start = (unsigned)pData->streamFrames; //a selftest is far shorter than 2^32 frames
+			for(unsigned long f=0; f<frames; f++)
+			{
+				for(int c=0; c<global_numchannels; c++) samples[f*global_numchannels+c] = (int)((start+f)*global_numchannels + c);
+			}
+			long long recorded = pData->recordedFrames;
+			long long dropped = pData->droppedSamples;
+			recordCallback(samples, NULL, frames, NULL, flags, pSession);
+			callbacks++;
+			simulated += (double)frames / global_samplerate / global_numsessions;
+			// The written part of a buffer comes first, what didn't fit is dropped
+			unsigned kept = (unsigned)((pData->recordedFrames - recorded) - (pData->droppedSamples - dropped)/global_numchannels);
+			vector<SpiFrameRange>& ranges = expected[i];
+			if(kept==0) continue;
+			if(!ranges.empty() && ranges.back().start + ranges.back().frames == start) ranges.back().frames += kept;
+			else
+			{
+				SpiFrameRange range = { start, kept };
+				ranges.push_back(range);
+			}
+		}
+		double ahead = simulated / global_selftestspeed - (SpiGetSeconds() - begin);
+		if(ahead > 0.001) Pa_Sleep((long)(ahead*1000.0));
+	}
+	return callbacks;
+}
+
+// Read back a target written through --matrix or --outrate. a mixed frame
+// is the matrix's sums of the expected one, within float rounding. a
+// resampled file has the frame count the rate ratio gives, its samples
+// are filtered and not compared.
+static bool VerifyMixedSelfTestTarget(SpiTarget* pTarget, const vector<SpiFrameRange>& expected)
+{
+	static int samples[SELFTEST_MAX_BUFFER*MAX_CHANNELS];
+	const char* filename = pTarget->filename.c_str();
+	int channels = pTarget->numchannels;
+	SndfileHandle infile(filename, SFM_READ, pTarget->fileformat, channels, global_filerate);
+	if(!infile && pTarget->state==TARGET_DROPPED)
+	{
+		printf("selftest, %s dropped before its first write\n", filename);
+		return true;
+	}
+	if(!infile || infile.channels()!=channels || infile.samplerate()!=global_filerate)
+	{
+		printf("selftest FAILED, can't read %s back as %d channels at %d Hz\n", filename, channels, global_filerate);
+		return false;
+	}
+	unsigned total = 0;
+	for(size_t r=0; r<expected.size(); r++) total += expected[r].frames;
+	bool dropped = (pTarget->state==TARGET_DROPPED);
+	unsigned intact = dropped ? (unsigned)(pTarget->intactSamples/global_numchannels) : total;
+	bool compare = (pTarget->resampler==NULL);
+	size_t range = 0;
+	unsigned offset = 0;
+	unsigned frame = 0;
+	sf_count_t n;
+	while((n = infile.readRaw(samples, (sf_count_t)sizeof(int)*channels*SELFTEST_MAX_BUFFER) / (sf_count_t)(sizeof(int)*channels)) > 0)
+	{
+		for(sf_count_t f=0; f<n && compare; f++, frame++)
+		{
+			if(frame>=intact) continue;
+			while(range<expected.size() && offset==expected[range].frames) range++, offset = 0;
+			if(range==expected.size())
+			{
+				printf("selftest FAILED, %s has more than the %u recorded frames\n", filename, total);
+				return false;
+			}
+			unsigned streamframe = expected[range].start + offset++;
+			for(int r=0; r<channels; r++)
+			{
+				double sum = 0.0;
+				for(int c=0; c<global_numchannels; c++) sum += pTarget->matrix->gains[r][c] * (double)(streamframe*global_numchannels + c);
+				int value = samples[f*channels+r];
+				if(fabs(value - sum) > 1.0 + fabs(sum)*1e-6)
+				{
+					printf("selftest FAILED, %s frame %u channel %d holds %d, expected %.1f\n", filename, frame, r, value, sum);
+					return false;
+				}
+			}
+		}
+		if(!compare) frame += (unsigned)n;
+	}
+	unsigned long long resampled = ((unsigned long long)total * global_resamplebank.up + global_resamplebank.down/2) / global_resamplebank.down;
+	unsigned length = compare ? total : (unsigned)resampled;
+	if(frame!=length && pTarget->state==TARGET_ACTIVE)
+	{
+		printf("selftest FAILED, %s has %u frames, expected %u for the %u recorded\n", filename, frame, length, total);
+		return false;
+	}
+	printf("selftest, %s, %u frames %s\n", filename, frame, dropped ? "of a dropped target" : (compare ? "verified, mixed" : "counted, resampled"));
+	return true;
+}
+
+// Read the target's file back and compare it with the expected frames. A
+// dropped target is compared up to where its last write began, that write
+// may end torn (see output targets) and holds a ring and a spill chunk at most.
+static bool VerifySelfTestTarget(SpiTarget* pTarget, const vector<SpiFrameRange>& expected)
+{
+	static int samples[SELFTEST_MAX_BUFFER*MAX_CHANNELS];
+	const char* filename = pTarget->filename.c_str();
+	if(pTarget->state==TARGET_FAILED || pTarget->pPipeline!=&global_pipeline)
+	{
+		printf("selftest, %s not checked\n", filename);
+		return true;
+	}
+	if(pTarget->matrix || pTarget->resampler) return VerifyMixedSelfTestTarget(pTarget, expected);
+	SndfileHandle infile(filename, SFM_READ, pTarget->fileformat, global_numchannels, global_samplerate);
+	if(!infile && pTarget->state==TARGET_DROPPED && pTarget->intactSamples==0)
+	{
+		printf("selftest, %s dropped before its first write\n", filename);
+		return true;
+	}
+	if(!infile)
+	{
+		printf("selftest FAILED, can't read %s back\n", filename);
+		return false;
+	}
+	unsigned total = 0;
+	for(size_t r=0; r<expected.size(); r++) total += expected[r].frames;
+	bool dropped = (pTarget->state==TARGET_DROPPED);
+	unsigned intact = dropped ? pTarget->intactSamples/global_numchannels : total;
+	unsigned torn = (unsigned)pTarget->pSession->data.ring.capacity + (unsigned)global_spillarena.chunkSamples/global_numchannels;
+	size_t range = 0;
+	unsigned offset = 0;
+	unsigned frame = 0;
+	sf_count_t n;
+	while((n = infile.readRaw(samples, (sf_count_t)sizeof(int)*global_numchannels*SELFTEST_MAX_BUFFER) / (sf_count_t)(sizeof(int)*global_numchannels)) > 0) //whole frames
+	{
+		for(sf_count_t f=0; f<n; f++, frame++)
+		{
+			if(frame>=intact) continue;
+			while(range<expected.size() && offset==expected[range].frames) range++, offset = 0;
+			if(range==expected.size())
+			{
+				printf("selftest FAILED, %s has more than the %u recorded frames\n", filename, total);
+				return false;
+			}
+			unsigned streamframe = expected[range].start + offset++;
+			for(int c=0; c<global_numchannels; c++)
+			{
+				int value = (int)(streamframe*global_numchannels + c);
+				if(samples[f*global_numchannels+c]!=value)
+				{
+					printf("selftest FAILED, %s frame %u channel %d holds %d, expected %d\n", filename, frame, c, samples[f*global_numchannels+c], value);
+					return false;
+				}
+			}
+		}
+	}
+	if(frame!=total && pTarget->state==TARGET_ACTIVE)
+	{
+		printf("selftest FAILED, %s has %u frames, %u were recorded\n", filename, frame, total);
+		return false;
+	}
+	if(dropped && frame>intact+torn)
+	{
+		printf("selftest FAILED, %s has %u frames past the %u written before it was dropped\n", filename, frame-intact, intact);
+		return false;
+	}
+	if(dropped) printf("selftest, %s, %u frames verified, a dropped target's prefix and %u frames of its last write\n", filename, min(frame, intact), frame-min(frame, intact));
+	else printf("selftest, %s, %u frames verified\n", filename, frame);
+	return true;
+}
+
+// Record the sessions' takes from generated buffers, finish them and check
+// every file, true when they all hold what was recorded
+static bool RunSelfTest()
+{
+	vector< vector<SpiFrameRange> > expected(global_numsessions);
+	printf("selftest, seed %d, %g times real time, writer stalls up to %d ms\n", global_selftestseed, global_selftestspeed, global_selfteststallms);
+	unsigned callbacks = FeedSelfTest(&expected[0]);
+	bool passed = true;
+	for(int i=0; i<global_numsessions; i++)
+	{
+		SpiSession* pSession = global_sessions[i];
+		FinishSession(pSession);
+		printf("selftest, session %d, %lld frames recorded, %lld samples dropped, %u overflows\n", i, pSession->data.recordedFrames, pSession->data.droppedSamples, pSession->data.inputOverflows);
+		for(int t=0; t<pSession->data.numTargets; t++)
+		{
+			if(!VerifySelfTestTarget(&pSession->data.targets[t], expected[i])) passed = false;
+		}
+	}
+	printf("selftest, %u callbacks, %s\n", callbacks, passed ? "passed" : "FAILED");
+	return passed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//    ring benchmark
+//
+// --ringbench=64 times the frame ring against the PaUtilRingBuffer it
+// replaced, with 64 channels of 32 bit samples, then exits. for each ring a
+// producer thread writes buffers of --ringbenchbuffer (256) frames, like the
+// callback, and a consumer thread takes everything readable in one or two
+// spans and moves the read index, like a writer, for --ringbenchseconds (2).
+// the rings hold --ringms (500) ms at --rate, PaUtilRingBuffer's rounded up
+// to a power of two samples. each sample holds its index, the consumer
+// checks them all. reported are the frames moved per second and the time of
+// the producer's calls, what the callback spends on the ring.
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+	bool frameRing; //else the PaUtilRingBuffer
+	SpiFrameRing ring;
+	PaUtilRingBuffer paRing;
+	int channels;
+	unsigned bufferFrames;
+	volatile int stop;
+	unsigned long long framesRead;
+	unsigned long long writes;
+	double writeSeconds; //in the producer's ring calls
+	bool failed;
+} SpiRingBench;
+
+static int RingBenchProducer(void* arg)
+{
+	SpiRingBench* pBench = (SpiRingBench*)arg;
+	unsigned samples = pBench->bufferFrames * pBench->channels;
+	vector<unsigned> buffer(samples);
+	unsigned next = 0;
+	while(!pBench->stop)
+	{
+		for(unsigned i=0; i<samples; i++) buffer[i] = next + i;
+		double start = PaUtil_GetTime();
+		bool written;
+		if(pBench->frameRing)
+		{
+			written = (SpiFrameRing_WriteAvailable(&pBench->ring, pBench->bufferFrames) >= pBench->bufferFrames);
+			if(written) SpiFrameRing_Write(&pBench->ring, &buffer[0], pBench->bufferFrames);
+		}
+		else
+		{
+			written = (PaUtil_GetRingBufferWriteAvailable(&pBench->paRing) >= (ring_buffer_size_t)samples);
+			if(written) PaUtil_WriteRingBuffer(&pBench->paRing, &buffer[0], samples);
+		}
+		pBench->writeSeconds += PaUtil_GetTime() - start;
+		if(!written)
+		{
+			Pa_Sleep(0); //full, let the consumer run
+			continue;
+		}
+		pBench->writes++;
+		next += samples;
+	}
+	return 0;
+}
+
+// Check the samples of a span against their indexes
+static bool CheckRingBenchSpan(const void* ptr, unsigned samples, unsigned* pNext)
+{
+	const unsigned* p = (const unsigned*)ptr;
+	bool ok = true;
+	for(unsigned i=0; i<samples; i++) ok &= (p[i]==*pNext + i);
+	*pNext += samples;
+	return ok;
+}
+
+static int RingBenchConsumer(void* arg)
+{
+	SpiRingBench* pBench = (SpiRingBench*)arg;
+	unsigned next = 0;
+	unsigned cachedWriteFrame = 0;
+	for(;;)
+	{
+		int stop = pBench->stop;
+		unsigned frames;
+		if(pBench->frameRing)
+		{
+			void* ptr[2];
+			unsigned sizes[2];
+			unsigned cursor = pBench->ring.readFrame;
+			frames = SpiFrameRing_GetReadSpans(&pBench->ring, cursor, &cachedWriteFrame, pBench->ring.capacity, ptr, sizes);
+			for(int i=0; i<2 && ptr[i]; i++)
+			{
+				if(!CheckRingBenchSpan(ptr[i], sizes[i]*pBench->channels, &next)) pBench->failed = true;
+			}
+			PaUtil_FullMemoryBarrier();
+			pBench->ring.readFrame = SpiFrameRing_Advance(&pBench->ring, cursor, frames);
+		}
+		else
+		{
+			void* ptr[2];
+			ring_buffer_size_t sizes[2];
+			ring_buffer_size_t samples = PaUtil_GetRingBufferReadRegions(&pBench->paRing, pBench->paRing.bufferSize, &ptr[0], &sizes[0], &ptr[1], &sizes[1]);
+			for(int i=0; i<2 && sizes[i]>0; i++)
+			{
+				if(!CheckRingBenchSpan(ptr[i], sizes[i], &next)) pBench->failed = true;
+			}
+			PaUtil_AdvanceRingBufferReadIndex(&pBench->paRing, samples);
+			frames = samples / pBench->channels;
+		}
+		pBench->framesRead += frames;
+		if(frames==0)
+		{
+			if(stop) break; //the producer is done and the ring empty
+			Pa_Sleep(0);
+		}
+	}
+	return 0;
+}
 
-/* Start up a new thread in the given function, at the moment only Windows, but should be very easy to extend
- 
-   to posix type OSs (Linux/Mac) */
- 
-static PaError startThread( paTestData* pData, ThreadFunctionType fn ) 
+// Run the producer and the consumer on one ring for seconds
+static bool RunRingBench(SpiRingBench* pBench, double seconds, const char* name, unsigned capacityFrames)
 {
-#ifdef _WIN32
-    typedef unsigned (__stdcall* WinThreadFunctionType)(void*);
-    pData->threadHandle = (void*)_beginthreadex(NULL, 0, (WinThreadFunctionType)fn, pData, CREATE_SUSPENDED, NULL);
-    if (pData->threadHandle == NULL) return paUnanticipatedHostError;
- 
-    /* Set file thread to a little higher prio than normal */
-    SetThreadPriority(pData->threadHandle, THREAD_PRIORITY_ABOVE_NORMAL);
- 
-    /* Start it up */
-    pData->threadSyncFlag = 1;
-    ResumeThread(pData->threadHandle);
-#endif
- 
-    /* Wait for thread to startup */
-    while (pData->threadSyncFlag) {
-        Pa_Sleep(10);
-    }
- 
-    return paNoError;
+	void* producer = SpiCreateThread(RingBenchProducer, pBench, NULL);
+	void* consumer = SpiCreateThread(RingBenchConsumer, pBench, NULL);
+	if(producer==NULL || consumer==NULL)
+	{
+		printf("error, can't start the ring benchmark's threads\n");
+		pBench->stop = 1;
+		SpiJoinThread(producer);
+		SpiJoinThread(consumer);
+		return false;
+	}
+	double start = SpiGetSeconds();
+	Pa_Sleep((long)(seconds*1000.0));
+	pBench->stop = 1;
+	SpiJoinThread(producer);
+	SpiJoinThread(consumer);
+	double elapsed = SpiGetSeconds() - start;
+	printf("ringbench, %s, %u frames: %.3f million frames/s, %.1f ns per producer call, %s\n", name, capacityFrames,
+		pBench->framesRead / elapsed / 1e6, pBench->writes ? pBench->writeSeconds / pBench->writes * 1e9 : 0.0, pBench->failed ? "samples FAILED" : "samples verified");
+	return !pBench->failed;
 }
- 
 
- 
-static int stopThread( paTestData* pData )
+// --ringbench, true when both rings passed the samples through intact
+static bool RunRingBenchmark(int channels, unsigned bufferFrames, double ringms, double seconds)
 {
-    pData->threadSyncFlag = 1;
-    /* Wait for thread to stop */
-    while (pData->threadSyncFlag) {
-        Pa_Sleep(10);
-    }
- 
-#ifdef _WIN32
-    CloseHandle(pData->threadHandle);
-    pData->threadHandle = 0;
-#endif
-
-    return paNoError;
+	unsigned capacityFrames = max((unsigned)(global_samplerate * ringms / 1000.0), bufferFrames);
+	unsigned paSamples = NextPowerOf2(capacityFrames * channels);
+	printf("ringbench, %d channels, buffers of %u frames, %g seconds for each ring\n", channels, bufferFrames, seconds);
+	void* data = SpiAllocateMemory((size_t)max(paSamples, capacityFrames * channels) * sizeof(unsigned), "ring benchmark");
+	if(data==NULL) return false;
+	SpiRingBench* pBench = new SpiRingBench();
+	pBench->channels = channels;
+	pBench->bufferFrames = bufferFrames;
+	bool passed = (PaUtil_InitializeRingBuffer(&pBench->paRing, sizeof(unsigned), paSamples, data) >= 0)
+		&& RunRingBench(pBench, seconds, "PaUtilRingBuffer", paSamples / channels);
+	SpiRingBench* pFrameBench = new SpiRingBench();
+	pFrameBench->frameRing = true;
+	pFrameBench->channels = channels;
+	pFrameBench->bufferFrames = bufferFrames;
+	passed = SpiFrameRing_Init(&pFrameBench->ring, channels * sizeof(unsigned), capacityFrames, data)
+		&& RunRingBench(pFrameBench, seconds, "frame ring", capacityFrames) && passed;
+	delete pBench;
+	delete pFrameBench;
+	SpiFreeMemory(data);
+	return passed;
 }
- 
 
- 
+///////////////////////////////////////////////////////////////////////////////
+//    startup
+//
+// portmidi is initialized on its own thread while portaudio is, and each
+// session's stream starts as soon as it is open, before the writers and
+// the control socket: the ring holds what is captured meanwhile. main
+// waits for the midi thread before its loop. audio devices are looked up
+// by name in a map filled only as far as needed. the time of each step
+// and of the first captured sample is logged.
+///////////////////////////////////////////////////////////////////////////////
 
- 
-/* This routine will be called by the PortAudio engine when audio is needed.
-** It may be called at interrupt level on some machines so don't do anything
-** that could mess up the system like calling malloc() or free().
-*/
-static int recordCallback( const void *inputBuffer, void *outputBuffer,
-                           unsigned long framesPerBuffer,
-                           const PaStreamCallbackTimeInfo* timeInfo,
-                           PaStreamCallbackFlags statusFlags,
-                           void *userData )
+typedef struct
 {
-	if(global_pauserecording) return paContinue;
+	double start; //main entered
+	double options; //options and sessions parsed
+	double midi; //midi inputs open, measured on the midi thread
+	double portaudio; //Pa_Initialize returned
+	double streams; //every stream open and started
+	double writers; //writer pool and control socket started
+	bool logged;
+} SpiStartupTiming;
 
-    paTestData *data = (paTestData*)userData;
-    ring_buffer_size_t elementsWriteable = PaUtil_GetRingBufferWriteAvailable(&data->ringBuffer);
-    ring_buffer_size_t elementsToWrite = min(elementsWriteable, (ring_buffer_size_t)(framesPerBuffer * NUM_CHANNELS));
-    const SAMPLE *rptr = (const SAMPLE*)inputBuffer;
- 
-    (void) outputBuffer; /* Prevent unused variable warnings. */
-    (void) timeInfo;
-    (void) statusFlags;
-    (void) userData;
- 
-    data->frameIndex += PaUtil_WriteRingBuffer(&data->ringBuffer, rptr, elementsToWrite);
- 
-    return paContinue;
+SpiStartupTiming global_startup;
+void* global_midiinitthread = NULL;
+
+// Runs on the midi init thread, or on main when it can't be created
+static int threadFunctionMidiInit(void* ptr)
+{
+	vector<string>* pNames = (vector<string>*)ptr;
+	Pm_Initialize(); //2013dec09, added by spi, was not there
+
+	/////////////////////////////
+	//input midi device selection
+	/////////////////////////////
+	const PmDeviceInfo* deviceInfo;
+	int numDevices = Pm_CountDevices();
+	for( int i=0; i<numDevices; i++ )
+	{
+		deviceInfo = Pm_GetDeviceInfo( i );
+		if (deviceInfo->input)
+		{
+			string devicenamestring = deviceInfo->name;
+			global_inputmididevicemap.insert(pair<string,int>(devicenamestring,i));
+		}
+	}
+
+	// use porttime callback to empty midi queue and print 
+	//Pt_Start(1, receive_poll, global_pInstrument); 
+	Pt_Start(1, receive_poll, 0);
+	// list device information 
+	printf("MIDI input devices:\n");
+	for (int i = 0; i < Pm_CountDevices(); i++) 
+	{
+		const PmDeviceInfo *info = Pm_GetDeviceInfo(i);
+		if (info->input) printf("%d: %s, %s\n", i, info->interf, info->name);
+	}
+	//inputmididevice = get_number("Type input device number: ");
+	showhelp();
+
+	/*
+	//disable
+	controls = false;
+	filter ^= PM_FILT_CONTROL;
+	//re-enable
+	controls = true;
+	filter ^= PM_FILT_CONTROL;
+	*/
+	bender = false;
+	filter ^= PM_FILT_PITCHBEND;
+	bool usesprograms = false;
+	bool usesnotes = false;
+	for(int i=0; i<global_numsessions; i++)
+	{
+		usesprograms = usesprograms || global_sessions[i]->config->midimap.usesprograms;
+		usesnotes = usesnotes || global_sessions[i]->config->midimap.usesnotes;
+	}
+	if(!usesprograms)
+	{
+		pgchanges = false;
+		filter ^= PM_FILT_PROGRAM;
+	}
+	if(!usesnotes)
+	{
+		notes = false;
+		filter ^= PM_FILT_NOTE;
+	}
+	excldata = false;
+	filter ^= PM_FILT_SYSEX;
+	realdata = false;
+	filter ^= (PM_FILT_PLAY | PM_FILT_RESET | PM_FILT_TICK | PM_FILT_UNDEFINED);
+	clksencnt = false;
+	filter ^= PM_FILT_CLOCK;
+
+	for(int i=0; i<global_numsessions; i++)
+	{
+		if((*pNames)[i].empty()) continue;
+		global_sessions[i]->midiinput = OpenMidiInput((*pNames)[i]);
+		if(global_sessions[i]->midiinput>=0) printf("session %d uses midi device %d\n", i, global_midiinputs[global_sessions[i]->midiinput].deviceid);
+	}
+	for(int i=0; i<global_nummidiinputs; i++) Pm_SetFilter(global_midiinputs[i].stream, filter);
+	inited = true; // now can document changes, set filter 
+	printf("Midi Monitoring ready.\n");
+	global_active = true;
+	global_startup.midi = SpiGetSeconds();
+	return 0;
 }
- 
 
- 
-static unsigned NextPowerOf2(unsigned val)
+// Wait for the midi inputs, before the main loop or on the way out
+static void WaitForMidiInit()
 {
-    val--;
-    val = (val >> 1) | val;
-    val = (val >> 2) | val;
-    val = (val >> 4) | val;
-    val = (val >> 8) | val;
-    val = (val >> 16) | val;
-    return ++val;
+	if(global_midiinitthread==NULL) return;
+	SpiJoinThread(global_midiinitthread);
+	global_midiinitthread = NULL;
 }
- 
 
-//migrated data out of the main scope so Terminate() can see it
-paTestData          data = {0};
-PaStream*           stream;
-PaError             err = paNoError;
+// Log the startup steps once every session got its first samples
+static void LogStartupTiming()
+{
+	SpiStartupTiming* pTiming = &global_startup;
+	double firstsample = 0.0;
+	for(int i=0; i<global_numsessions; i++)
+	{
+		if(global_sessions[i]->data.firstSampleSeconds==0.0) return;
+		firstsample = max(firstsample, (double)global_sessions[i]->data.firstSampleSeconds);
+	}
+	pTiming->logged = true;
+	SpiLog("startup, options at %f ms, portaudio at %f ms, streams started at %f ms, writers at %f ms\n",
+		(pTiming->options - pTiming->start)*1000.0, (pTiming->portaudio - pTiming->start)*1000.0,
+		(pTiming->streams - pTiming->start)*1000.0, (pTiming->writers - pTiming->start)*1000.0);
+	if(pTiming->midi>0.0) SpiLog("startup, midi ready at %f ms, in parallel\n", (pTiming->midi - pTiming->start)*1000.0);
+	SpiLog("startup, first sample of every session at %f ms\n", (firstsample - pTiming->start)*1000.0);
+}
 
- 
-/*******************************************************************/
 int main(int argc, char *argv[]);
 int main(int argc, char *argv[])
 {
+	global_startup.start = SpiGetSeconds();
+#ifdef _WIN32
 	int nShowCmd = false;
 	ShellExecuteA(NULL, "open", "begin.bat", "", NULL, nShowCmd);
+#endif
 
 	///////////////////
 	//read in arguments
 	///////////////////
-	global_filename = "testrecording.wav"; //usage: spirecord testrecording.wav 10 "E-MU ASIO" 0 1
-	//global_filename = "testrecording.w64";
-	float fSecondsRecord = NUM_SECONDS; 
-	if(argc>1)
+	ParseNamedOptions(argc, argv); //--midimap=file.txt, etc.
+	//--verify take.wav ... checks files against their .crc32c manifests and exits, see integrity manifest
+	if(GetOption("verify", "0")!="0")
 	{
-		//first argument is the filename
-		global_filename = argv[1];
+		return VerifyManifests(argc-1, argv+1, atoi(GetOption("verifythreads", "0").c_str())) ? 0 : 1;
 	}
-	if(argc>2)
+	//sample format, --format=float32|int32|int24|int16|int8|uint8 as captured, --channels=N, --encoding=pcm16|pcm24|pcm32|float|double|pcm8
+	//--writer=gather writes the captured samples straight from the ring, its encoding is the captured format
+	global_gatherwriter = (GetOption("writer", "sndfile")=="gather");
+	//--retro=10 keeps the last 10 minutes in a circular file, saves are written as captured, see retrospective capture
+	double retrominutes = atof(GetOption("retro", "0").c_str());
+	string format = GetOption("format", "float32");
+	string encoding = GetOption("encoding", (global_gatherwriter || retrominutes>0.0) ? CapturedEncoding(format) : "pcm16");
+	if(retrominutes>0.0 && (global_gatherwriter || !GetOption("mirror", "").empty() || !GetOption("fanout", "").empty() || !GetOption("matrix", "").empty()
+		|| !GetOption("outrate", "").empty() || encoding!=CapturedEncoding(format) || encoding.empty()))
 	{
-		//second argument is the time it will play
-		fSecondsRecord = atof(argv[2]);
+		printf("error, --retro saves samples as captured, without --writer=gather, --mirror, --fanout, --matrix, --outrate, --encoding or --format=int8\n");
+		return 1;
 	}
-	//use audio_spi\spidevicesselect.exe to find the name of your devices, only exact name will be matched (name as detected by spidevicesselect.exe)  
-	global_audiodevicename="E-MU ASIO"; //"Wave (2- E-MU E-DSP Audio Proce"
-	//string audiodevicename="Wave (2- E-MU E-DSP Audio Proce"; //"E-MU ASIO"
-	if(argc>3)
+	//--takes=4 records four takes of the seconds argument back to back, --takes=0 until stopped, see take manager
+	global_numtakes = (unsigned)max(atoi(GetOption("takes", "1").c_str()), 0);
+	if(global_numtakes!=1 && retrominutes>0.0)
 	{
-		global_audiodevicename = argv[3]; //for spi, device name could be "E-MU ASIO", "Speakers (2- E-MU E-DSP Audio Processor (WDM))", etc.
+		printf("error, --retro keeps one circular file, without --takes\n");
+		return 1;
 	}
-	global_inputAudioChannelSelectors[0] = 0; // on emu patchmix ASIO device channel 1 (left)
-	global_inputAudioChannelSelectors[1] = 1; // on emu patchmix ASIO device channel 2 (right)
-	//global_inputAudioChannelSelectors[0] = 2; // on emu patchmix ASIO device channel 3 (left)
-	//global_inputAudioChannelSelectors[1] = 3; // on emu patchmix ASIO device channel 4 (right)
-	//global_inputAudioChannelSelectors[0] = 8; // on emu patchmix ASIO device channel 9 (left)
-	//global_inputAudioChannelSelectors[1] = 9; // on emu patchmix ASIO device channel 10 (right)
-	//global_inputAudioChannelSelectors[0] = 10; // on emu patchmix ASIO device channel 11 (left)
-	//global_inputAudioChannelSelectors[1] = 11; // on emu patchmix ASIO device channel 12 (right)
-	if(argc>4)
+	//--selftest=seed records generated buffers, --selftestspeed=8 times real time, writer stalls up to --selfteststallms=50
+	global_selftest = (GetOption("selftest", "")!="");
+	if(global_selftest)
 	{
-		global_inputAudioChannelSelectors[0]=atoi(argv[4]); //0 for first asio channel (left) or 2, 4, 6, etc.
+		global_selftestseed = atoi(GetOption("selftest", "1").c_str());
+		global_selftestspeed = max(atof(GetOption("selftestspeed", "8").c_str()), 0.01);
+		global_selfteststallms = atoi(GetOption("selfteststallms", "50").c_str());
+		format = "int32"; //samples the ring and the writer must not change, see self test
+		encoding = "pcm32";
+		global_numtakes = 1; //the check reads back one file
 	}
-	if(argc>5)
+	//--rate=48000 for the streams, --outrate=44100 resamples the files in the writers
+	if(!GetOption("rate", "").empty()) global_samplerate = atoi(GetOption("rate", "").c_str());
+	global_filerate = global_samplerate;
+	if(!GetOption("outrate", "").empty()) global_filerate = atoi(GetOption("outrate", "").c_str());
+	if(global_samplerate<1000 || global_filerate<1000)
 	{
-		global_inputAudioChannelSelectors[1]=atoi(argv[5]); //1 for second asio channel (right) or 3, 5, 7, etc.
+		printf("error, --rate and --outrate must be sample rates in Hz\n");
+		return 1;
 	}
-	if(argc>6)
+	//--ringbench=64 times the frame ring against PaUtilRingBuffer, see ring benchmark
+	if(!GetOption("ringbench", "").empty())
+	{
+		int channels = atoi(GetOption("ringbench", "").c_str());
+		unsigned bufferFrames = (unsigned)max(atoi(GetOption("ringbenchbuffer", "256").c_str()), 1);
+		if(channels<1 || channels>1024)
+		{
+			printf("error, --ringbench takes a channel count\n");
+			return 1;
+		}
+		return RunRingBenchmark(channels, bufferFrames, atof(GetOption("ringms", "500").c_str()), max(atof(GetOption("ringbenchseconds", "2").c_str()), 0.1)) ? 0 : 1;
+	}
+	if(global_gatherwriter && global_filerate!=global_samplerate)
 	{
-		global_receivemidi=true;
-		global_inputmididevicename = argv[6]; //"In From MIDI Yoke:  1", "In From MIDI Yoke:  2", ... , "In From MIDI Yoke:  8"
+		printf("error, --writer=gather writes samples as captured, it can't resample to --outrate=%d\n", global_filerate);
+		return 1;
 	}
-	if(argc>7)
+	if(global_filerate!=global_samplerate && !SetupResampleBank())
+	{
+		return 1;
+	}
+	//--matrix=1+2,1-2 or --matrix=file.txt writes sums of the captured channels, see routing matrix
+	string matrix = GetOption("matrix", "");
+	if(global_gatherwriter && !matrix.empty())
+	{
+		printf("error, --writer=gather writes samples as captured, it can't apply --matrix\n");
+		return 1;
+	}
+	if(!SetupMatrix(matrix, atoi(GetOption("channels", "2").c_str())))
+	{
+		return 1;
+	}
+	if(encoding.empty())
+	{
+		printf("error, --writer=gather can't store --format=%s as captured, wav has no signed 8 bit samples\n", format.c_str());
+		return 1;
+	}
+	//--dither adds tpdf dither when pcm16 is written from wider samples
+	if(!SetupSamplePipeline(format, atoi(GetOption("channels", "2").c_str()), encoding, GetOption("dither", "0")!="0"))
+	{
+		return 1;
+	}
+	if(global_gatherwriter && global_pipeline.writetype!=WRITE_RAW)
+	{
+		printf("error, --writer=gather writes samples as captured, --encoding=%s doesn't match --format=%s\n", encoding.c_str(), format.c_str());
+		return 1;
+	}
+	if(retrominutes>0.0 && !global_selftest && !SetupRetro(retrominutes, atof(GetOption("retrobefore", "300").c_str()), atof(GetOption("retroafter", "120").c_str())))
+	{
+		return 1;
+	}
+	//--fanout=pcm16:dither,float:1-2 also records each take in these encodings
+	if(!SetupFanout(GetOption("fanout", "")))
+	{
+		return 1;
+	}
+	//--manifest writes the crc32c of each file's blocks to filename.crc32c, see integrity manifest
+	if(!SetupManifest(GetOption("manifest", "0")!="0", atol(GetOption("manifestblock", "1048576").c_str()), retrominutes>0.0))
+	{
+		return 1;
+	}
+	//--peaks writes a min/max/rms overview next to each file, filename.peak
+	global_peaks = (GetOption("peaks", "0")!="0");
+	if(global_peaks) SetupPeaks();
+	//--loudness measures ebu r128 loudness and true peak, filename.loudness
+	global_loudness = (GetOption("loudness", "0")!="0");
+	if(global_loudness) SetupLoudness();
+	global_metricspath = GetOption("metrics", "");
+	global_metrics = !global_metricspath.empty();
+	global_metricsperiod = max(atof(GetOption("metricsms", "1000").c_str()), 10.0) / 1000.0;
+	//sessions, the positional arguments give one, --sessions=file.txt any number
+	vector<string> midiinputnames;
+	string sessionsfilename = GetOption("sessions", "");
+	if(!sessionsfilename.empty())
+	{
+		if(!LoadSessionsFile(sessionsfilename.c_str(), midiinputnames)) return 1;
+	}
+	else
+	{
+		SpiSession* pSession = CreateSession();
+		if(pSession==NULL) return 1;
+		string midiinputname;
+		ParseSessionArguments(pSession, argc-1, argv+1, midiinputname);
+		//midi mapping file given with --midimap=file.txt, otherwise the single control from the arguments above
+		pSession->midimapfilename = GetOption("midimap", "");
+		//record windows given with --windows=10s-20s,14:30-14:45, the whole take otherwise
+		pSession->windowsspec = GetOption("windows", "");
+		midiinputnames.push_back(midiinputname);
+	}
+	for(int i=0; i<global_numsessions; i++)
+	{
+		SpiSession* pSession = global_sessions[i];
+		if(global_selftest) pSession->windowsspec = "";
+		if(!SetupRecordWindows(pSession)) return 1;
+		//a take longer than the ring can't start before the previous split is written
+		unsigned ringframes = max((unsigned)(global_samplerate * (atof(GetOption("ringms", "500").c_str()) / 1000.0)), 1u);
+		if(global_numtakes!=1 && pSession->recordframes<=(long long)ringframes)
+		{
+			printf("error, with --takes each take must be longer than the ring, %u frames (--ringms)\n", ringframes);
+			return 1;
+		}
+		//--mirror=dir1,dir2 records a copy of each take into every directory, --fanout one file per encoding
+		if(!AddMirrorTargets(pSession, GetOption("mirror", "")) || !AddFanoutTargets(pSession))
+		{
+			printf("error, at most %d files per session with --mirror and --fanout\n", MAX_TARGETS);
+			return 1;
+		}
+		//the midi map, files and encoding as a first snapshot, see hot reconfiguration
+		if(!CreateConfig(pSession)) return 1;
+	}
+	//writer and midi thread scheduling, --writerpriority=fifo:70 (or rr:50, nice:-10), --writercpus=2,3 and --midicpus=1
+	if(!GetOption("writerpriority", "").empty() && !ParseThreadPriority(GetOption("writerpriority", "").c_str(), &global_writerthreadconfig))
+	{
+		printf("error, invalid --writerpriority, expected fifo:<priority>, rr:<priority> or nice:<level>\n");
+	}
+	if(!GetOption("writercpus", "").empty() && !ParseCpuList(GetOption("writercpus", "").c_str(), &global_writerthreadconfig))
+	{
+		printf("error, invalid --writercpus, expected a cpu list like 2,3 or 4-7\n");
+	}
+	if(!GetOption("midicpus", "").empty() && !ParseCpuList(GetOption("midicpus", "").c_str(), &global_midithreadconfig))
 	{
-		global_midichannelid = atoi(argv[7]); //0 for midi channel 1, ..., up to 15 for midi channel 16
+		printf("error, invalid --midicpus, expected a cpu list like 1 or 0-1\n");
 	}
-	if(argc>8)
+	//writer pool size, --writers=N, one writer per target by default so a stalled disk holds only its own
+	int numwriters = atoi(GetOption("writers", "0").c_str());
+	if(numwriters<=0)
 	{
-		global_midictrlnumber = atoi(argv[8]); //midi control number between 0 and 127
+		numwriters = (global_numsessions+7)/8;
+		int numtargets = 0;
+		for(int i=0; i<global_numsessions; i++) numtargets += global_sessions[i]->data.numTargets;
+		numwriters = max(numwriters, numtargets);
 	}
+	numwriters = min(numwriters, MAX_WRITERS);
+#ifdef _WIN32
     //Auto-reset, initially non-signaled event 
     g_hTerminateEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
     //Add the break handler
     ::SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+#else
+	signal(SIGINT, SignalHandler);
+	signal(SIGTERM, SignalHandler);
+#endif
+	SpiEvent_Init(&global_completionevent);
+	//--lockmemory locks and prefaults the ring and the buffers the callback touches, --hugepages backs large rings with huge pages
+	global_lockmemory = (GetOption("lockmemory", "0")!="0");
+	global_hugepages = (GetOption("hugepages", "0")!="0");
+	if(global_lockmemory)
+	{
+		SpiLockMemory(spilog_rings, sizeof(spilog_rings), "log rings");
+		for(int i=0; i<global_numsessions; i++) SpiLockMemory(global_sessions[i], sizeof(SpiSession), "session");
+	}
+	//start the logging thread before any time critical path can post
+	SpiLog_Start();
+	global_startup.options = SpiGetSeconds();
 
 	/////////////////////
 	//initialize portmidi
 	/////////////////////
-	if(global_receivemidi)
+	//on its own thread, portaudio is initialized and the streams are started meanwhile
+	bool receivemidi = false;
+	for(int i=0; i<global_numsessions; i++) receivemidi = receivemidi || !midiinputnames[i].empty();
+	if(receivemidi && !global_selftest)
 	{
-		PmError err;
-		Pm_Initialize(); //2013dec09, added by spi, was not there
-
-		/////////////////////////////
-		//input midi device selection
-		/////////////////////////////
-		const PmDeviceInfo* deviceInfo;
-		int numDevices = Pm_CountDevices();
-		for( int i=0; i<numDevices; i++ )
-		{
-			deviceInfo = Pm_GetDeviceInfo( i );
-			if (deviceInfo->input)
-			{
-				string devicenamestring = deviceInfo->name;
-				global_inputmididevicemap.insert(pair<string,int>(devicenamestring,i));
-			}
-		}
-		map<string,int>::iterator it;
-		it = global_inputmididevicemap.find(global_inputmididevicename);
-		if(it!=global_inputmididevicemap.end())
-		{
-			global_inputmidideviceid = (*it).second;
-			printf("%s maps to %d\n", global_inputmididevicename.c_str(), global_inputmidideviceid);
-			deviceInfo = Pm_GetDeviceInfo(global_inputmidideviceid);
-		}
-		else
-		{
-			assert(false);
-			for(it=global_inputmididevicemap.begin(); it!=global_inputmididevicemap.end(); it++)
-			{
-				printf("%s maps to %d\n", (*it).first.c_str(), (*it).second);
-			}
-			printf("input midi device not found\n");
-		}
-
-		// use porttime callback to empty midi queue and print 
-		//Pt_Start(1, receive_poll, global_pInstrument); 
-		Pt_Start(1, receive_poll, 0);
-		// list device information 
-		printf("MIDI input devices:\n");
-		for (int i = 0; i < Pm_CountDevices(); i++) 
-		{
-			const PmDeviceInfo *info = Pm_GetDeviceInfo(i);
-			if (info->input) printf("%d: %s, %s\n", i, info->interf, info->name);
-		}
-		//inputmididevice = get_number("Type input device number: ");
-		printf("device %d selected\n", global_inputmidideviceid);
-		showhelp();
-
-		err = Pm_OpenInput(&global_pPmStreamMIDIIN, global_inputmidideviceid, NULL, 512, NULL, NULL);
-		if (err) 
-		{
-			printf(Pm_GetErrorText(err));
-			Pt_Stop();
-			Terminate();
-			//mmexit(1);
-		}
-		/*
-		//disable
-		controls = false;
-		filter ^= PM_FILT_CONTROL;
-		//re-enable
-		controls = true;
-		filter ^= PM_FILT_CONTROL;
-		*/
-        bender = false;
-        filter ^= PM_FILT_PITCHBEND;
-        pgchanges = false;
-        filter ^= PM_FILT_PROGRAM;
-        notes = false;
-        filter ^= PM_FILT_NOTE;
-        excldata = false;
-        filter ^= PM_FILT_SYSEX;
-        realdata = false;
-        filter ^= (PM_FILT_PLAY | PM_FILT_RESET | PM_FILT_TICK | PM_FILT_UNDEFINED);
-        clksencnt = false;
-        filter ^= PM_FILT_CLOCK;
-
-		Pm_SetFilter(global_pPmStreamMIDIIN, filter);
-		inited = true; // now can document changes, set filter 
-		printf("Midi Monitoring ready.\n");
-		global_active = true;
+		global_midiinitthread = SpiCreateThread(threadFunctionMidiInit, &midiinputnames, NULL);
+		if(global_midiinitthread==NULL) threadFunctionMidiInit(&midiinputnames);
 	}
 
     //PaStreamParameters  inputParameters;
@@ -729,139 +7814,111 @@ int main(int argc, char *argv[])
     //PaError             err = paNoError;
     //paTestData          data = {0};
     //unsigned            delayCntr;
-    float delayCntr;
-    unsigned numSamples;
-    unsigned numBytes;
+    double nextlogseconds;
+    unsigned numFrames;
+    int numactive;
+    bool selftestfailed;
  
     printf("patest_record.c\n"); fflush(stdout);
+    selftestfailed = false;
+ 
+    err = Pa_Initialize();
+    if( err != paNoError ) goto done;
+    global_startup.portaudio = SpiGetSeconds();
  
-    // We set the ring buffer size to about 500 ms
-    numSamples = NextPowerOf2((unsigned)(SAMPLE_RATE * 0.5 * NUM_CHANNELS));
-    numBytes = numSamples * sizeof(SAMPLE);
-    data.ringBufferData = (SAMPLE *) PaUtil_AllocateMemory( numBytes );
-    if( data.ringBufferData == NULL )
+    // We set the ring buffer size to 500 ms of frames, or --ringms
+    numFrames = max((unsigned)(global_samplerate * (atof(GetOption("ringms", "500").c_str()) / 1000.0)), 1u);
+    // Spill arena shared by the sessions, --spillseconds of chunks for each
+    if (atof(GetOption("spillseconds", "0").c_str()) > 0.0 && !SpiSpill_Init(atof(GetOption("spillseconds", "0").c_str()), global_numsessions))
     {
-        printf("Could not allocate ring buffer data.\n");
+        err = paInsufficientMemory;
         goto done;
     }
- 
-    if (PaUtil_InitializeRingBuffer(&data.ringBuffer, sizeof(SAMPLE), numSamples, data.ringBufferData) < 0)
+    // Capture into the ring as soon as each stream is open, the writers start after
+    for(int i=0; i<global_numsessions; i++)
     {
-        printf("Failed to initialize ring buffer. Size is not power of 2 ??\n");
-        goto done;
+        err = OpenSession(global_sessions[i], numFrames);
+        if( err != paNoError ) goto done;
+        SetupRecordWindows(global_sessions[i]); //wall-clock windows count from now
+        if( global_selftest ) continue;
+        err = Pa_StartStream( global_sessions[i]->stream );
+        if( err != paNoError ) goto done;
     }
- 
-    err = Pa_Initialize();
-    if( err != paNoError ) goto done;
- 
- 
-	if(0)
-	{
-		global_inputParameters.device = Pa_GetDefaultInputDevice(); //default input device 
-		if (global_inputParameters.device == paNoDevice) 
-		{
-			fprintf(stderr,"Error: No default input device.\n");
-			goto done;
-		}
-		global_inputParameters.channelCount = 2;                    // stereo input
-		global_inputParameters.sampleFormat = PA_SAMPLE_TYPE;
-		global_inputParameters.suggestedLatency = Pa_GetDeviceInfo( global_inputParameters.device )->defaultLowInputLatency;
-		global_inputParameters.hostApiSpecificStreamInfo = NULL;
-	}
-	else
-	{
-		////////////////////////
-		//audio device selection
-		////////////////////////
-		SelectAudioDevice();
-	}
-
-
-    // Record some audio. -------------------------------------------- 
-    err = Pa_OpenStream(
-              &stream,
-              &global_inputParameters,
-              NULL,                  // &outputParameters, 
-              SAMPLE_RATE,
-              FRAMES_PER_BUFFER,
-              paClipOff,      // we won't output out of range samples so don't bother clipping them 
-              recordCallback,
-              &data );
- 
-    if( err != paNoError ) goto done;
- 
-	if(0)
-	{
-		// Open the raw audio 'cache' file...
-		data.file = fopen(FILE_NAME, "wb");
-		if (data.file == 0) goto done;
-	}
-	else
-	{
-		// Open the wav audio 'cache' file...
-		data.file = fopen(global_filename.c_str(), "wb");
-		if (data.file == 0) goto done;
-	}
+    global_startup.streams = SpiGetSeconds();
 
-    // Start the file writing thread 
-    if(0)
-	{
-		err = startThread(&data, threadFunctionWriteToRawFile);
-	}
-	else
-	{
-		err = startThread(&data, threadFunctionWriteToWavFile);
-	}
+    // Start the thread syncing finished files, then the file writing threads, see take manager
+    SpiFinalizer_Start();
+    err = startWriterPool(&global_writerpool, numwriters);
 	if( err != paNoError ) goto done;
+    printf("%d sessions serviced by %d writer threads\n", global_numsessions, global_writerpool.numThreads);
  
-    err = Pa_StartStream( stream );
-    if( err != paNoError ) goto done;
+    //control socket given with --control=/tmp/spirecord.sock
+    global_controlpath = GetOption("control", "");
+    if(!global_controlpath.empty() && !SpiControl_Start(global_controlpath))
+    {
+        err = paInternalError;
+        goto done;
+    }
+    //settings changed while recording with --config=file.txt, see hot reconfiguration
+    SpiConfigFile_Start(GetOption("config", ""));
+    global_startup.writers = SpiGetSeconds();
+    WaitForMidiInit();
+    if(global_selftest)
+    {
+        selftestfailed = !RunSelfTest();
+        goto done;
+    }
     //printf("\n=== Now recording to '" FILE_NAME "' for %f seconds!! Press P to pause/unpause recording. ===\n", fSecondsRecord); fflush(stdout);
-    printf("\n=== Now recording to \"%s\" for %f seconds!!\nPress P to pause/unpause recording. ===\n\n", global_filename.c_str(), fSecondsRecord); fflush(stdout);
+    if(global_lockmemory) printf("%lu bytes locked in memory\n", (unsigned long)global_lockedbytes);
+    for(int i=0; i<global_numsessions; i++)
+    {
+        printf("\n=== Now recording to \"%s\" for %f seconds!!", global_sessions[i]->filename.c_str(), global_sessions[i]->secondsRecord);
+    }
+    printf("\nPress P to pause/unpause recording. ===\n\n"); fflush(stdout);
  
-    // Note that the RECORDING part is limited with TIME, not size of the file and/or buffer, so you can
+    // Note that the RECORDING part is limited in frames by the callback, see
+    // record windows, not by the size of the file and/or buffer, so you can
     // increase NUM_SECONDS until you run out of disk 
-    delayCntr = 0;
-    //while( delayCntr++ < fSecondsRecord )
-    while( delayCntr < fSecondsRecord )
+    // The keyboard is polled every MAIN_POLL_MS, a completed take or a stop
+    // wakes main at once, the recorded time is logged once per second
+    nextlogseconds = SpiGetSeconds();
+    numactive = global_numsessions;
+    while( numactive>0 && !global_stoprequested )
     {
-        //printf("index = %d\n", data.frameIndex ); fflush(stdout);
-        printf("rec time = %f\n", delayCntr ); fflush(stdout);
-		if(_kbhit() && _getch()=='p')
-		{
-			if(global_pauserecording==false)
-			{
-				global_pauserecording=true;
-				printf("pause pressed\n"); fflush(stdout);
-			}
-			else
-			{
-				global_pauserecording=false;
-				printf("unpause pressed\n"); fflush(stdout);
-			}
-		}
-        Pa_Sleep(1000);
-		if(!global_pauserecording) delayCntr++;
+        bool logtime = (SpiGetSeconds() >= nextlogseconds);
+        if(logtime) nextlogseconds += 1.0;
+        if(!global_startup.logged) LogStartupTiming();
+        SpiMetrics_Poll(SpiGetSeconds());
+        SpiConfigFile_Poll(SpiGetSeconds());
+        int key = SpiKbhit() ? SpiGetch() : 0;
+        SpiEvent_Wait(&global_completionevent, MAIN_POLL_MS);
+        numactive = 0;
+        for(int i=0; i<global_numsessions; i++)
+        {
+            SpiSession* pSession = global_sessions[i];
+            if(pSession->data.finished) continue;
+            //printf("index = %d\n", pSession->data.sampleIndex ); fflush(stdout);
+            if(logtime) SpiLog("session %d, rec time = %f\n", i, (double)SpiAtomicLoad64(&pSession->data.recordedFrames)/global_samplerate );
+            if(key=='p') SpiCommand_Post(pSession, MIDIACTION_TOGGLE, 0, "keyboard");
+            if(key=='s') SpiCommand_Post(pSession, MIDIACTION_SAVE, 0, "keyboard");
+            if(key=='n') SpiCommand_Post(pSession, MIDIACTION_NEXT, 0, "keyboard");
+            SpiRetro_Poll(pSession, false);
+            DropLaggingTargets(&pSession->data); //also when every writer is stuck, see output targets
+            if(pSession->data.complete || pSession->stoprequested)
+            {
+                FinishSession(pSession);
+                continue;
+            }
+            numactive++;
+        }
     }
     if( err < 0 ) goto done;
  
-	/*
-    err = Pa_CloseStream( stream );
-    if( err != paNoError ) goto done;
- 
-    // Stop the thread 
-    err = stopThread(&data);
-    if( err != paNoError ) goto done;
- 
-    // Close file 
-    fclose(data.file);
-    data.file = 0;
-	*/
-
-    printf("Done.\n"); fflush(stdout);
+    SpiLog("Done.\n");
 
  
 done:
+	WaitForMidiInit();
 	/*
     Pa_Terminate();
     if( data.ringBufferData )       // Sure it is NULL or valid. 
@@ -875,57 +7932,64 @@ done:
         fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( err ) );
         err = 1;          /* Always return 0 or 1, but no other return codes. */
     }
+    if( selftestfailed ) err = 1;
  
     return err;
 }
  
 int Terminate()
 {
+	static bool terminated = false; //main and the console handler may both get here
+	if(terminated) return 0;
+	terminated = true;
 	////////////////////
 	//terminate portmidi
 	////////////////////
-	if(global_receivemidi)
+	if(global_active)
 	{
 		global_active = false;
-		Pm_Close(global_pPmStreamMIDIIN);
+		for(int i=0; i<global_nummidiinputs; i++) Pm_Close(global_midiinputs[i].stream);
 		Pt_Stop();
 		Pm_Terminate();
 	}
-    err = Pa_CloseStream( stream );
-    if( err != paNoError ) 
-	{
-        fprintf( stderr, "An error occured while using the portaudio stream\n" );
-        fprintf( stderr, "Error number: %d\n", err );
-        fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( err ) );
-        err = 1;          /* Always return 0 or 1, but no other return codes. */
-		return err;
-	}
-    // Stop the thread 
-    err = stopThread(&data);
-    if( err != paNoError )
+	//close the streams and write what is left in the rings
+	PaError finisherr = paNoError;
+	for(int i=0; i<global_numsessions; i++)
 	{
-        fprintf( stderr, "An error occured while using the portaudio stream\n" );
-        fprintf( stderr, "Error number: %d\n", err );
-        fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( err ) );
-        err = 1;          /* Always return 0 or 1, but no other return codes. */
-		return err;
+		PaError sessionerr = FinishSession(global_sessions[i]);
+		if(sessionerr != paNoError) finisherr = sessionerr;
 	}
- 
-    // Close file 
-    fclose(data.file);
-    data.file = 0;
+	SpiControl_Stop();
+    // Stop the threads 
+	stopWriterPool(&global_writerpool);
+	SpiFinalizer_Stop(); //every file written is synced once it returns
+	if(!global_metricspath.empty()) WriteMetricsFile(); //final counts
 
     Pa_Terminate();
-    if( data.ringBufferData )       // Sure it is NULL or valid. 
-        PaUtil_FreeMemory( data.ringBufferData );
+	for(int i=0; i<global_numsessions; i++) FreeSession(global_sessions[i]);
+	global_numsessions = 0;
+	SpiSpill_Free();
 
+	//last drain of the log rings, nothing posts after the streams and threads are gone
+	SpiLog_Stop();
+    if( finisherr != paNoError ) 
+	{
+        fprintf( stderr, "An error occured while using the portaudio stream\n" );
+        fprintf( stderr, "Error number: %d\n", finisherr );
+        fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( finisherr ) );
+		return 1; /* Always return 0 or 1, but no other return codes. */
+	}
 	printf("Exiting!\n"); fflush(stdout);
 
+#ifdef _WIN32
 	int nShowCmd = false;
 	ShellExecuteA(NULL, "open", "end.bat", "", NULL, nShowCmd);
+#endif
 	return 0;
 }
+
  
+#ifdef _WIN32
 //Called by the operating system in a separate thread to handle an app-terminating event. 
 BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
 {
@@ -948,6 +8012,15 @@ BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
     //should only be sent to services. 
     return FALSE;
 }
+#else
+//Only async-signal-safe work here, the main loop sees the flag and terminates
+void SignalHandler(int signum)
+{
+	(void)signum;
+	global_stoprequested = true;
+	SpiEvent_Signal(&global_completionevent); //sem_post is async-signal-safe
+}
+#endif
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1023,12 +8096,13 @@ private void doascii(char c)
         if (inited) {
             if (c == ' ') {
                 PmEvent event;
-                while (Pm_Read(global_pPmStreamMIDIIN, &event, 1)) ;	// flush midi input 
+                for (int i = 0; i < global_nummidiinputs; i++)
+                    while (Pm_Read(global_midiinputs[i].stream, &event, 1)) ;	// flush midi input 
                 printf("...FLUSHED MIDI INPUT\n\n");
             } else showhelp();
         }
     }
-    if (inited) Pm_SetFilter(global_pPmStreamMIDIIN, filter);
+    for (int i = 0; inited && i < global_nummidiinputs; i++) Pm_SetFilter(global_midiinputs[i].stream, filter);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1046,8 +8120,6 @@ private void output(PmMessage data)
     int chan;   // the midi channel of the current event 
     int len;    // used to get constant field width 
 
-    // printf("output data %8x; ", data); 
-
     command = Pm_MessageStatus(data) & MIDI_CODE_MASK;
     chan = Pm_MessageStatus(data) & MIDI_CHN_MASK;
 
@@ -1067,29 +8139,29 @@ private void output(PmMessage data)
             i++; // include the EOX byte in output 
         }
         showbytes(data, i, verbose);
-        if (verbose) printf("System Exclusive\n");
+        if (verbose) SpiLog("System Exclusive\n");
     } else if (command == MIDI_ON_NOTE && Pm_MessageData2(data) != 0) {
         notescount++;
         if (notes) {
             showbytes(data, 3, verbose);
             if (verbose) {
-                printf("NoteOn  Chan %2d Key %3d ", chan, Pm_MessageData1(data));
+                SpiLog("NoteOn  Chan %2d Key %3d ", chan, Pm_MessageData1(data));
                 len = put_pitch(Pm_MessageData1(data));
-                printf(vel_format + len, Pm_MessageData2(data));
+                SpiLog(vel_format + len, Pm_MessageData2(data));
             }
         }
     } else if ((command == MIDI_ON_NOTE // && Pm_MessageData2(data) == 0
                 || command == MIDI_OFF_NOTE) && notes) {
         showbytes(data, 3, verbose);
         if (verbose) {
-            printf("NoteOff Chan %2d Key %3d ", chan, Pm_MessageData1(data));
+            SpiLog("NoteOff Chan %2d Key %3d ", chan, Pm_MessageData1(data));
             len = put_pitch(Pm_MessageData1(data));
-            printf(vel_format + len, Pm_MessageData2(data));
+            SpiLog(vel_format + len, Pm_MessageData2(data));
         }
     } else if (command == MIDI_CH_PROGRAM && pgchanges) {
         showbytes(data, 2, verbose);
         if (verbose) {
-            printf("  ProgChg Chan %2d Prog %2d\n", chan, Pm_MessageData1(data) + 1);
+            SpiLog("  ProgChg Chan %2d Prog %2d\n", chan, Pm_MessageData1(data) + 1);
         }
     } else if (command == MIDI_CTRL) {
                // controls 121 (MIDI_RESET_CONTROLLER) to 127 are channel
@@ -1097,7 +8169,7 @@ private void output(PmMessage data)
         if (Pm_MessageData1(data) < MIDI_ALL_SOUND_OFF) {
             showbytes(data, 3, verbose);
             if (verbose) {
-                printf("CtrlChg Chan %2d Ctrl %2d Val %2d\n",
+                SpiLog("CtrlChg Chan %2d Ctrl %2d Val %2d\n",
                        chan, Pm_MessageData1(data), Pm_MessageData2(data));
             }
         } else if (chmode) { // channel mode 
@@ -1105,33 +8177,33 @@ private void output(PmMessage data)
             if (verbose) {
                 switch (Pm_MessageData1(data)) {
                   case MIDI_ALL_SOUND_OFF:
-                      printf("All Sound Off, Chan %2d\n", chan);
+                      SpiLog("All Sound Off, Chan %2d\n", chan);
                     break;
                   case MIDI_RESET_CONTROLLERS:
-                    printf("Reset All Controllers, Chan %2d\n", chan);
+                    SpiLog("Reset All Controllers, Chan %2d\n", chan);
                     break;
                   case MIDI_LOCAL:
-                    printf("LocCtrl Chan %2d %s\n",
+                    SpiLog("LocCtrl Chan %2d %s\n",
                             chan, Pm_MessageData2(data) ? "On" : "Off");
                     break;
                   case MIDI_ALL_OFF:
-                    printf("All Off Chan %2d\n", chan);
+                    SpiLog("All Off Chan %2d\n", chan);
                     break;
                   case MIDI_OMNI_OFF:
-                    printf("OmniOff Chan %2d\n", chan);
+                    SpiLog("OmniOff Chan %2d\n", chan);
                     break;
                   case MIDI_OMNI_ON:
-                    printf("Omni On Chan %2d\n", chan);
+                    SpiLog("Omni On Chan %2d\n", chan);
                     break;
                   case MIDI_MONO_ON:
-                    printf("Mono On Chan %2d\n", chan);
+                    SpiLog("Mono On Chan %2d\n", chan);
                     if (Pm_MessageData2(data))
-                        printf(" to %d received channels\n", Pm_MessageData2(data));
+                        SpiLog(" to %d received channels\n", Pm_MessageData2(data));
                     else
-                        printf(" to all received channels\n");
+                        SpiLog(" to all received channels\n");
                     break;
                   case MIDI_POLY_ON:
-                    printf("Poly On Chan %2d\n", chan);
+                    SpiLog("Poly On Chan %2d\n", chan);
                     break;
                 }
             }
@@ -1139,69 +8211,69 @@ private void output(PmMessage data)
     } else if (command == MIDI_POLY_TOUCH && bender) {
         showbytes(data, 3, verbose);
         if (verbose) {
-            printf("P.Touch Chan %2d Key %2d ", chan, Pm_MessageData1(data));
+            SpiLog("P.Touch Chan %2d Key %2d ", chan, Pm_MessageData1(data));
             len = put_pitch(Pm_MessageData1(data));
-            printf(val_format + len, Pm_MessageData2(data));
+            SpiLog(val_format + len, Pm_MessageData2(data));
         }
     } else if (command == MIDI_TOUCH && bender) {
         showbytes(data, 2, verbose);
         if (verbose) {
-            printf("  A.Touch Chan %2d Val %2d\n", chan, Pm_MessageData1(data));
+            SpiLog("  A.Touch Chan %2d Val %2d\n", chan, Pm_MessageData1(data));
         }
     } else if (command == MIDI_BEND && bender) {
         showbytes(data, 3, verbose);
         if (verbose) {
-            printf("P.Bend  Chan %2d Val %2d\n", chan,
+            SpiLog("P.Bend  Chan %2d Val %2d\n", chan,
                     (Pm_MessageData1(data) + (Pm_MessageData2(data)<<7)));
         }
     } else if (Pm_MessageStatus(data) == MIDI_SONG_POINTER) {
         showbytes(data, 3, verbose);
         if (verbose) {
-            printf("    Song Position %d\n",
+            SpiLog("    Song Position %d\n",
                     (Pm_MessageData1(data) + (Pm_MessageData2(data)<<7)));
         }
     } else if (Pm_MessageStatus(data) == MIDI_SONG_SELECT) {
         showbytes(data, 2, verbose);
         if (verbose) {
-            printf("    Song Select %d\n", Pm_MessageData1(data));
+            SpiLog("    Song Select %d\n", Pm_MessageData1(data));
         }
     } else if (Pm_MessageStatus(data) == MIDI_TUNE_REQ) {
         showbytes(data, 1, verbose);
         if (verbose) {
-            printf("    Tune Request\n");
+            SpiLog("    Tune Request\n");
         }
     } else if (Pm_MessageStatus(data) == MIDI_Q_FRAME && realdata) {
         showbytes(data, 2, verbose);
         if (verbose) {
-            printf("    Time Code Quarter Frame Type %d Values %d\n",
+            SpiLog("    Time Code Quarter Frame Type %d Values %d\n",
                     (Pm_MessageData1(data) & 0x70) >> 4, Pm_MessageData1(data) & 0xf);
         }
     } else if (Pm_MessageStatus(data) == MIDI_START && realdata) {
         showbytes(data, 1, verbose);
         if (verbose) {
-            printf("    Start\n");
+            SpiLog("    Start\n");
         }
     } else if (Pm_MessageStatus(data) == MIDI_CONTINUE && realdata) {
         showbytes(data, 1, verbose);
         if (verbose) {
-            printf("    Continue\n");
+            SpiLog("    Continue\n");
         }
     } else if (Pm_MessageStatus(data) == MIDI_STOP && realdata) {
         showbytes(data, 1, verbose);
         if (verbose) {
-            printf("    Stop\n");
+            SpiLog("    Stop\n");
         }
     } else if (Pm_MessageStatus(data) == MIDI_SYS_RESET && realdata) {
         showbytes(data, 1, verbose);
         if (verbose) {
-            printf("    System Reset\n");
+            SpiLog("    System Reset\n");
         }
     } else if (Pm_MessageStatus(data) == MIDI_TIME_CLOCK) {
         if (clksencnt) clockcount++;
         else if (realdata) {
             showbytes(data, 1, verbose);
             if (verbose) {
-                printf("    Clock\n");
+                SpiLog("    Clock\n");
             }
         }
     } else if (Pm_MessageStatus(data) == MIDI_ACTIVE_SENSING) {
@@ -1209,11 +8281,10 @@ private void output(PmMessage data)
         else if (realdata) {
             showbytes(data, 1, verbose);
             if (verbose) {
-                printf("    Active Sensing\n");
+                SpiLog("    Active Sensing\n");
             }
         }
     } else showbytes(data, 3, verbose);
-    fflush(stdout);
 }
 
 
@@ -1226,14 +8297,14 @@ private void output(PmMessage data)
 
 private int put_pitch(int p)
 {
-    char result[8];
-    static char *ptos[] = {
+    static const char *ptos[] = {
         "c", "cs", "d", "ef", "e", "f", "fs", "g",
         "gs", "a", "bf", "b"    };
     // note octave correction below 
-    sprintf(result, "%s%d", ptos[p % 12], (p / 12) - 1);
-    printf(result);
-    return strlen(result);
+    int octave = (p / 12) - 1;
+    SpiLog("%s%d", ptos[p % 12], octave);
+    // length of what was logged, octave is -1 to 9
+    return (int)strlen(ptos[p % 12]) + ((octave < 0) ? 2 : 1);
 }
 
 
@@ -1246,26 +8317,26 @@ char nib_to_hex[] = "0123456789ABCDEF";
 
 private void showbytes(PmMessage data, int len, boolean newline)
 {
+    char hex[80];
     int count = 0;
     int i;
 
 //    if (newline) {
-//        putchar('\n');
-//        count++;
+//        hex[count++] = '\n';
 //    } 
     for (i = 0; i < len; i++) {
-        putchar(nib_to_hex[(data >> 4) & 0xF]);
-        putchar(nib_to_hex[data & 0xF]);
-        count += 2;
+        hex[count++] = nib_to_hex[(data >> 4) & 0xF];
+        hex[count++] = nib_to_hex[data & 0xF];
         if (count > 72) {
-            putchar('.');
-            putchar('.');
-            putchar('.');
+            hex[count++] = '.';
+            hex[count++] = '.';
+            hex[count++] = '.';
             break;
         }
         data >>= 8;
     }
-    putchar(' ');
+    hex[count] = '\0';
+    SpiLog("%s ", (const char*)hex);
 }
 
 